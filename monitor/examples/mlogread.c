@@ -0,0 +1,229 @@
+/*
+ *  Copyright (c) 2019-2020, Rice University.
+ *  See LICENSE for details.
+ *
+ *  ----------------------------------------------------------------------
+ *
+ *  Read an event log from libmonitor (MONITOR_LOG=dir, or
+ *  monitor_log_dump(), see monitor.h) and print the first event of
+ *  each type (the startup costs), the totals per type, and the last
+ *  events in the ring.
+ *
+ *  Usage:
+ *    mlogread [-n num] file ...
+ *
+ *  where num is the number of ring events to print (default 20, -1
+ *  for all).
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "monitor.h"
+
+#define DEFAULT_EVENTS  20
+
+static const char * type_name [MONITOR_LOG_NUM_TYPES] = {
+    "none",
+    "first entry",
+    "gotcha init",
+    "begin process",
+    "at main",
+    "end process",
+    "thread create",
+    "begin thread",
+    "end thread",
+    "dlopen",
+    "dlclose",
+};
+
+//----------------------------------------------------------------------
+
+static const char *
+event_name(uint32_t type)
+{
+    return (type < MONITOR_LOG_NUM_TYPES) ? type_name[type] : "unknown";
+}
+
+/*
+ *  Times are nsec, print them as usec relative to base.
+ */
+static void
+print_event(const struct monitor_log_event * ev, uint64_t base)
+{
+    printf("  %12.1f  %10.1f  %-14s  %6d",
+	   ((double) ev->le_time - (double) base) / 1000.0,
+	   (double) ev->le_dur / 1000.0,
+	   event_name(ev->le_type), (int) ev->le_thread);
+
+    if (ev->le_type == MONITOR_LOG_DLOPEN || ev->le_type == MONITOR_LOG_DLCLOSE) {
+	printf("  %p", (void *) (uintptr_t) ev->le_arg);
+    }
+    printf("\n");
+}
+
+/*
+ *  Returns 0 if the header is ours and the file is long enough.
+ */
+static int
+check_header(const struct monitor_log_header * hdr, size_t size, const char * path)
+{
+    size_t need;
+
+    if (strncmp(hdr->lh_magic, MONITOR_LOG_MAGIC, sizeof(hdr->lh_magic)) != 0) {
+	warnx("not a monitor event log: %s", path);
+	return -1;
+    }
+    if (hdr->lh_version != MONITOR_LOG_VERSION
+	|| hdr->lh_header_size < sizeof(*hdr)) {
+	warnx("unknown version %u: %s", hdr->lh_version, path);
+	return -1;
+    }
+
+    need = hdr->lh_header_size
+	+ hdr->lh_num_types * (sizeof(struct monitor_log_total)
+			       + sizeof(struct monitor_log_event))
+	+ hdr->lh_num_events * sizeof(struct monitor_log_event);
+    if (size < need) {
+	warnx("file too short: %s", path);
+	return -1;
+    }
+
+    return 0;
+}
+
+static void
+print_log(const char * buf, const char * path, long num_print)
+{
+    const struct monitor_log_header * hdr = (const struct monitor_log_header *) buf;
+    const struct monitor_log_total * total;
+    const struct monitor_log_event * first;
+    const struct monitor_log_event * event;
+    uint64_t base, num_events, start;
+
+    total = (const struct monitor_log_total *) (buf + hdr->lh_header_size);
+    first = (const struct monitor_log_event *) (total + hdr->lh_num_types);
+    event = first + hdr->lh_num_types;
+    num_events = hdr->lh_num_events;
+
+    // times are relative to first entry, if there is one
+    base = 0;
+    if (hdr->lh_num_types > MONITOR_LOG_FIRST_ENTRY
+	&& first[MONITOR_LOG_FIRST_ENTRY].le_type == MONITOR_LOG_FIRST_ENTRY) {
+	base = first[MONITOR_LOG_FIRST_ENTRY].le_time;
+    }
+
+    printf("file: %s\n", path);
+    printf("pid: %u,  events: %lu,  lost: %lu,  dump at: %.1f usec\n\n",
+	   hdr->lh_pid, (unsigned long) num_events, (unsigned long) hdr->lh_lost,
+	   ((double) hdr->lh_dump_time - (double) base) / 1000.0);
+
+    printf("first events (usec):\n");
+    printf("  %12s  %10s  %-14s  %6s\n", "time", "duration", "event", "thread");
+    for (uint32_t type = 1; type < hdr->lh_num_types; type++) {
+	if (first[type].le_type != MONITOR_LOG_NONE) {
+	    print_event(&first[type], base);
+	}
+    }
+
+    printf("\ntotals (usec):\n");
+    printf("  %-14s  %10s  %12s  %10s  %10s\n",
+	   "event", "count", "total", "mean", "max");
+    for (uint32_t type = 1; type < hdr->lh_num_types; type++) {
+	const struct monitor_log_total * tot = &total[type];
+
+	if (tot->lt_count == 0) {
+	    continue;
+	}
+	printf("  %-14s  %10lu  %12.1f  %10.2f  %10.1f\n",
+	       event_name(type), (unsigned long) tot->lt_count,
+	       (double) tot->lt_total / 1000.0,
+	       (double) tot->lt_total / 1000.0 / (double) tot->lt_count,
+	       (double) tot->lt_max / 1000.0);
+    }
+
+    start = 0;
+    if (num_print >= 0 && (uint64_t) num_print < num_events) {
+	start = num_events - num_print;
+    }
+    if (start < num_events) {
+	printf("\nlast events (usec):\n");
+	printf("  %12s  %10s  %-14s  %6s\n", "time", "duration", "event", "thread");
+	for (uint64_t n = start; n < num_events; n++) {
+	    if (event[n].le_type != MONITOR_LOG_NONE) {
+		print_event(&event[n], base);
+	    }
+	}
+    }
+    printf("\n");
+}
+
+static void
+read_file(const char * path, long num_print)
+{
+    struct stat st;
+    char * buf;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+	warn("unable to open: %s", path);
+	return;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(struct monitor_log_header)) {
+	warnx("file too short: %s", path);
+	close(fd);
+	return;
+    }
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+	warn("mmap failed: %s", path);
+	return;
+    }
+
+    if (check_header((const struct monitor_log_header *) buf, st.st_size, path) == 0) {
+	print_log(buf, path, num_print);
+    }
+
+    munmap(buf, st.st_size);
+}
+
+//----------------------------------------------------------------------
+
+int
+main(int argc, char **argv)
+{
+    long num_print = DEFAULT_EVENTS;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+	switch (c) {
+	case 'n':
+	    num_print = atol(optarg);
+	    break;
+	default:
+	    errx(1, "usage: mlogread [-n num] file ...");
+	}
+    }
+
+    if (optind >= argc) {
+	errx(1, "usage: mlogread [-n num] file ...");
+    }
+
+    for (int i = optind; i < argc; i++) {
+	read_file(argv[i], num_print);
+    }
+
+    return 0;
+}
@@ -51,26 +51,117 @@
  *  where name is 'real' or 'cpu', and period is time in
  *  micro-seconds.
  *
+ *  The name may also be a perf event: cpu-clock, task-clock,
+ *  page-faults, minor-faults, major-faults, context-switches,
+ *  cpu-migrations, or a hardware event (cycles, instructions,
+ *  cache-references, cache-misses, branches, branch-misses,
+ *  bus-cycles, ref-cycles) if the machine and perf_event_paranoid
+ *  allow it.  When built with -DUSE_LIBPFM and -lpfm, any other name
+ *  that libpfm4 knows works too.  For the clock events the period is
+ *  usec, otherwise it's the number of events per sample.
+ *
+ *  Each thread opens its own perf fd at thread begin, user mode only,
+ *  and the kernel signals overflow with PROF_SIGNAL (F_SETSIG) to that
+ *  thread.  By default, the handler takes the pc from the signal
+ *  context, the same as for the timers.
+ *
+ *    export PERF_RING=pages   (power of 2, default 0 = no ring)
+ *
+ *  With a ring, the kernel writes the pc and time of every sample into
+ *  a per-thread mmap buffer of that many pages and only signals when
+ *  it's half full, so the handler copies a batch at a time.  The ring
+ *  is also drained at thread end, but samples for threads still
+ *  running at end of process stay in the kernel.
+ *
+ *  Timer mode:
+ *    export TIMER=periodic|oneshot   (default periodic)
+ *
+ *  A periodic timer re-arms itself, so the handler makes no system
+ *  calls.  If the signal is still pending when the timer expires
+ *  again, the kernel counts an overrun (si_overrun) and the sample
+ *  gets weight 1 + overrun.  A one-shot timer is re-armed at the end
+ *  of every handler, so it can't overrun but drifts by the handler
+ *  time.
+ *
+ *  Sampling mode:
+ *    export SAMPLE_OUTPUT=dir
+ *    export SAMPLE_BUFFER=num      (default 4096)
+ *    export SAMPLE_FLUSH=msec      (default 100, 0 = no flusher)
+ *
+ *  Each thread's handler writes samples into its own ring buffer of
+ *  SAMPLE_BUFFER samples.  A background thread flushes the rings to
+ *  dir/realtime-<pid>.samples when they're half full or every
+ *  SAMPLE_FLUSH msec, and a thread flushes its own ring at thread
+ *  end.  The handler takes no locks.  If a ring is full, the sample
+ *  is dropped and counted.  Exec keeps the pid, so the images after
+ *  exec write realtime-<pid>.1.samples, .2.samples, etc, instead of
+ *  truncating the earlier file.  The file format is in rtsample.h,
+ *  use rtread to read it.
+ *
+ *  Stack mode:
+ *    export STACK=depth               (max frames per sample, default 1)
+ *    export STACK_UNWIND=fp|libunwind
+ *
+ *  With depth > 1, each sample also records up to depth - 1 callers,
+ *  into per-thread frame buffers allocated with the ring.  'fp' walks
+ *  the frame pointer chain, checked against the thread's stack, which
+ *  is fast but only complete for code built with
+ *  -fno-omit-frame-pointer.  'libunwind' uses the unwind tables with
+ *  libunwind's per-thread cache, it needs -DUSE_LIBUNWIND and
+ *  -lunwind (make libreal-unw.so) and is the default when built that
+ *  way.  With a perf ring, the kernel records the user call chain
+ *  instead.
+ *
+ *  Context tree:
+ *    export CCT=nodes
+ *
+ *  Instead of keeping each sample's stack, add it to a per-thread
+ *  calling context tree of up to that many nodes, allocated at thread
+ *  begin, so memory grows with the number of distinct contexts, not
+ *  with run time.  The handler only looks up and adds nodes, no
+ *  malloc.  If a tree fills, samples go to the deepest context that
+ *  fits and are counted as truncated.  At end of process, the trees
+ *  are merged and written to the sample file, and the samples in the
+ *  file are pc only.
+ *
+ *  End of process:
+ *    export END_THREADS=num    (default online cpus, up to 8)
+ *    export END_BUDGET=msec    (default -1 = wait for it)
+ *
+ *  The per-thread summaries and the context tree merge are split over
+ *  up to END_THREADS threads, one per 16 app threads, the trees are
+ *  merged pairwise.  With a budget, the whole reduction and output
+ *  run in a helper thread and the process waits at most that long
+ *  for it.  If it gives up, the sample file header has zero offsets
+ *  and the file is cut short (see rtsample.h).
+ *
+ *  The handler also measures itself: its cost from entry to exit with
+ *  the cycle counter, and how late each interrupt arrives compared to
+ *  when it was requested (in the event's own clock).  The summary
+ *  reports the overhead as a percent of each thread's time and
+ *  percentiles of both.
+ *
  *  ----------------------------------------------------------------------
  *
  *  Todo:
- *    3. support many threads, threads that end before the process,
- *    etc.
- *
  *    5. add alarm in case of deadlock.
- *
- *    6. for pc addrs in .so library, compute file name, load address
- *    and offset.
  */
 
 #define _GNU_SOURCE
 
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
 #include <err.h>
+#include <errno.h>
 #include <error.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -78,72 +169,556 @@
 #include <unistd.h>
 
 #include <pthread.h>
+#include <semaphore.h>
 #include <ucontext.h>
 
+#include <linux/perf_event.h>
+#ifdef USE_LIBPFM
+#include <perfmon/pfmlib_perf_event.h>
+#endif
+#ifdef USE_LIBUNWIND
+#define UNW_LOCAL_ONLY
+#include <libunwind.h>
+#endif
+
 #include "monitor.h"
+#include "rtsample.h"
 
 #define REALTIME_NAME  "REALTIME"
 #define CPUTIME_NAME   "CPUTIME"
+#define PERF_NAME      "PERF"
 #define REALTIME_CLOCK_TYPE  CLOCK_REALTIME
 #define CPUTIME_CLOCK_TYPE   CLOCK_THREAD_CPUTIME_ID
 #define NOTIFY_METHOD   SIGEV_THREAD_ID
 #define PROF_SIGNAL    (SIGRTMIN + 4)
 
-#define MAX_THREADS  550
 #define NUM_SAMPLES   40
+#define DEFAULT_BUFFER  4096
+#define DEFAULT_FLUSH    100
+#define MAX_FILE_SUFFIX  100
+
+// end of process, at most MAX_END_WORKERS by default, and one worker
+// per THREADS_PER_WORKER threads
+#define MAX_END_WORKERS     8
+#define THREADS_PER_WORKER  16
 
 #define DEFAULT_PERIOD  4000
 #define MILLION   1000000
 
 #define MAGIC  0x004ea1004ea1
 
+// log-linear histogram: 8 buckets per power of 2
+#define HIST_SUB_BITS  3
+#define HIST_SUB       (1 << HIST_SUB_BITS)
+#define NUM_HIST       ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/*
+ *  Calling context tree.  Node 0 is the root, a node's parent always
+ *  has a smaller index, and the children of all nodes are in one open
+ *  addressed hash table keyed by (parent, return address) that holds
+ *  node indices (0 for empty, the root is nobody's child).
+ */
+struct cct_node {
+    uintptr_t  addr;
+    long       self;
+    uint32_t   parent;
+};
+
+struct cct {
+    struct cct_node * nodes;
+    uint32_t * hash;
+    long  size;
+    long  used;
+    int   hash_bits;
+};
+
+/*
+ *  Per-thread results from the end of process reduction: times in
+ *  sec, handler cost percentiles (p50, p99) in cycles and lateness
+ *  (p50, p90, p99, max) in nsec.
+ */
+struct thread_sum {
+    double    time;
+    double    handler;
+    uint64_t  cost [2];
+    uint64_t  late [4];
+};
+
+/*
+ *  The sample ring is single producer (the signal handler in the
+ *  owner thread) and single consumer (the flusher or the thread
+ *  itself at thread end, serialized by flush_lock).  head and tail
+ *  only increase, the slot is index & ring_mask.
+ */
 struct thread_info {
     long  magic;
     long  tnum;
     long  count;
+    long  overrun;
     struct sigevent sigev;
     timer_t  timerid;
+    int   timer_gen;
     struct timeval  start;
+    struct timeval  end;
     struct sample_info * sinfo;
+    long  head;
+    long  tail;
+    long  dropped;
+    long  written;
+    int   flush_posted;
+
+    // perf events
+    int   perf_fd;
+    struct perf_event_mmap_page * perf_page;
+    long  perf_lost;
+
+    // stacks, max_callers frames per ring slot
+    void ** frames;
+    long  num_frames;
+    uintptr_t  stack_hi;
+
+    // context tree, preallocated, the handler only adds to it
+    struct cct  cct;
+    long  cct_truncated;
+
+    // self measurement, only written by the owner thread
+    uint64_t  armed_nsec;
+    uint64_t  handler_cycles;
+    uint32_t  cost_hist [NUM_HIST];
+    uint32_t  late_hist [NUM_HIST];
+
+    struct thread_sum  sum;
 };
 
 struct sample_info {
     void *pc;
     long  usec;
+    long  weight;
+    long  depth;
 };
 
-static struct thread_info thread_array[MAX_THREADS];
+/*
+ *  Thread records live in a monitor registry, so they never move and
+ *  there's no limit on threads.  A record is ready once its magic is
+ *  set, which is the last step in mk_thread_info().
+ */
+static struct monitor_registry thread_reg =
+    MONITOR_REGISTRY_INITIALIZER(sizeof(struct thread_info));
 
-static long next_thread = 1;
+static long num_threads = 0;
 
 static struct itimerspec itspec_start;
+static int periodic = 1;
 static struct itimerspec itspec_stop;
 
 static clockid_t clock_type;
 static char *clock_name;
 static long  period;
 
-static pthread_key_t key;
-
 static struct timeval proc_start;
+static uint64_t proc_start_cycles;
+static uint64_t proc_start_nsec;
+static uint64_t period_nsec;
 
 static int at_end_of_process = 0;
 
+// timer generations, 0 is never used
+static int  timer_gen = 0;
+
+// end of process reduction, end_budget is msec, -1 to wait
+static long end_workers = 1;
+static long end_budget = -1;
+static struct timeval end_time;
+static double ns_per_cycle = 1.0;
+static uint64_t all_cost [NUM_HIST];
+static uint64_t all_late [NUM_HIST];
+static sem_t end_sem;
+
+// perf events, perf_pages is the ring size in pages, 0 for no ring
+static int  perf_mode = 0;
+static int  perf_is_clock = 0;
+static long perf_pages = 0;
+static struct perf_event_attr perf_attr;
+
+// stacks, max callers per sample, 0 for pc only
+static int  max_callers = 0;
+static int  stack_fp = 1;
+
+// context tree, cct_size nodes per thread, 0 for none
+static long cct_size = 0;
+static struct cct * merged_cct = NULL;
+
 static int my_pid = 0;
 
+// sampling mode
+static int  sample_mode = 0;
+static long ring_size = 64;
+static long ring_mask = 63;
+static long flush_msec = DEFAULT_FLUSH;
+static int  sample_fd = -1;
+static sem_t flush_sem;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static void * ring_pool = NULL;
+static void * frame_pool = NULL;
+static char * sample_dir = NULL;
+static uint8_t * encode_buf = NULL;
+static size_t encode_size = 0;
+static off_t file_size = 0;
+static off_t thread_off = 0;
+static off_t module_off = 0;
+static long  num_modules = 0;
+
 static void dump_samples(void);
+static void perf_drain(struct thread_info *);
+
+/*
+ *  Our thread info is hung off monitor's per-thread context, which is
+ *  a single TLS load and safe in the signal handler.
+ */
+static struct thread_info *
+get_thread_info(void)
+{
+    struct monitor_thread_info *info = monitor_get_thread_info();
+
+    return (info != NULL) ? (struct thread_info *) info->mti_client_data : NULL;
+}
+
+/*
+ *  Returns the thread record at index, or NULL if it's free or not
+ *  ready.
+ */
+static struct thread_info *
+thread_lookup(long index)
+{
+    struct thread_info *tid = monitor_registry_lookup(&thread_reg, index);
+
+    if (tid == NULL || __atomic_load_n(&tid->magic, __ATOMIC_ACQUIRE) != MAGIC) {
+	return NULL;
+    }
+
+    return tid;
+}
+
+//----------------------------------------------------------------------
+//  Self measurement
+//----------------------------------------------------------------------
+
+/*
+ *  Cycle counter for the handler's cost.  It's converted to nsec at
+ *  the end by comparing it with CLOCK_MONOTONIC over the whole run,
+ *  so we don't need the frequency.
+ */
+static inline uint64_t
+read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+
+#elif defined(__aarch64__)
+    uint64_t val;
+
+    __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (val));
+    return val;
+
+#elif defined(__powerpc64__)
+    uint64_t val;
+
+    __asm__ __volatile__ ("mfspr %0, 268" : "=r" (val));
+    return val;
+
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000000UL * ts.tv_sec + ts.tv_nsec;
+#endif
+}
+
+static inline uint64_t
+read_nsec(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return 1000000000UL * ts.tv_sec + ts.tv_nsec;
+}
+
+static inline int
+hist_index(uint64_t val)
+{
+    if (val < HIST_SUB) {
+	return (int) val;
+    }
+
+    int e = 63 - __builtin_clzl(val);
+
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB
+	+ (int) ((val >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// smallest value in the next bucket
+static uint64_t
+hist_upper(int index)
+{
+    index++;
+    if (index < HIST_SUB) {
+	return index;
+    }
+
+    int e = index / HIST_SUB + HIST_SUB_BITS - 1;
+
+    return (uint64_t) (HIST_SUB + index % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+/*
+ *  Return the value at fraction pct of the histogram, as the upper
+ *  end of its bucket.
+ */
+static uint64_t
+hist_percentile(const uint64_t *hist, double pct)
+{
+    uint64_t total = 0, sum = 0;
+
+    for (int i = 0; i < NUM_HIST; i++) {
+	total += hist[i];
+    }
+    if (total == 0) {
+	return 0;
+    }
+
+    uint64_t want = (uint64_t) (pct * total);
+
+    if (want >= total) {
+	want = total - 1;
+    }
+    for (int i = 0; i < NUM_HIST; i++) {
+	sum += hist[i];
+	if (sum > want) {
+	    return hist_upper(i);
+	}
+    }
+
+    return hist_upper(NUM_HIST - 1);
+}
+
+//----------------------------------------------------------------------
+//  Perf event functions
+//----------------------------------------------------------------------
+
+#define DEFAULT_COUNT  1000000
+
+struct perf_name {
+    const char * name;
+    uint32_t  type;
+    uint64_t  config;
+    long      period;
+    int       kernel;
+};
+
+/*
+ *  The generic perf events, so we don't need libpfm for the common
+ *  cases.  Default periods are usec for the clocks and event counts
+ *  for the rest.  Context switches and migrations only happen in the
+ *  kernel, so they count kernel mode (which perf_event_paranoid may
+ *  not allow) and a ring records kernel pcs for them.
+ */
+static struct perf_name perf_names[] = {
+    { "cpu-clock",        PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK,  DEFAULT_PERIOD },
+    { "task-clock",       PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, DEFAULT_PERIOD },
+    { "page-faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS,     100 },
+    { "faults",           PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS,     100 },
+    { "minor-faults",     PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN, 100 },
+    { "major-faults",     PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ,   1 },
+    { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, 10, 1 },
+    { "cs",               PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, 10, 1 },
+    { "cpu-migrations",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS,    1, 1 },
+    { "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,   10000000 },
+    { "instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 10000000 },
+    { "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, DEFAULT_COUNT },
+    { "cache-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,  100000 },
+    { "branches",         PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS, DEFAULT_COUNT },
+    { "branch-instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS, DEFAULT_COUNT },
+    { "branch-misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 100000 },
+    { "bus-cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES,  DEFAULT_COUNT },
+    { "ref-cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES, 10000000 },
+    { NULL, 0, 0, 0 },
+};
+
+static long page_size = 4096;
+
+/*
+ *  Look up the event name in str (up to '@') and fill in the type and
+ *  config of perf_attr, the default period and clock_name.  Returns 1
+ *  if found, else 0.
+ */
+static int
+perf_lookup(const char *str)
+{
+    size_t len = strcspn(str, "@");
+    char * name = strndup(str, len);
+
+    if (name == NULL) {
+	err(1, "strndup failed");
+    }
+
+    memset(&perf_attr, 0, sizeof(perf_attr));
+
+    for (struct perf_name *pn = perf_names; pn->name != NULL; pn++) {
+	if (strcasecmp(name, pn->name) == 0) {
+	    perf_attr.type = pn->type;
+	    perf_attr.config = pn->config;
+	    perf_is_clock = (pn->type == PERF_TYPE_SOFTWARE
+			     && (pn->config == PERF_COUNT_SW_CPU_CLOCK
+				 || pn->config == PERF_COUNT_SW_TASK_CLOCK));
+	    perf_attr.exclude_kernel = ! pn->kernel;
+	    period = pn->period;
+	    clock_name = name;
+	    return 1;
+	}
+    }
+
+#ifdef USE_LIBPFM
+    pfm_perf_encode_arg_t arg;
+
+    if (pfm_initialize() != PFM_SUCCESS) {
+	warnx("pfm_initialize failed");
+	free(name);
+	return 0;
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    arg.attr = &perf_attr;
+    arg.size = sizeof(arg);
+
+    if (pfm_get_os_event_encoding(name, PFM_PLM3, PFM_OS_PERF_EVENT, &arg)
+	== PFM_SUCCESS) {
+	perf_attr.exclude_kernel = 1;
+	period = DEFAULT_COUNT;
+	clock_name = name;
+	return 1;
+    }
+#endif
+
+    free(name);
+    return 0;
+}
+
+/*
+ *  Fill in the rest of perf_attr once the period is known.  Without a
+ *  ring, the kernel signals every overflow.  With a ring, it records
+ *  the pc and time and signals when the ring is half full.
+ */
+static void
+perf_init_attr(void)
+{
+    perf_attr.size = sizeof(perf_attr);
+    perf_attr.sample_period = perf_is_clock ? 1000UL * period : period;
+    perf_attr.disabled = 1;
+    perf_attr.exclude_hv = 1;
+
+    if (perf_pages > 0) {
+	perf_attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TIME;
+	perf_attr.use_clockid = 1;
+	perf_attr.clockid = CLOCK_MONOTONIC;
+	perf_attr.watermark = 1;
+	perf_attr.wakeup_watermark = perf_pages * page_size / 2;
+
+	if (max_callers > 0) {
+	    perf_attr.sample_type |= PERF_SAMPLE_CALLCHAIN;
+	    perf_attr.sample_max_stack = max_callers + 1;
+	    perf_attr.exclude_callchain_kernel = 1;
+	}
+    }
+    else {
+	perf_attr.wakeup_events = 1;
+    }
+}
+
+/*
+ *  Open the perf event for the calling thread and send its overflow
+ *  signals to this thread.
+ */
+static void
+perf_open(struct thread_info *tid)
+{
+    struct f_owner_ex owner;
+
+    int fd = syscall(SYS_perf_event_open, &perf_attr, 0, -1, -1, 0);
+
+    if (fd < 0) {
+	if (errno == ENOENT || errno == EOPNOTSUPP || errno == ENODEV) {
+	    errx(1, "perf event %s is not supported on this machine", clock_name);
+	}
+	if (errno == EACCES || errno == EPERM) {
+	    err(1, "perf_event_open for %s not allowed, check "
+		"/proc/sys/kernel/perf_event_paranoid", clock_name);
+	}
+	err(1, "perf_event_open for %s failed", clock_name);
+    }
+
+    if (perf_pages > 0) {
+	void *buf = mmap(NULL, (1 + perf_pages) * page_size,
+			 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (buf == MAP_FAILED) {
+	    err(1, "mmap of perf ring failed");
+	}
+	tid->perf_page = (struct perf_event_mmap_page *) buf;
+    }
+
+    owner.type = F_OWNER_TID;
+    owner.pid = syscall(SYS_gettid);
+
+    if (fcntl(fd, F_SETFL, O_ASYNC | O_NONBLOCK) != 0
+	|| fcntl(fd, F_SETSIG, PROF_SIGNAL) != 0
+	|| fcntl(fd, F_SETOWN_EX, &owner) != 0) {
+	err(1, "fcntl on perf fd failed");
+    }
+
+    tid->perf_fd = fd;
+}
+
+static void
+perf_close(struct thread_info *tid)
+{
+    if (tid->perf_page != NULL) {
+	munmap(tid->perf_page, (1 + perf_pages) * page_size);
+	tid->perf_page = NULL;
+    }
+    if (tid->perf_fd >= 0) {
+	close(tid->perf_fd);
+	tid->perf_fd = -1;
+    }
+}
 
 //----------------------------------------------------------------------
 //  POSIX timer functions
 //----------------------------------------------------------------------
 
+/*
+ *  The timer functions also cover the perf events, the fd plays the
+ *  part of the timer.
+ */
 static void
 create_timer(struct thread_info *tid)
 {
+    if (perf_mode) {
+	perf_open(tid);
+	return;
+    }
+
+    do {
+	tid->timer_gen = __sync_add_and_fetch(&timer_gen, 1);
+    } while (tid->timer_gen == 0);
+
     memset(&tid->sigev, 0, sizeof(tid->sigev));
     tid->sigev.sigev_notify = NOTIFY_METHOD;
     tid->sigev.sigev_signo = PROF_SIGNAL;
-    tid->sigev.sigev_value.sival_ptr = &tid->timerid;
+    tid->sigev.sigev_value.sival_int = tid->timer_gen;
     tid->sigev._sigev_un._tid = syscall(SYS_gettid);
 
     if (timer_create(clock_type, &tid->sigev, &tid->timerid) != 0) {
@@ -154,132 +729,1141 @@ create_timer(struct thread_info *tid)
 static void
 start_timer(struct thread_info *tid)
 {
+    if (perf_mode) {
+	if (ioctl(tid->perf_fd, PERF_EVENT_IOC_ENABLE, 0) != 0) {
+	    err(1, "perf event enable failed");
+	}
+	return;
+    }
+
+    tid->armed_nsec = read_nsec(clock_type);
+
     if (timer_settime(tid->timerid, 0, &itspec_start, NULL) != 0) {
 	err(1, "timer start failed");
     }
 }
 
+/*
+ *  For a perf ring, also copy out what's left, with the signal
+ *  blocked so the handler can't drain at the same time.  It stays
+ *  blocked, delete comes next anyway.
+ */
 static void
 stop_timer(struct thread_info *tid)
 {
+    if (perf_mode) {
+	sigset_t set;
+
+	if (ioctl(tid->perf_fd, PERF_EVENT_IOC_DISABLE, 0) != 0) {
+	    err(1, "perf event disable failed");
+	}
+	if (tid->perf_page != NULL) {
+	    sigemptyset(&set);
+	    sigaddset(&set, PROF_SIGNAL);
+	    monitor_real_pthread_sigmask(SIG_BLOCK, &set, NULL);
+	    perf_drain(tid);
+	}
+	return;
+    }
+
     if (timer_settime(tid->timerid, 0, &itspec_stop, NULL) != 0) {
 	err(1, "timer stop failed");
     }
 }
 
+/*
+ *  Delete also disarms the timer, so there's no need to stop it
+ *  first.  A signal that's already queued carries the old generation
+ *  and the handler ignores it, so we don't wait for it either.  A perf
+ *  event is stopped first to drain its ring.
+ */
 static void
 delete_timer(struct thread_info *tid)
 {
+    if (perf_mode) {
+	stop_timer(tid);
+	perf_close(tid);
+	return;
+    }
+
+    __atomic_store_n(&tid->timer_gen, 0, __ATOMIC_RELAXED);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
     if (timer_delete(tid->timerid) != 0) {
 	warn("timer delete failed");
     }
-}
+}
+
+//----------------------------------------------------------------------
+//  Stack unwinding
+//----------------------------------------------------------------------
+
+/*
+ *  Walk the frame pointer chain from the signal context into frames
+ *  and return the number of callers.  A frame must lie between the
+ *  interrupted sp and the top of the thread's stack and move up, so
+ *  code without frame pointers ends the walk early instead of
+ *  faulting.  If the leaf hasn't pushed its frame yet, its caller is
+ *  missed, the usual limit of frame pointers.
+ */
+static int
+unwind_fp(struct thread_info *tid, void *context, void **frames)
+{
+    mcontext_t *mcontext = &((ucontext_t *) context)->uc_mcontext;
+    uintptr_t fp, sp;
+    int n = 0;
+
+#if defined(__x86_64__)
+    fp = mcontext->gregs[REG_RBP];
+    sp = mcontext->gregs[REG_RSP];
+#elif defined(__aarch64__)
+    fp = mcontext->regs[29];
+    sp = mcontext->sp;
+#else
+    return 0;
+#endif
+
+    while (n < max_callers) {
+	if (fp < sp || fp + 2 * sizeof(uintptr_t) > tid->stack_hi
+	    || (fp & (sizeof(uintptr_t) - 1)) != 0) {
+	    break;
+	}
+
+	uintptr_t *frame = (uintptr_t *) fp;
+
+	if (frame[1] == 0) {
+	    break;
+	}
+	frames[n++] = (void *) frame[1];
+
+	if (frame[0] <= fp) {
+	    break;
+	}
+	fp = frame[0];
+    }
+
+    return n;
+}
+
+#ifdef USE_LIBUNWIND
+/*
+ *  Unwind with libunwind from the signal context, which is a
+ *  ucontext_t on Linux.  The first step goes from the pc to its
+ *  caller.
+ */
+static int
+unwind_libunwind(void *context, void **frames)
+{
+    unw_cursor_t cursor;
+    unw_word_t ip;
+    int n = 0;
+
+    if (unw_init_local2(&cursor, (unw_context_t *) context,
+			UNW_INIT_SIGNAL_FRAME) < 0) {
+	return 0;
+    }
+
+    while (n < max_callers && unw_step(&cursor) > 0) {
+	if (unw_get_reg(&cursor, UNW_REG_IP, &ip) < 0 || ip == 0) {
+	    break;
+	}
+	frames[n++] = (void *) ip;
+    }
+
+    return n;
+}
+#endif
+
+//----------------------------------------------------------------------
+//  Calling context tree
+//----------------------------------------------------------------------
+
+static inline uint32_t
+cct_hash(uint32_t parent, uintptr_t addr, int bits)
+{
+    uint64_t key = (addr ^ ((uint64_t) parent << 40)) * 0x9e3779b97f4a7c15UL;
+
+    return (uint32_t) (key >> (64 - bits));
+}
+
+/*
+ *  Allocate a tree for size nodes, including the root.  The hash
+ *  table is at least twice that, so it never fills and probes stay
+ *  short.  Pages of the node array are only touched as they're used.
+ */
+static void
+cct_init(struct cct *tree, long size)
+{
+    for (tree->hash_bits = 4; (1L << tree->hash_bits) < 2 * size; tree->hash_bits++)
+	;
+
+    tree->nodes = (struct cct_node *) malloc(size * sizeof(struct cct_node));
+    tree->hash = (uint32_t *) calloc(1L << tree->hash_bits, sizeof(uint32_t));
+    if (tree->nodes == NULL || tree->hash == NULL) {
+	err(1, "malloc for context tree failed");
+    }
+
+    tree->size = size;
+    tree->used = 1;
+    memset(&tree->nodes[0], 0, sizeof(struct cct_node));
+}
+
+/*
+ *  Return the index of parent's child for addr, adding it if there's
+ *  room, or -1 if the tree is full.  No allocation, safe in the
+ *  handler.
+ */
+static long
+cct_child(struct cct *tree, uint32_t parent, uintptr_t addr)
+{
+    uint32_t mask = (1U << tree->hash_bits) - 1;
+    uint32_t h = cct_hash(parent, addr, tree->hash_bits);
+
+    for (; tree->hash[h] != 0; h = (h + 1) & mask) {
+	struct cct_node *node = &tree->nodes[tree->hash[h]];
+
+	if (node->parent == parent && node->addr == addr) {
+	    return tree->hash[h];
+	}
+    }
+
+    if (tree->used >= tree->size) {
+	return -1;
+    }
+
+    long index = tree->used;
+    struct cct_node *node = &tree->nodes[index];
+
+    node->addr = addr;
+    node->self = 0;
+    node->parent = parent;
+    tree->hash[h] = index;
+    __atomic_store_n(&tree->used, index + 1, __ATOMIC_RELEASE);
+
+    return index;
+}
+
+/*
+ *  Add a sample from the outermost caller down to the pc.  If the
+ *  tree is full, the weight goes to the deepest context that fits and
+ *  we return 1.
+ */
+static int
+cct_add(struct cct *tree, void *pc, void **frames, int depth, long weight)
+{
+    long node = 0;
+
+    for (int k = depth - 1; k >= -1; k--) {
+	uintptr_t addr = (k >= 0) ? (uintptr_t) frames[k] : (uintptr_t) pc;
+	long child = cct_child(tree, node, addr);
+
+	if (child < 0) {
+	    tree->nodes[node].self += weight;
+	    return 1;
+	}
+	node = child;
+    }
+    tree->nodes[node].self += weight;
+
+    return 0;
+}
+
+//----------------------------------------------------------------------
+//  Interrupt and analysis functions
+//----------------------------------------------------------------------
+
+/*
+ *  Return the thread's next ring slot, or -1 if the ring is full and
+ *  the sample is dropped.  The caller fills in the slot (and its
+ *  frames) and then publishes it with commit_sample().
+ */
+static long
+next_slot(struct thread_info *tid)
+{
+    tid->count++;
+
+    long head = tid->head;
+
+    if (sample_mode) {
+	long used = head - __atomic_load_n(&tid->tail, __ATOMIC_ACQUIRE);
+
+	if (used >= ring_size) {
+	    tid->dropped++;
+	    return -1;
+	}
+	// wake the flusher at half full, sem_post is signal safe
+	if (used >= ring_size / 2 && ! tid->flush_posted && flush_msec > 0) {
+	    tid->flush_posted = 1;
+	    sem_post(&flush_sem);
+	}
+    }
+
+    return head & ring_mask;
+}
+
+static inline void **
+slot_frames(struct thread_info *tid, long slot)
+{
+    return tid->frames + slot * max_callers;
+}
+
+/*
+ *  Where to unwind the stack for a sample in slot: the slot's own
+ *  frames, or with a context tree, one scratch buffer (the tree keeps
+ *  the stacks).  NULL if there's nowhere to put it.
+ */
+static inline void **
+sample_frames(struct thread_info *tid, long slot)
+{
+    if (max_callers == 0) {
+	return NULL;
+    }
+    if (cct_size > 0) {
+	return tid->frames;
+    }
+
+    return (slot >= 0) ? slot_frames(tid, slot) : NULL;
+}
+
+/*
+ *  Add a sample to the context tree and fill in and publish its ring
+ *  slot, if it has one.
+ */
+static void
+store_sample(struct thread_info *tid, long slot, void *pc, long usec,
+	     long weight, void **frames, int depth)
+{
+    tid->num_frames += depth;
+
+    if (cct_size > 0) {
+	tid->cct_truncated += cct_add(&tid->cct, pc, frames, depth, weight);
+	depth = 0;
+    }
+
+    if (slot < 0) {
+	return;
+    }
+
+    struct sample_info *si = &tid->sinfo[slot];
+
+    si->pc = pc;
+    si->usec = usec;
+    si->weight = weight;
+    si->depth = depth;
+
+    __atomic_store_n(&tid->head, tid->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *  Sample the pc, and maybe the stack, from the signal context at the
+ *  current time.
+ */
+static void
+do_sample(struct thread_info *tid, void *context, long weight)
+{
+    ucontext_t *ucontext = (ucontext_t *) context;
+    mcontext_t *mcontext = &(ucontext->uc_mcontext);
+    struct timeval now;
+    void *pc = NULL;
+
+    gettimeofday(&now, NULL);
+
+    long usec = MILLION * (now.tv_sec - proc_start.tv_sec)
+	+ (now.tv_usec - proc_start.tv_usec);
+
+#if defined(__x86_64__)
+#ifndef REG_RIP
+#define REG_RIP  16
+#endif
+    pc = (void *) mcontext->gregs[REG_RIP];
+
+#elif defined(__powerpc64__)
+#ifndef PPC_REG_PC
+#define PPC_REG_PC  32
+#endif
+    pc = (void *) mcontext->gp_regs[PPC_REG_PC];
+
+#elif defined(__aarch64__)
+    pc = (void *) mcontext->pc;
+
+#else
+#error architecture not supported
+#endif
+
+    long slot = next_slot(tid);
+    void **frames = sample_frames(tid, slot);
+    int depth = 0;
+
+    if (frames != NULL) {
+#ifdef USE_LIBUNWIND
+	if (! stack_fp) {
+	    depth = unwind_libunwind(context, frames);
+	}
+	else
+#endif
+	depth = unwind_fp(tid, context, frames);
+    }
+
+    store_sample(tid, slot, pc, usec, weight, frames, depth);
+}
+
+/*
+ *  Copy the samples from the kernel's perf ring into ours and give
+ *  the space back.  The data area is a power of 2 and records are
+ *  8-byte aligned, so a record may wrap around the end, but no single
+ *  u64 does.  The times are CLOCK_MONOTONIC.
+ */
+static void
+perf_drain(struct thread_info *tid)
+{
+    struct perf_event_mmap_page *page = tid->perf_page;
+
+    if (page == NULL) {
+	return;
+    }
+
+    uint64_t *data = (uint64_t *) ((char *) page + page_size);
+    uint64_t mask = perf_pages * page_size / sizeof(uint64_t) - 1;
+    uint64_t head = __atomic_load_n(&page->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = page->data_tail;
+
+    while (tail < head) {
+	struct perf_event_header hdr;
+	uint64_t pos = tail / sizeof(uint64_t);
+	uint64_t word = data[pos & mask];
+
+	memcpy(&hdr, &word, sizeof(hdr));
+	if (hdr.size == 0) {
+	    break;
+	}
+
+	if (hdr.type == PERF_RECORD_SAMPLE) {
+	    uint64_t ip = data[(pos + 1) & mask];
+	    int64_t nsec = data[(pos + 2) & mask] - proc_start_nsec;
+	    long slot = next_slot(tid);
+	    void **frames = sample_frames(tid, slot);
+	    int depth = 0;
+
+	    // the call chain starts with context markers and the pc
+	    if (frames != NULL) {
+		uint64_t nr = data[(pos + 3) & mask];
+		int seen_pc = 0;
+
+		for (uint64_t k = 0; k < nr && depth < max_callers; k++) {
+		    uint64_t addr = data[(pos + 4 + k) & mask];
+
+		    if (addr >= PERF_CONTEXT_MAX) {
+			continue;
+		    }
+		    if (! seen_pc) {
+			seen_pc = 1;
+			if (addr == ip) {
+			    continue;
+			}
+		    }
+		    frames[depth++] = (void *) addr;
+		}
+	    }
+	    store_sample(tid, slot, (void *) ip, nsec / 1000, 1, frames, depth);
+	}
+	else if (hdr.type == PERF_RECORD_LOST) {
+	    tid->perf_lost += data[(pos + 2) & mask];
+	}
+	tail += hdr.size;
+    }
+
+    __atomic_store_n(&page->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+//----------------------------------------------------------------------
+//  Sample file functions
+//----------------------------------------------------------------------
+
+/*
+ *  See rtsample.h for the file format.  Chunks are encoded in the
+ *  flusher (or at thread end) into encode_buf under flush_lock, never
+ *  in the handler.
+ */
+static void
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+	ssize_t ret = write(fd, p, len);
+
+	if (ret < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    warn("write to sample file failed");
+	    return;
+	}
+	p += ret;
+	len -= ret;
+    }
+}
+
+static void
+write_header(void)
+{
+    struct rts_header hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RTS_MAGIC, sizeof(hdr.magic));
+    hdr.version = RTS_VERSION;
+    hdr.header_size = sizeof(hdr);
+    hdr.pid = my_pid;
+    hdr.clock = perf_mode ? RTS_CLOCK_PERF
+	: (clock_type == CPUTIME_CLOCK_TYPE) ? RTS_CLOCK_CPU : RTS_CLOCK_REAL;
+    hdr.period = period;
+    hdr.start_sec = proc_start.tv_sec;
+    hdr.start_usec = proc_start.tv_usec;
+    hdr.thread_off = thread_off;
+    hdr.thread_num = num_threads;
+    hdr.module_off = module_off;
+    hdr.module_num = num_modules;
+
+    if (pwrite(sample_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+	warn("write of sample file header failed");
+    }
+}
+
+static void
+open_sample_file(const char *dir)
+{
+    char path[PATH_MAX];
+    int n;
+
+    snprintf(path, sizeof(path), "%s/realtime-%d.samples", dir, my_pid);
+    sample_fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+    for (n = 1; sample_fd < 0 && errno == EEXIST && n < MAX_FILE_SUFFIX; n++) {
+	snprintf(path, sizeof(path), "%s/realtime-%d.%d.samples", dir, my_pid, n);
+	sample_fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    }
+    if (sample_fd < 0) {
+	err(1, "unable to open sample file: %s", path);
+    }
+
+    // room for a full ring plus the chunk header
+    encode_size = ((4 + max_callers) * ring_size + 5) * RTS_VARINT_MAX;
+    encode_buf = (uint8_t *) malloc(encode_size);
+    if (encode_buf == NULL) {
+	err(1, "malloc for encode buffer failed");
+    }
+
+    // pwrite() doesn't move the file offset
+    write_header();
+    file_size = sizeof(struct rts_header);
+    lseek(sample_fd, file_size, SEEK_SET);
+}
+
+/*
+ *  In sampling mode, a thread's ring and frame buffer are done at
+ *  thread end.  They go on a free list, linked through their first
+ *  word, for the next new thread, so short-lived threads don't call
+ *  malloc (or mmap, for big rings) and free every time.
+ */
+static void *
+pool_get(void **pool)
+{
+    void *buf;
+
+    pthread_mutex_lock(&pool_lock);
+    buf = *pool;
+    if (buf != NULL) {
+	*pool = *(void **) buf;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    return buf;
+}
+
+static void
+pool_put(void **pool, void *buf)
+{
+    if (buf == NULL) {
+	return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    *(void **) buf = *pool;
+    *pool = buf;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ *  Encode and write the samples in one thread's ring as one chunk.
+ *  Caller holds flush_lock.
+ */
+static void
+flush_ring(struct thread_info *tid)
+{
+    uint8_t hdr[5 * RTS_VARINT_MAX];
+    uint8_t *p, *q;
+
+    if (sample_fd < 0 || tid->sinfo == NULL) {
+	return;
+    }
+
+    long head = __atomic_load_n(&tid->head, __ATOMIC_ACQUIRE);
+    long tail = tid->tail;
+
+    if (head == tail) {
+	return;
+    }
+
+    long base = tid->sinfo[tail & ring_mask].usec;
+    long last_usec = base;
+    uintptr_t last_pc = 0;
+
+    p = encode_buf;
+    for (long j = tail; j < head; j++) {
+	struct sample_info *si = &tid->sinfo[j & ring_mask];
+
+	p = rts_put_varint(p, (rts_zigzag(si->usec - last_usec) << 2)
+			   | ((si->weight > 1) ? RTS_FLAG_WEIGHT : 0)
+			   | ((si->depth > 0) ? RTS_FLAG_STACK : 0));
+	p = rts_put_varint(p, rts_zigzag((uintptr_t) si->pc - last_pc));
+	if (si->weight > 1) {
+	    p = rts_put_varint(p, si->weight);
+	}
+	if (si->depth > 0) {
+	    void **frames = slot_frames(tid, j & ring_mask);
+	    uintptr_t last = (uintptr_t) si->pc;
+
+	    p = rts_put_varint(p, si->depth);
+	    for (long k = 0; k < si->depth; k++) {
+		p = rts_put_varint(p, rts_zigzag((uintptr_t) frames[k] - last));
+		last = (uintptr_t) frames[k];
+	    }
+	}
+	last_usec = si->usec;
+	last_pc = (uintptr_t) si->pc;
+    }
+
+    // the samples are copied, the handler can reuse the slots
+    tid->flush_posted = 0;
+    __atomic_store_n(&tid->tail, head, __ATOMIC_RELEASE);
+
+    q = hdr;
+    q = rts_put_varint(q, RTS_TAG_CHUNK);
+    q = rts_put_varint(q, tid->tnum);
+    q = rts_put_varint(q, head - tail);
+    q = rts_put_varint(q, (p - encode_buf) + rts_varint_len(base));
+    q = rts_put_varint(q, base);
+
+    write_all(sample_fd, hdr, q - hdr);
+    write_all(sample_fd, encode_buf, p - encode_buf);
+    file_size += (q - hdr) + (p - encode_buf);
+
+    tid->written += head - tail;
+}
+
+/*
+ *  Write the merged context tree as one record in the chunk stream.
+ *  Caller holds flush_lock.
+ */
+static void
+write_cct(void)
+{
+    uint8_t hdr[3 * RTS_VARINT_MAX];
+    uint8_t *buf, *p, *q;
+
+    if (merged_cct == NULL || merged_cct->used <= 1) {
+	return;
+    }
+
+    buf = (uint8_t *) malloc(3 * merged_cct->used * RTS_VARINT_MAX);
+    if (buf == NULL) {
+	warn("malloc for context tree record failed");
+	return;
+    }
+
+    p = buf;
+    for (long i = 1; i < merged_cct->used; i++) {
+	struct cct_node *node = &merged_cct->nodes[i];
+
+	p = rts_put_varint(p, node->parent);
+	p = rts_put_varint(p, rts_zigzag(node->addr
+					  - merged_cct->nodes[node->parent].addr));
+	p = rts_put_varint(p, node->self);
+    }
+
+    q = hdr;
+    q = rts_put_varint(q, RTS_TAG_CCT);
+    q = rts_put_varint(q, merged_cct->used - 1);
+    q = rts_put_varint(q, p - buf);
+
+    write_all(sample_fd, hdr, q - hdr);
+    write_all(sample_fd, buf, p - buf);
+    file_size += (q - hdr) + (p - buf);
+
+    free(buf);
+}
+
+/*
+ *  Write the thread table and monitor's load map at end of process
+ *  and fill in their offsets in the header.  Caller holds flush_lock.
+ */
+static void
+write_tables(void)
+{
+    uint8_t buf[PATH_MAX + 5 * RTS_VARINT_MAX];
+    uint8_t *p;
+
+    thread_off = file_size;
+    for (long i = 0; i < monitor_registry_size(&thread_reg); i++) {
+	struct thread_info *tid = thread_lookup(i);
+
+	if (tid == NULL) {
+	    continue;
+	}
+
+	long start = MILLION * (tid->start.tv_sec - proc_start.tv_sec)
+	    + (tid->start.tv_usec - proc_start.tv_usec);
+
+	p = buf;
+	p = rts_put_varint(p, tid->tnum);
+	p = rts_put_varint(p, start);
+	p = rts_put_varint(p, tid->count);
+	p = rts_put_varint(p, tid->written);
+	p = rts_put_varint(p, tid->dropped);
+	write_all(sample_fd, buf, p - buf);
+	file_size += p - buf;
+    }
+
+    // the load map from monitor, vaddr in the file is pc - load addr
+    long num = monitor_get_load_map(NULL, 0);
+    struct monitor_module *mods = malloc((num + 1) * sizeof(*mods));
+
+    module_off = file_size;
+    if (mods == NULL) {
+	module_off = 0;
+	return;
+    }
+    num = monitor_get_load_map(mods, num);
+
+    for (long i = 0; i < num; i++) {
+	uintptr_t start = (uintptr_t) mods[i].mm_start;
+	uintptr_t end = (uintptr_t) mods[i].mm_end;
+	size_t plen = strnlen(mods[i].mm_name, PATH_MAX);
+
+	p = buf;
+	p = rts_put_varint(p, start);
+	p = rts_put_varint(p, end - start);
+	p = rts_put_varint(p, start - mods[i].mm_load_addr);
+	p = rts_put_varint(p, plen);
+	memcpy(p, mods[i].mm_name, plen);
+	p += plen;
+	write_all(sample_fd, buf, p - buf);
+	file_size += p - buf;
+	num_modules++;
+    }
+    free(mods);
+}
+
+static void
+flush_all(void)
+{
+    pthread_mutex_lock(&flush_lock);
+
+    for (long i = 0; i < monitor_registry_size(&thread_reg); i++) {
+	struct thread_info *tid = thread_lookup(i);
+
+	if (tid != NULL) {
+	    flush_ring(tid);
+	}
+    }
+
+    pthread_mutex_unlock(&flush_lock);
+}
+
+/*
+ *  The background flusher wakes up when some ring is half full, or
+ *  else every flush_msec, until end of process.
+ */
+static void *
+flusher_thread(void *arg)
+{
+    struct timespec ts;
+
+    for (;;) {
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += flush_msec / 1000;
+	ts.tv_nsec += 1000000 * (flush_msec % 1000);
+	if (ts.tv_nsec >= 1000000000) {
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000;
+	}
+
+	sem_timedwait(&flush_sem, &ts);
+
+	// end process flushes for the last time, and if main called
+	// pthread_exit, the process doesn't exit until we do
+	if (at_end_of_process) {
+	    break;
+	}
+	flush_all();
+    }
+
+    return NULL;
+}
+
+/*
+ *  Start the flusher.  It's our thread, not the app's, so monitor
+ *  doesn't report it and we don't profile it.
+ */
+static void
+start_flusher(void)
+{
+    pthread_t td;
+    int ret;
+
+    if (sem_init(&flush_sem, 0, 0) != 0) {
+	err(1, "sem_init failed");
+    }
+
+    monitor_disable_new_threads();
+    ret = pthread_create(&td, NULL, flusher_thread, NULL);
+    monitor_enable_new_threads();
+
+    if (ret != 0) {
+	err(1, "unable to create flusher thread");
+    }
+}
+
+//----------------------------------------------------------------------
+//  Signal handler functions
+//----------------------------------------------------------------------
+
+static int
+my_handler(int sig, siginfo_t *info, void *context)
+{
+    uint64_t entry = read_cycles();
+
+    if (at_end_of_process) {
+	return 0;
+    }
+
+    struct thread_info *tid = get_thread_info();
+
+    if (tid == NULL) {
+	//
+	// a signal left in the queue after the thread's timer was
+	// deleted at thread end
+	//
+	return 0;
+    }
+    else if (tid->magic != MAGIC) {
+	//
+	// internal corruption, should not happen
+	//
+	at_end_of_process = 1;
+	warnx("thread info bad magic");
+	dump_samples();
+	abort();
+    }
+
+    // same, but before the thread info is cleared
+    if (! perf_mode && info->si_code == SI_TIMER
+	&& info->si_value.sival_int != tid->timer_gen) {
+	return 0;
+    }
+
+    // how late this interrupt is, in the event's clock, from the
+    // first expiration it stands for (perf events have no deadline)
+    if (! perf_mode) {
+	int64_t late = read_nsec(clock_type) - tid->armed_nsec - period_nsec;
+
+	tid->late_hist[hist_index((late > 0) ? late : 0)]++;
+    }
+
+    if (perf_mode) {
+	if (tid->perf_page != NULL) {
+	    perf_drain(tid);
+	}
+	else {
+	    do_sample(tid, context, 1);
+	}
+    }
+    else if (periodic) {
+	long overrun = (info->si_overrun > 0) ? info->si_overrun : 0;
+
+	tid->overrun += overrun;
+	tid->armed_nsec += (1 + overrun) * period_nsec;
+	do_sample(tid, context, 1 + overrun);
+    }
+    else {
+	do_sample(tid, context, 1);
+	start_timer(tid);
+    }
+
+    uint64_t cost = read_cycles() - entry;
+
+    tid->handler_cycles += cost;
+    tid->cost_hist[hist_index(cost)]++;
+
+    return 0;
+}
+
+/*
+ *  Dump what we have and pass the fault on to the application's
+ *  handler, or the default action.  The application may recover, so
+ *  keep sampling.
+ */
+static int
+segv_handler(int sig, siginfo_t *info, void *context)
+{
+    dump_samples();
+
+    return 1;
+}
+
+//----------------------------------------------------------------------
+//  End of process reduction
+//----------------------------------------------------------------------
+
+/*
+ *  The thread records are reduced by end_workers threads (the caller
+ *  and helpers that monitor doesn't see).  Each worker claims threads
+ *  one at a time to summarize and adds its share of the histograms
+ *  at the end.  Then the context trees are merged pairwise in rounds,
+ *  (0,1), (2,3), ... then (0,2), (4,6), ... and so on, with a barrier
+ *  between rounds, and the result ends up in trees[0].
+ */
+struct reduce {
+    struct thread_info ** array;
+    long  num;
+    long  next;
+    struct cct ** trees;
+    long  num_trees;
+    long  num_workers;
+    pthread_barrier_t  barrier;
+    pthread_mutex_t  lock;
+};
+
+static struct reduce reduce;
+
+static int
+cmp_tnum(const void *p1, const void *p2)
+{
+    const struct thread_info *t1 = * (struct thread_info * const *) p1;
+    const struct thread_info *t2 = * (struct thread_info * const *) p2;
+
+    return (t1->tnum > t2->tnum) - (t1->tnum < t2->tnum);
+}
+
+/*
+ *  Summarize one thread into tid->sum and add its histograms to the
+ *  worker's totals.
+ */
+static void
+summarize_thread(struct thread_info *tid, uint64_t *cost, uint64_t *late)
+{
+    uint64_t cost_hist [NUM_HIST];
+    uint64_t late_hist [NUM_HIST];
+    struct timeval *end = (tid->end.tv_sec != 0) ? &tid->end : &end_time;
+    double diff;
+
+    diff = (end->tv_sec - tid->start.tv_sec)
+	+ ((double) (end->tv_usec - tid->start.tv_usec)) / MILLION;
+
+    if (diff < 0.001) { diff = 0.001; }
+
+    for (int j = 0; j < NUM_HIST; j++) {
+	cost_hist[j] = tid->cost_hist[j];
+	late_hist[j] = tid->late_hist[j];
+	cost[j] += cost_hist[j];
+	late[j] += late_hist[j];
+    }
 
-//----------------------------------------------------------------------
-//  Interrupt and analysis functions
-//----------------------------------------------------------------------
+    tid->sum.time = diff;
+    tid->sum.handler = ns_per_cycle * tid->handler_cycles / 1.0e9;
+    tid->sum.cost[0] = hist_percentile(cost_hist, 0.50);
+    tid->sum.cost[1] = hist_percentile(cost_hist, 0.99);
+    tid->sum.late[0] = hist_percentile(late_hist, 0.50);
+    tid->sum.late[1] = hist_percentile(late_hist, 0.90);
+    tid->sum.late[2] = hist_percentile(late_hist, 0.99);
+    tid->sum.late[3] = hist_percentile(late_hist, 1.0);
+}
 
+/*
+ *  Add src's nodes and weights to dst, which must have room.  Parents
+ *  come before children, so one pass in index order maps every node.
+ */
 static void
-do_sample(struct thread_info *tid, void *context)
+cct_add_tree(struct cct *dst, struct cct *src)
 {
-    struct ucontext *ucontext = (struct ucontext *) context;
-    mcontext_t *mcontext = &(ucontext->uc_mcontext);
-    struct timeval now;
-    void *pc = NULL;
+    long used = __atomic_load_n(&src->used, __ATOMIC_ACQUIRE);
+    uint32_t *map = (uint32_t *) malloc(used * sizeof(uint32_t));
 
-    gettimeofday(&now, NULL);
+    if (map == NULL) {
+	err(1, "malloc for context tree merge failed");
+    }
 
-    long usec = MILLION * (now.tv_sec - proc_start.tv_sec)
-	+ (now.tv_usec - proc_start.tv_usec);
+    map[0] = 0;
+    for (long i = 1; i < used; i++) {
+	struct cct_node *node = &src->nodes[i];
 
-#if defined(__x86_64__)
-#ifndef REG_RIP
-#define REG_RIP  16
-#endif
-    pc = (void *) mcontext->gregs[REG_RIP];
+	map[i] = cct_child(dst, map[node->parent], node->addr);
+    }
+    for (long i = 0; i < used; i++) {
+	dst->nodes[map[i]].self += src->nodes[i].self;
+    }
 
-#elif defined(__powerpc64__)
-#ifndef PPC_REG_PC
-#define PPC_REG_PC  32
-#endif
-    pc = (void *) mcontext->gp_regs[PPC_REG_PC];
+    free(map);
+}
 
-#elif defined(__aarch64__)
-    pc = (void *) mcontext->pc;
+/*
+ *  Merge a and b into a new tree, sized so it can't fill.
+ */
+static struct cct *
+cct_merge(struct cct *a, struct cct *b)
+{
+    struct cct *tree = (struct cct *) malloc(sizeof(struct cct));
 
-#else
-#error architecture not supported
-#endif
+    if (tree == NULL) {
+	err(1, "malloc for context tree merge failed");
+    }
 
-    long slot = tid->count % NUM_SAMPLES;
-    tid->sinfo[slot].pc = pc;
-    tid->sinfo[slot].usec = usec;
+    cct_init(tree, a->used + b->used - 1);
+    cct_add_tree(tree, a);
+    cct_add_tree(tree, b);
 
-    tid->count++;
+    return tree;
 }
 
-//----------------------------------------------------------------------
-//  Signal handler functions
-//----------------------------------------------------------------------
-
-static void
-my_handler(int sig, siginfo_t *info, void *context)
+static void *
+reduce_worker(void *arg)
 {
-    if (at_end_of_process) {
-	return;
-    }
+    long me = (long) arg;
+    uint64_t cost [NUM_HIST];
+    uint64_t late [NUM_HIST];
+    long i;
 
-    struct thread_info *tid = pthread_getspecific(key);
+    memset(cost, 0, sizeof(cost));
+    memset(late, 0, sizeof(late));
 
-    if (tid == NULL) {
-	//
-	// probably a stray "drain the swamp" signal at thread tear
-	// down
-	//
-	warnx("pthread_getspecific returns NULL");
-	return;
+    while ((i = __atomic_fetch_add(&reduce.next, 1, __ATOMIC_RELAXED)) < reduce.num) {
+	summarize_thread(reduce.array[i], cost, late);
     }
-    else if (tid->magic != MAGIC) {
-	//
-	// internal corruption, should not happen
-	//
-	at_end_of_process = 1;
-	warnx("pthread_getspecific bad magic");
-	dump_samples();
-	abort();
+
+    pthread_mutex_lock(&reduce.lock);
+    for (int j = 0; j < NUM_HIST; j++) {
+	all_cost[j] += cost[j];
+	all_late[j] += late[j];
+    }
+    pthread_mutex_unlock(&reduce.lock);
+
+    // pair p of a round is (2 * stride * p, that + stride).  The
+    // merged trees from earlier rounds are ours to free, the threads'
+    // trees are not.  Slot k (even) holds a merged tree once the first
+    // round has paired it with k + 1.
+    for (long stride = 1; stride < reduce.num_trees; stride *= 2) {
+	for (long p = me; 2 * stride * p + stride < reduce.num_trees;
+	     p += reduce.num_workers) {
+	    long a = 2 * stride * p;
+	    long b = a + stride;
+	    struct cct *tree = cct_merge(reduce.trees[a], reduce.trees[b]);
+
+	    for (long k = a; stride > 1 && k <= b; k += stride) {
+		if (k + 1 < reduce.num_trees) {
+		    free(reduce.trees[k]->nodes);
+		    free(reduce.trees[k]->hash);
+		    free(reduce.trees[k]);
+		}
+	    }
+	    reduce.trees[a] = tree;
+	}
+	pthread_barrier_wait(&reduce.barrier);
     }
 
-    do_sample(tid, context);
-    start_timer(tid);
+    return NULL;
 }
 
+/*
+ *  Reduce the thread records: per-thread summaries, total histograms
+ *  and the merged context tree.  Threads that haven't ended are
+ *  summarized as of now, their handlers are already off.
+ */
 static void
-segv_handler(int sig, siginfo_t *info, void *context)
+reduce_threads(void)
 {
-    struct sigaction act;
-    sigset_t set;
+    pthread_t *td;
+    long num = 0;
 
-    at_end_of_process = 1;
+    gettimeofday(&end_time, NULL);
 
-    // reset handler to default
-    memset(&act, 0, sizeof(act));
-    sigemptyset(&act.sa_mask);
-    act.sa_handler = SIG_DFL;
-    if (sigaction(SIGSEGV, &act, NULL) != 0) {
-        err(1, "reset sigaction failed");
+    // convert cycles to nsec over the whole run
+    uint64_t cycles = read_cycles() - proc_start_cycles;
+    uint64_t nsec = read_nsec(CLOCK_MONOTONIC) - proc_start_nsec;
+
+    ns_per_cycle = (cycles > 0) ? ((double) nsec) / cycles : 1.0;
+
+    memset(all_cost, 0, sizeof(all_cost));
+    memset(all_late, 0, sizeof(all_late));
+    memset(&reduce, 0, sizeof(reduce));
+
+    // the app may still be adding threads, take the registry as of now
+    long size = monitor_registry_size(&thread_reg);
+
+    // sort the threads by thread number for display
+    reduce.array = (struct thread_info **) malloc((size + 1) * sizeof(void *));
+    reduce.trees = (struct cct **) malloc((size + 1) * sizeof(void *));
+    if (reduce.array == NULL || reduce.trees == NULL) {
+	err(1, "malloc for thread summary failed");
     }
-    if (sigaction(SIGBUS, &act, NULL) != 0) {
-        err(1, "reset sigaction failed");
+    for (long i = 0; i < size; i++) {
+	struct thread_info *tid = thread_lookup(i);
+
+	if (tid == NULL) {
+	    continue;
+	}
+	reduce.array[num++] = tid;
+	if (tid->cct.nodes != NULL) {
+	    reduce.trees[reduce.num_trees++] = &tid->cct;
+	}
     }
+    qsort(reduce.array, num, sizeof(void *), cmp_tnum);
+    reduce.num = num;
 
-    // unblock segfaults
-    sigemptyset(&set);
-    sigaddset(&set, SIGSEGV);
-    sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+    // one worker per THREADS_PER_WORKER threads, up to end_workers
+    reduce.num_workers = (num + THREADS_PER_WORKER - 1) / THREADS_PER_WORKER;
+    if (reduce.num_workers > end_workers) {
+	reduce.num_workers = end_workers;
+    }
+    if (reduce.num_workers < 1) {
+	reduce.num_workers = 1;
+    }
 
-    dump_samples();
-    abort();
+    td = (pthread_t *) malloc(reduce.num_workers * sizeof(pthread_t));
+    if (td == NULL) {
+	err(1, "malloc for reduce threads failed");
+    }
+
+    pthread_mutex_init(&reduce.lock, NULL);
+    pthread_barrier_init(&reduce.barrier, NULL, reduce.num_workers);
+
+    monitor_disable_new_threads();
+    for (long w = 1; w < reduce.num_workers; w++) {
+	if (pthread_create(&td[w], NULL, reduce_worker, (void *) w) != 0) {
+	    err(1, "unable to create reduce thread");
+	}
+    }
+    monitor_enable_new_threads();
+
+    reduce_worker((void *) 0);
+
+    for (long w = 1; w < reduce.num_workers; w++) {
+	pthread_join(td[w], NULL);
+    }
+
+    pthread_barrier_destroy(&reduce.barrier);
+    free(td);
+
+    merged_cct = (reduce.num_trees > 0) ? reduce.trees[0] : NULL;
 }
 
 //----------------------------------------------------------------------
@@ -287,42 +1871,143 @@ segv_handler(int sig, siginfo_t *info, void *context)
 //----------------------------------------------------------------------
 
 /*
- *  Normal summary on success.
+ *  Normal summary on success, from the reduced thread records.
  */
 static void
 print_summary(void)
 {
-    struct timeval now;
     long total = 0;
+    long frames = 0;
     double diff;
-
-    gettimeofday(&now, NULL);
+    double all_handler = 0.0, all_time = 0.0;
 
     if (period < 1) { period = 1; }
-    if (next_thread > MAX_THREADS) { next_thread = MAX_THREADS; }
 
-    printf("event: %s   period: %ld usec   rate: %.1f per sec\n",
-	   clock_name, period, ((double) MILLION) / period);
+    if (perf_mode && ! perf_is_clock) {
+	printf("event: %s   period: %ld events   timer: %s\n",
+	       clock_name, period, (perf_pages > 0) ? "perf ring" : "perf");
+    }
+    else {
+	printf("event: %s   period: %ld usec   rate: %.1f per sec   timer: %s\n",
+	       clock_name, period, ((double) MILLION) / period,
+	       perf_mode ? ((perf_pages > 0) ? "perf ring" : "perf")
+	       : periodic ? "periodic" : "one-shot");
+    }
 
-    for (int i = 0; i < next_thread; i++) {
-	diff = (now.tv_sec - thread_array[i].start.tv_sec)
-	    + ((double) (now.tv_usec - thread_array[i].start.tv_usec)) / MILLION;
+    for (long i = 0; i < reduce.num; i++) {
+	struct thread_info *tid = reduce.array[i];
+	struct thread_sum *sum = &tid->sum;
 
-	if (diff < 0.001) { diff = 0.001; }
+	printf("tid: %3ld   time: %.3f sec   count: %ld   rate: %.1f per sec\n",
+	       tid->tnum, sum->time, tid->count, tid->count / sum->time);
+
+	if (perf_pages > 0) {
+	    printf("tid: %3ld   lost: %ld\n", tid->tnum, tid->perf_lost);
+	}
+	else if (periodic && ! perf_mode) {
+	    printf("tid: %3ld   overrun: %ld\n", tid->tnum, tid->overrun);
+	}
+	if (sample_mode) {
+	    printf("tid: %3ld   written: %ld   dropped: %ld\n",
+		   tid->tnum, tid->written, tid->dropped);
+	}
+	if (cct_size > 0) {
+	    printf("tid: %3ld   contexts: %ld   truncated: %ld\n",
+		   tid->tnum, tid->cct.used - 1, tid->cct_truncated);
+	}
 
-	printf("tid: %3d   time: %.3f sec   count: %ld   rate: %.1f per sec\n",
-	       i, diff, thread_array[i].count, thread_array[i].count / diff);
+	if (tid->count > 0) {
+	    printf("tid: %3ld   overhead: %.3f%%   handler p50/p99: %.2f/%.2f usec",
+		   tid->tnum, 100.0 * sum->handler / sum->time,
+		   ns_per_cycle * sum->cost[0] / 1000.0,
+		   ns_per_cycle * sum->cost[1] / 1000.0);
+	    if (! perf_mode) {
+		printf("   late p50/p90/p99/max: %.1f/%.1f/%.1f/%.1f usec",
+		       sum->late[0] / 1000.0, sum->late[1] / 1000.0,
+		       sum->late[2] / 1000.0, sum->late[3] / 1000.0);
+	    }
+	    printf("\n");
+	}
 
-	total += thread_array[i].count;
+	total += tid->count;
+	frames += tid->num_frames;
+	all_handler += sum->handler;
+	all_time += sum->time;
     }
 
-    diff = (now.tv_sec - thread_array[0].start.tv_sec)
-	+ ((double) (now.tv_usec - thread_array[0].start.tv_usec)) / MILLION;
+    diff = (end_time.tv_sec - proc_start.tv_sec)
+	+ ((double) (end_time.tv_usec - proc_start.tv_usec)) / MILLION;
 
     if (diff < 0.001) { diff = 0.001; }
 
     printf("time: %.3f sec   total: %ld   rate: %.1f per sec\n",
 	   diff, total, total / diff);
+
+    if (max_callers > 0 && total > 0) {
+	printf("stacks: depth %d   unwind: %s   mean callers: %.1f\n",
+	       max_callers + 1,
+	       (perf_pages > 0) ? "perf" : stack_fp ? "fp" : "libunwind",
+	       ((double) frames) / total);
+    }
+    if (cct_size > 0) {
+	printf("contexts: %ld merged   %ld nodes per thread\n",
+	       (merged_cct != NULL) ? merged_cct->used - 1 : 0, cct_size);
+    }
+
+    if (total > 0) {
+	printf("overhead: %.3f%%   handler p50/p99: %.2f/%.2f usec",
+	       100.0 * all_handler / all_time,
+	       ns_per_cycle * hist_percentile(all_cost, 0.50) / 1000.0,
+	       ns_per_cycle * hist_percentile(all_cost, 0.99) / 1000.0);
+	if (! perf_mode) {
+	    printf("   late p50/p90/p99/max: %.1f/%.1f/%.1f/%.1f usec",
+		   hist_percentile(all_late, 0.50) / 1000.0,
+		   hist_percentile(all_late, 0.90) / 1000.0,
+		   hist_percentile(all_late, 0.99) / 1000.0,
+		   hist_percentile(all_late, 1.0) / 1000.0);
+	}
+	printf("\n");
+    }
+}
+
+/*
+ *  Reduce, write the sample file and print the summary.  The file is
+ *  one stream, so it's written serially under flush_lock.
+ */
+static void
+end_process_work(void)
+{
+    if (sample_mode) {
+	flush_all();
+    }
+
+    reduce_threads();
+
+    if (sample_mode) {
+	pthread_mutex_lock(&flush_lock);
+	write_cct();
+	write_tables();
+	write_header();
+	close(sample_fd);
+	sample_fd = -1;
+	pthread_mutex_unlock(&flush_lock);
+    }
+
+    printf("\n---> end process  (pid %d)\n", my_pid);
+
+    print_summary();
+
+    // exec and _exit don't flush stdio
+    fflush(stdout);
+}
+
+static void *
+end_helper(void *arg)
+{
+    end_process_work();
+    sem_post(&end_sem);
+
+    return NULL;
 }
 
 //----------------------------------------------------------------------
@@ -336,27 +2021,33 @@ dump_samples(void)
     struct timeval now;
     gettimeofday(&now, NULL);
 
-    for (int i = 0; i < next_thread; i++) {
-	struct thread_info *tid = &thread_array[i];
+    for (long n = 0; n < monitor_registry_size(&thread_reg); n++) {
+	struct thread_info *tid = thread_lookup(n);
+
+	if (tid == NULL || tid->sinfo == NULL) {
+	    continue;
+	}
+
+	long i = tid->tnum;
 
 	double diff = (now.tv_sec - tid->start.tv_sec)
 	    + ((double) (now.tv_usec - tid->start.tv_usec)) / MILLION;
 
-	printf("\npid: %6d    tid: %4d    ----------------------------------------\n"
-	       "pid: %6d    tid: %4d    time: %.3f sec    count: %ld\n",
+	printf("\npid: %6d    tid: %4ld    ----------------------------------------\n"
+	       "pid: %6d    tid: %4ld    time: %.3f sec    count: %ld\n",
 	       my_pid, i, my_pid, i, diff, tid->count);
 
-	long slot = (tid->count < NUM_SAMPLES) ? 0 : (tid->count % NUM_SAMPLES);
-	long num =  (tid->count < NUM_SAMPLES) ? tid->count : NUM_SAMPLES;
+	// the last few samples in the ring, flushed or not
+	long head = tid->head;
+	long num = (head < NUM_SAMPLES) ? head : NUM_SAMPLES;
 
-	for (long j = 0; j < num; j++) {
+	for (long j = head - num; j < head; j++) {
+	    long slot = j & ring_mask;
 	    long sec = tid->sinfo[slot].usec / MILLION;
 	    long usec = tid->sinfo[slot].usec % MILLION;
 
-	    printf("pid: %6d    tid: %4d    usec: %4ld.%06ld    %p\n",
+	    printf("pid: %6d    tid: %4ld    usec: %4ld.%06ld    %p\n",
 		   my_pid, i, sec, usec, tid->sinfo[slot].pc);
-
-	    slot = (slot + 1) % NUM_SAMPLES;
 	}
     }
 }
@@ -378,7 +2069,11 @@ init_process(void)
     char *str = getenv("EVENT");
 
     if (str != NULL) {
-	if (strncasecmp(str, "real", 4) == 0) {
+	if (perf_lookup(str)) {
+	    perf_mode = 1;
+	    clock_type = CLOCK_MONOTONIC;
+	}
+	else if (strncasecmp(str, "real", 4) == 0) {
 	    clock_type = REALTIME_CLOCK_TYPE;
 	    clock_name = REALTIME_NAME;
 	}
@@ -387,112 +2082,221 @@ init_process(void)
 	    clock_name = CPUTIME_NAME;
 	}
 	else {
-	    warnx("EVENT does not specify 'real' or 'cpu'");
+	    warnx("EVENT does not specify 'real', 'cpu' or a perf event");
 	}
 
 	char *p = strchr(str, '@');
-	if (p != NULL) {
+	if (p != NULL && atol(p + 1) > 0) {
 	    period = atol(p + 1);
-	    if (period <= 0) {
-		period = DEFAULT_PERIOD;
-	    }
 	}
     }
 
-    // one-shot mode, period is usec
+    period_nsec = 1000UL * period;
+
+    // stacks, depth counts the pc
+    if ((str = getenv("STACK")) != NULL && atol(str) > 1) {
+	max_callers = atol(str) - 1;
+    }
+#ifdef USE_LIBUNWIND
+    stack_fp = 0;
+#endif
+    if ((str = getenv("STACK_UNWIND")) != NULL) {
+	if (strcasecmp(str, "fp") == 0) {
+	    stack_fp = 1;
+	}
+#ifdef USE_LIBUNWIND
+	else if (strcasecmp(str, "libunwind") == 0) {
+	    stack_fp = 0;
+	}
+#endif
+	else {
+	    warnx("STACK_UNWIND does not specify a known method, using %s",
+		  stack_fp ? "fp" : "libunwind");
+	}
+    }
+    if ((str = getenv("CCT")) != NULL && atol(str) > 0) {
+	cct_size = atol(str);
+	if (cct_size > UINT32_MAX) {
+	    cct_size = UINT32_MAX;
+	}
+    }
+
+    // end of process, workers default to the cpus, up to 8
+    end_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (end_workers > MAX_END_WORKERS) {
+	end_workers = MAX_END_WORKERS;
+    }
+    if ((str = getenv("END_THREADS")) != NULL && atol(str) > 0) {
+	end_workers = atol(str);
+    }
+    if (end_workers < 1) {
+	end_workers = 1;
+    }
+    if ((str = getenv("END_BUDGET")) != NULL) {
+	end_budget = atol(str);
+    }
+
+#ifdef USE_LIBUNWIND
+    if (max_callers > 0 && ! stack_fp) {
+	unw_set_caching_policy(unw_local_addr_space, UNW_CACHE_PER_THREAD);
+    }
+#endif
+
+    if (perf_mode) {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	// ring size in pages is a power of 2
+	if ((str = getenv("PERF_RING")) != NULL && atol(str) > 0) {
+	    for (perf_pages = 1; perf_pages < atol(str); perf_pages *= 2)
+		;
+	}
+	perf_init_attr();
+    }
+
+    if ((str = getenv("TIMER")) != NULL) {
+	if (strncasecmp(str, "one", 3) == 0) {
+	    periodic = 0;
+	}
+	else if (strncasecmp(str, "per", 3) != 0) {
+	    warnx("TIMER does not specify 'periodic' or 'oneshot'");
+	}
+    }
+
+    // period is usec, one-shot mode has no interval
     itspec_start.it_value.tv_sec = period / MILLION;
     itspec_start.it_value.tv_nsec = 1000 * (period % MILLION);
-    itspec_start.it_interval.tv_sec = 0;
-    itspec_start.it_interval.tv_nsec = 0;
+    if (periodic) {
+	itspec_start.it_interval = itspec_start.it_value;
+    }
+    else {
+	itspec_start.it_interval.tv_sec = 0;
+	itspec_start.it_interval.tv_nsec = 0;
+    }
 
     memset(&itspec_stop, 0, sizeof(itspec_stop));
 
-    // profiling handler
+    // sampling mode, ring size is a power of 2
+    char *dir = getenv("SAMPLE_OUTPUT");
+
+    if (dir != NULL) {
+	sample_mode = 1;
+	sample_dir = dir;
+
+	long size = DEFAULT_BUFFER;
+	if ((str = getenv("SAMPLE_BUFFER")) != NULL && atol(str) > 0) {
+	    size = atol(str);
+	}
+	for (ring_size = 64; ring_size < size; ring_size *= 2)
+	    ;
+	ring_mask = ring_size - 1;
+
+	if ((str = getenv("SAMPLE_FLUSH")) != NULL) {
+	    flush_msec = atol(str);
+	}
+    }
+
+    // profiling handler, monitor keeps the application from
+    // blocking or replacing it
     memset(&act, 0, sizeof(act));
     sigemptyset(&act.sa_mask);
-    act.sa_sigaction = my_handler;
-    act.sa_flags = SA_SIGINFO | SA_RESTART;
-    if (sigaction(PROF_SIGNAL, &act, NULL) != 0) {
-        err(1, "sigaction failed");
+    act.sa_flags = SA_RESTART;
+    if (monitor_sigaction(PROF_SIGNAL, my_handler, 0, &act) != 0) {
+        err(1, "monitor_sigaction failed");
     }
 
     // segfault handler
     memset(&segv_act, 0, sizeof(segv_act));
     sigemptyset(&segv_act.sa_mask);
-    segv_act.sa_sigaction = segv_handler;
-    segv_act.sa_flags = SA_SIGINFO;
-    if (sigaction(SIGSEGV, &segv_act, NULL) != 0) {
-        err(1, "segv sigaction failed");
-    }
-    if (sigaction(SIGBUS, &segv_act, NULL) != 0) {
-        err(1, "segv sigaction failed");
+    if (monitor_sigaction(SIGSEGV, segv_handler, 0, &segv_act) != 0) {
+        err(1, "segv monitor_sigaction failed");
     }
-
-    if (pthread_key_create(&key, NULL) != 0) {
-	err(1, "pthread_key_create failed");
+    if (monitor_sigaction(SIGBUS, segv_handler, 0, &segv_act) != 0) {
+        err(1, "segv monitor_sigaction failed");
     }
 
     my_pid = getpid();
 
     gettimeofday(&proc_start, NULL);
+    proc_start_cycles = read_cycles();
+    proc_start_nsec = read_nsec(CLOCK_MONOTONIC);
+
+    if (sample_mode) {
+	open_sample_file(dir);
+    }
 }
 
 //----------------------------------------------------------------------
 
-static void
-mk_thread_info(long tnum)
+static struct thread_info *
+mk_thread_info(void)
 {
-    if (tnum < 0 || tnum >= MAX_THREADS) {
-	errx(1, "thread num out of range: %ld", tnum);
+    struct monitor_thread_info *info = monitor_get_thread_info();
+
+    if (info == NULL) {
+	errx(1, "monitor_get_thread_info failed");
     }
 
-    struct thread_info *tid = &thread_array[tnum];
+    // registry records start zeroed
+    struct thread_info *tid = monitor_registry_alloc(&thread_reg);
 
-    memset(tid, 0, sizeof(*tid));
-    tid->magic = MAGIC;
-    tid->tnum = tnum;
+    tid->tnum = info->mti_thread_num;
     tid->count = 0;
+    tid->perf_fd = -1;
     gettimeofday(&tid->start, NULL);
 
-    tid->sinfo = (struct sample_info *) malloc(NUM_SAMPLES * sizeof(struct sample_info));
+    tid->sinfo = (struct sample_info *) pool_get(&ring_pool);
+    if (tid->sinfo == NULL) {
+	tid->sinfo = (struct sample_info *) malloc(ring_size * sizeof(struct sample_info));
+    }
     if (tid->sinfo == NULL) {
 	err(1, "malloc for sample info array failed");
     }
 
-    create_timer(tid);
+    if (max_callers > 0) {
+	pthread_attr_t attr;
+	void *addr;
+	size_t size;
+
+	// with a context tree, only one stack at a time
+	long num = (cct_size > 0) ? 1 : ring_size;
+
+	tid->frames = (void **) pool_get(&frame_pool);
+	if (tid->frames == NULL) {
+	    tid->frames = (void **) malloc(num * max_callers * sizeof(void *));
+	}
+	if (tid->frames == NULL) {
+	    err(1, "malloc for frame array failed");
+	}
 
-    if (pthread_setspecific(key, tid) != 0) {
-	err(1, "pthread_setspecific failed");
+	// top of stack for the frame pointer walk
+	if (pthread_getattr_np(pthread_self(), &attr) != 0
+	    || pthread_attr_getstack(&attr, &addr, &size) != 0) {
+	    errx(1, "unable to get thread stack bounds");
+	}
+	pthread_attr_destroy(&attr);
+	tid->stack_hi = (uintptr_t) addr + size;
     }
-}
 
-//----------------------------------------------------------------------
-//  Monitor callback functions
-//----------------------------------------------------------------------
+    if (cct_size > 0) {
+	cct_init(&tid->cct, cct_size);
+    }
 
-/*
- *  Drain the queue of any leftover signals and block the profiling
- *  signal at end of process or thread time.  There's a risk that a
- *  leftover signal might run in the handler after thread specific
- *  data has gone away.
- */
-static void
-drain_signal_queue(void)
-{
-    struct timespec tspec;
-    sigset_t set;
+    create_timer(tid);
 
-    sigemptyset(&set);
-    sigaddset(&set, PROF_SIGNAL);
-    tspec.tv_sec = 0;
-    tspec.tv_nsec = 10;
+    // now the flusher and end of process can see it
+    __atomic_store_n(&tid->magic, MAGIC, __ATOMIC_RELEASE);
 
-    while (sigtimedwait(&set, NULL, &tspec) > 0)
-	;
+    __sync_fetch_and_add(&num_threads, 1);
 
-    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    info->mti_client_data = tid;
+
+    return tid;
 }
 
+//----------------------------------------------------------------------
+//  Monitor callback functions
+//----------------------------------------------------------------------
+
 void
 monitor_begin_process_cb(void)
 {
@@ -501,8 +2305,12 @@ monitor_begin_process_cb(void)
     printf("---> begin process  (pid %d)  %s at %ld\n",
 	   my_pid, clock_name, period);
 
-    mk_thread_info(0);
-    start_timer(&thread_array[0]);
+    struct thread_info *tid = mk_thread_info();
+    start_timer(tid);
+
+    if (sample_mode && flush_msec > 0) {
+	start_flusher();
+    }
 }
 
 void
@@ -515,39 +2323,161 @@ monitor_end_process_cb(void)
 {
     at_end_of_process = 1;
 
-    stop_timer(&thread_array[0]);
-    delete_timer(&thread_array[0]);
-    drain_signal_queue();
+    struct thread_info *tid = get_thread_info();
 
-    printf("\n---> end process  (pid %d)\n", my_pid);
+    // other threads' handlers see at_end_of_process and do nothing
+    if (tid != NULL) {
+	delete_timer(tid);
+    }
 
-    print_summary();
+    if (end_budget < 0) {
+	end_process_work();
+	return;
+    }
+
+    // with a budget, do the work in a helper and give up waiting
+    // after end_budget msec, the process exits anyway
+    struct timespec deadline;
+    pthread_t td;
+    int ret;
+
+    if (sem_init(&end_sem, 0, 0) != 0) {
+	err(1, "sem_init failed");
+    }
+
+    monitor_disable_new_threads();
+    ret = pthread_create(&td, NULL, end_helper, NULL);
+    monitor_enable_new_threads();
+
+    if (ret != 0) {
+	warn("unable to create end of process thread");
+	end_process_work();
+	return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += end_budget / 1000;
+    deadline.tv_nsec += 1000000 * (end_budget % 1000);
+    if (deadline.tv_nsec >= 1000000000) {
+	deadline.tv_sec++;
+	deadline.tv_nsec -= 1000000000;
+    }
+
+    do {
+	ret = sem_timedwait(&end_sem, &deadline);
+    } while (ret != 0 && errno == EINTR);
+
+    if (ret != 0) {
+	warnx("end of process exceeded %ld msec, output may be incomplete",
+	      end_budget);
+    }
+}
+
+/*
+ *  Hold flush_lock and pool_lock across fork so the child doesn't inherit
+ *  them locked by a thread that no longer exists.
+ */
+void *
+monitor_pre_fork_cb(void)
+{
+    if (sample_mode) {
+	pthread_mutex_lock(&flush_lock);
+	pthread_mutex_lock(&pool_lock);
+    }
+
+    return NULL;
 }
 
 void
-monitor_begin_thread_cb(void)
+monitor_post_fork_parent_cb(pid_t child, void *data)
 {
-    long tnum = __sync_fetch_and_add(&next_thread, 1);
+    if (sample_mode) {
+	pthread_mutex_unlock(&pool_lock);
+	pthread_mutex_unlock(&flush_lock);
+    }
+}
 
-    if (tnum < 0 || tnum >= MAX_THREADS) {
-	warnx("out of threads: %ld", tnum);
-	return;
+/*
+ *  The child has only the forking thread and no timers or perf
+ *  events.  Drop the parent's threads without flushing them (the
+ *  parent writes those samples) and start over as a new process with
+ *  its own file.
+ */
+void
+monitor_post_fork_child_cb(void *data)
+{
+    // perf fds are inherited, but they count the parent's threads
+    for (long i = 0; i < monitor_registry_size(&thread_reg); i++) {
+	struct thread_info *tid = thread_lookup(i);
+
+	if (tid != NULL) {
+	    if (perf_mode) {
+		perf_close(tid);
+	    }
+	    monitor_registry_free(&thread_reg, tid);
+	}
+    }
+
+    num_threads = 0;
+    my_pid = getpid();
+    gettimeofday(&proc_start, NULL);
+    proc_start_cycles = read_cycles();
+    proc_start_nsec = read_nsec(CLOCK_MONOTONIC);
+
+    if (sample_mode) {
+	pthread_mutex_init(&flush_lock, NULL);
+	pthread_mutex_init(&pool_lock, NULL);
+	close(sample_fd);
+	free(encode_buf);
+	open_sample_file(sample_dir);
+    }
+
+    printf("---> begin process  (pid %d)  %s at %ld  (fork)\n",
+	   my_pid, clock_name, period);
+
+    struct thread_info *tid = mk_thread_info();
+    start_timer(tid);
+
+    if (sample_mode && flush_msec > 0) {
+	start_flusher();
     }
+}
 
-    mk_thread_info(tnum);
-    start_timer(&thread_array[tnum]);
+void
+monitor_begin_thread_cb(void)
+{
+    struct thread_info *tid = mk_thread_info();
+    start_timer(tid);
 }
 
 void
 monitor_end_thread_cb(void)
 {
-    struct thread_info *tid = pthread_getspecific(key);
+    struct thread_info *tid = get_thread_info();
 
-    if (tid == NULL || tid->magic != MAGIC) {
-	errx(1, "pthread_getspecific failed");
+    // not profiled, eg, the flusher
+    if (tid == NULL) {
+	return;
+    }
+    if (tid->magic != MAGIC) {
+	errx(1, "get thread info failed");
     }
 
-    stop_timer(tid);
     delete_timer(tid);
-    drain_signal_queue();
+    gettimeofday(&tid->end, NULL);
+
+    // the last thread may also deliver end process after main's
+    // pthread_exit, and the timer is gone
+    monitor_get_thread_info()->mti_client_data = NULL;
+
+    // flush our own ring and pass it on, the summary only needs counts
+    if (sample_mode) {
+	pthread_mutex_lock(&flush_lock);
+	flush_ring(tid);
+	pool_put(&ring_pool, tid->sinfo);
+	pool_put(&frame_pool, tid->frames);
+	tid->sinfo = NULL;
+	tid->frames = NULL;
+	pthread_mutex_unlock(&flush_lock);
+    }
 }
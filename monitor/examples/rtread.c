@@ -0,0 +1,618 @@
+/*
+ *  Copyright (c) 2019-2020, Rice University.
+ *  See LICENSE for details.
+ *
+ *  ----------------------------------------------------------------------
+ *
+ *  Read a sample file from realtime.c (see rtsample.h) and print the
+ *  thread table, a histogram of the sample intervals, the samples per
+ *  load module, and the hottest PCs as module + offset.
+ *
+ *  Usage:
+ *    rtread [-n num] file ...
+ *
+ *  where num is the number of PCs to print (default 20).
+ *
+ *  The file is mmap()ed and decoded in place.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rtsample.h"
+
+#define DEFAULT_TOP  20
+#define NUM_BUCKETS  40
+#define DEFAULT_CONTEXTS   5
+#define MAX_CONTEXT_DEPTH  8
+
+struct module {
+    uint64_t  start;
+    uint64_t  len;
+    uint64_t  offset;
+    const char * path;
+    int       path_len;
+    long      count;
+};
+
+struct pc_count {
+    uint64_t  pc;
+    long      count;
+};
+
+struct context {
+    uint64_t  addr;
+    uint64_t  parent;
+    long      self;
+    long      total;
+};
+
+static struct module * module;
+static long num_modules;
+
+static struct pc_count * pc_table;
+static long pc_size;
+static long pc_used;
+
+static long interval [NUM_BUCKETS];
+static long total_samples;
+static long unknown_samples;
+static long stack_samples;
+static long stack_frames;
+static long stack_max;
+
+// context tree, node 0 is the root
+static struct context * context;
+static long num_contexts;
+
+//----------------------------------------------------------------------
+
+static void
+pc_table_init(long size)
+{
+    pc_size = size;
+    pc_used = 0;
+    pc_table = (struct pc_count *) calloc(pc_size, sizeof(struct pc_count));
+    if (pc_table == NULL) {
+	err(1, "calloc for pc table failed");
+    }
+}
+
+/*
+ *  Open addressing with linear probing.  pc 0 is never a sample, so
+ *  it marks an empty slot.
+ */
+static void
+pc_table_add(uint64_t pc, long count)
+{
+    if (2 * (pc_used + 1) > pc_size) {
+	struct pc_count *old = pc_table;
+	long old_size = pc_size;
+
+	pc_table_init(2 * old_size);
+	for (long i = 0; i < old_size; i++) {
+	    if (old[i].pc != 0) {
+		pc_table_add(old[i].pc, old[i].count);
+	    }
+	}
+	free(old);
+    }
+
+    long i = (pc * 0x9e3779b97f4a7c15UL) >> 20;
+
+    for (i &= pc_size - 1; ; i = (i + 1) & (pc_size - 1)) {
+	if (pc_table[i].pc == pc) {
+	    pc_table[i].count += count;
+	    return;
+	}
+	if (pc_table[i].pc == 0) {
+	    pc_table[i].pc = pc;
+	    pc_table[i].count = count;
+	    pc_used++;
+	    return;
+	}
+    }
+}
+
+static int
+cmp_count(const void *p1, const void *p2)
+{
+    const struct pc_count *a = p1, *b = p2;
+
+    if (a->count != b->count) {
+	return (a->count > b->count) ? -1 : 1;
+    }
+    return (a->pc < b->pc) ? -1 : (a->pc > b->pc);
+}
+
+static int
+cmp_start(const void *p1, const void *p2)
+{
+    const struct module *a = p1, *b = p2;
+
+    return (a->start < b->start) ? -1 : (a->start > b->start);
+}
+
+static struct module *
+find_module(uint64_t pc)
+{
+    long lo = 0, hi = num_modules;
+
+    while (lo < hi) {
+	long mid = (lo + hi) / 2;
+
+	if (pc < module[mid].start) {
+	    hi = mid;
+	}
+	else if (pc >= module[mid].start + module[mid].len) {
+	    lo = mid + 1;
+	}
+	else {
+	    return &module[mid];
+	}
+    }
+
+    return NULL;
+}
+
+static int
+log2_bucket(uint64_t val)
+{
+    int b = 0;
+
+    while (val > 1 && b < NUM_BUCKETS - 1) {
+	val >>= 1;
+	b++;
+    }
+
+    return b;
+}
+
+//----------------------------------------------------------------------
+
+#define GET(var)  do {					\
+    if (rts_get_varint(&p, end, &(var)) != 0) {		\
+	errx(1, "%s: truncated at offset %ld",		\
+	     name, (long) (p - base));			\
+    }							\
+} while (0)
+
+static void
+read_modules(const char *name, const uint8_t *base, const uint8_t *end,
+	     const struct rts_header *hdr)
+{
+    const uint8_t *p = base + hdr->module_off;
+    uint64_t start, len, offset, path_len;
+
+    num_modules = hdr->module_num;
+    module = (struct module *) calloc(num_modules + 1, sizeof(struct module));
+    if (module == NULL) {
+	err(1, "calloc for modules failed");
+    }
+
+    for (long i = 0; i < num_modules; i++) {
+	GET(start);
+	GET(len);
+	GET(offset);
+	GET(path_len);
+	if (path_len > (uint64_t) (end - p)) {
+	    errx(1, "%s: bad module path length", name);
+	}
+	module[i].start = start;
+	module[i].len = len;
+	module[i].offset = offset;
+	module[i].path = (const char *) p;
+	module[i].path_len = path_len;
+	p += path_len;
+    }
+
+    qsort(module, num_modules, sizeof(struct module), cmp_start);
+}
+
+static void
+print_threads(const char *name, const uint8_t *base, const uint8_t *end,
+	      const struct rts_header *hdr)
+{
+    const uint8_t *p = base + hdr->thread_off;
+    uint64_t tnum, start, count, written, dropped;
+
+    printf("\n%6s  %10s  %10s  %10s  %10s\n",
+	   "thread", "start", "count", "written", "dropped");
+
+    for (uint64_t i = 0; i < hdr->thread_num; i++) {
+	GET(tnum);
+	GET(start);
+	GET(count);
+	GET(written);
+	GET(dropped);
+	printf("%6lu  %6lu.%03lu  %10lu  %10lu  %10lu\n",
+	       tnum, start / 1000000, (start / 1000) % 1000,
+	       count, written, dropped);
+    }
+}
+
+/*
+ *  Read the context tree record, *pos is just past the tag.
+ */
+static void
+read_contexts(const char *name, const uint8_t *base, const uint8_t **pos,
+	      const uint8_t *limit)
+{
+    const uint8_t *p = *pos;
+    const uint8_t *end = limit;
+    uint64_t num, len, parent, delta, self;
+
+    GET(num);
+    GET(len);
+    if (len > (uint64_t) (limit - p) || num > len) {
+	errx(1, "%s: bad context tree length at offset %ld",
+	     name, (long) (p - base));
+    }
+    end = p + len;
+
+    free(context);
+    context = (struct context *) calloc(num + 1, sizeof(struct context));
+    if (context == NULL) {
+	err(1, "calloc for context tree failed");
+    }
+
+    for (uint64_t i = 1; i <= num; i++) {
+	GET(parent);
+	GET(delta);
+	GET(self);
+	if (parent >= i) {
+	    errx(1, "%s: bad context parent at offset %ld",
+		 name, (long) (p - base));
+	}
+	context[i].addr = context[parent].addr + rts_unzigzag(delta);
+	context[i].parent = parent;
+	context[i].self = self;
+    }
+    num_contexts = num + 1;
+
+    *pos = end;
+}
+
+/*
+ *  Decode all the chunks from the end of the header to limit.
+ */
+static void
+read_chunks(const char *name, const uint8_t *base, const uint8_t *limit,
+	    uint32_t version)
+{
+    const uint8_t *p = base + sizeof(struct rts_header);
+    const uint8_t *end = limit;
+    uint64_t tag, tnum, num, len, usec, val, delta, weight, depth;
+
+    while (p < limit) {
+	GET(tag);
+	if (tag == RTS_TAG_CCT) {
+	    read_contexts(name, base, &p, limit);
+	    continue;
+	}
+	if (tag != RTS_TAG_CHUNK) {
+	    errx(1, "%s: bad chunk tag %lu at offset %ld",
+		 name, tag, (long) (p - base));
+	}
+	GET(tnum);
+	GET(num);
+	GET(len);
+	if (len > (uint64_t) (limit - p)) {
+	    // cut short while writing, stop here
+	    warnx("%s: last chunk is truncated", name);
+	    return;
+	}
+	end = p + len;
+
+	GET(usec);
+	uint64_t last_usec = usec;
+	uint64_t last_pc = 0;
+
+	for (uint64_t j = 0; j < num; j++) {
+	    GET(val);
+	    int flags = rts_usec_field(val, version, &delta);
+	    usec = last_usec + rts_unzigzag(delta);
+	    GET(val);
+	    uint64_t pc = last_pc + rts_unzigzag(val);
+	    weight = 1;
+	    if (flags & RTS_FLAG_WEIGHT) {
+		GET(weight);
+	    }
+	    if (flags & RTS_FLAG_STACK) {
+		GET(depth);
+		for (uint64_t k = 0; k < depth; k++) {
+		    GET(val);
+		}
+		stack_samples++;
+		stack_frames += depth;
+		if ((long) depth > stack_max) {
+		    stack_max = depth;
+		}
+	    }
+
+	    if (j > 0) {
+		interval[log2_bucket(usec - last_usec)]++;
+	    }
+	    if (pc != 0) {
+		pc_table_add(pc, weight);
+	    }
+	    last_usec = usec;
+	    last_pc = pc;
+	    total_samples += weight;
+	}
+	end = limit;
+    }
+}
+
+//----------------------------------------------------------------------
+
+static void
+print_intervals(void)
+{
+    long max = 0;
+
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+	if (interval[b] > max) {
+	    max = interval[b];
+	}
+    }
+    if (max == 0) {
+	return;
+    }
+
+    printf("\n%-22s  %10s\n", "interval (usec)", "count");
+
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+	if (interval[b] == 0) {
+	    continue;
+	}
+	int len = (int) ((50 * interval[b] + max - 1) / max);
+
+	printf("[%8lu, %8lu)  %10ld  %.*s\n",
+	       (b == 0) ? 0UL : 1UL << b, 1UL << (b + 1), interval[b],
+	       len, "##################################################");
+    }
+}
+
+/*
+ *  Print addr as module + offset.
+ */
+static void
+print_addr(uint64_t addr)
+{
+    struct module *mod = find_module(addr);
+
+    if (mod != NULL) {
+	const char *base = memrchr(mod->path, '/', mod->path_len);
+
+	base = (base != NULL) ? base + 1 : mod->path;
+	printf("%.*s + 0x%lx\n",
+	       (int) (mod->path + mod->path_len - base), base,
+	       addr - mod->start + mod->offset);
+    }
+    else {
+	printf("(unknown)\n");
+    }
+}
+
+static void
+print_pcs(long top)
+{
+    struct pc_count *list;
+    long n = 0;
+
+    list = (struct pc_count *) malloc((pc_used + 1) * sizeof(struct pc_count));
+    if (list == NULL) {
+	err(1, "malloc for pc list failed");
+    }
+    for (long i = 0; i < pc_size; i++) {
+	if (pc_table[i].pc != 0) {
+	    struct module *mod = find_module(pc_table[i].pc);
+
+	    if (mod != NULL) {
+		mod->count += pc_table[i].count;
+	    }
+	    else {
+		unknown_samples += pc_table[i].count;
+	    }
+	    list[n++] = pc_table[i];
+	}
+    }
+    qsort(list, n, sizeof(struct pc_count), cmp_count);
+
+    printf("\n%10s  %6s  %s\n", "samples", "pct", "module");
+    for (long i = 0; i < num_modules; i++) {
+	if (module[i].count > 0) {
+	    printf("%10ld  %5.1f%%  %.*s\n", module[i].count,
+		   100.0 * module[i].count / total_samples,
+		   module[i].path_len, module[i].path);
+	}
+    }
+    if (unknown_samples > 0) {
+	printf("%10ld  %5.1f%%  %s\n", unknown_samples,
+	       100.0 * unknown_samples / total_samples, "(unknown)");
+    }
+
+    printf("\n%10s  %6s  %-18s  %s\n", "samples", "pct", "pc", "module + offset");
+    for (long i = 0; i < n && i < top; i++) {
+	printf("%10ld  %5.1f%%  0x%-16lx  ", list[i].count,
+	       100.0 * list[i].count / total_samples, list[i].pc);
+	print_addr(list[i].pc);
+    }
+
+    free(list);
+}
+
+static int
+cmp_self(const void *p1, const void *p2)
+{
+    long a = context[* (const long *) p1].self;
+    long b = context[* (const long *) p2].self;
+
+    return (a > b) ? -1 : (a < b);
+}
+
+/*
+ *  Print the hottest contexts by self weight, innermost first.
+ */
+static void
+print_contexts(long top)
+{
+    if (num_contexts <= 1) {
+	return;
+    }
+
+    long *list = (long *) malloc(num_contexts * sizeof(long));
+    if (list == NULL) {
+	err(1, "malloc for context list failed");
+    }
+
+    // children come after parents, so one pass backwards sums totals
+    for (long i = num_contexts - 1; i > 0; i--) {
+	context[i].total += context[i].self;
+	context[context[i].parent].total += context[i].total;
+	list[i - 1] = i;
+    }
+    qsort(list, num_contexts - 1, sizeof(long), cmp_self);
+
+    printf("\ncontexts: %ld   samples: %ld\n", num_contexts - 1, context[0].total);
+
+    for (long i = 0; i < num_contexts - 1 && i < top && context[list[i]].self > 0; i++) {
+	int depth = 0;
+
+	printf("\n%10ld  %5.1f%%  ", context[list[i]].self,
+	       100.0 * context[list[i]].self / context[0].total);
+
+	for (uint64_t n = list[i]; n != 0 && depth < MAX_CONTEXT_DEPTH;
+	     n = context[n].parent, depth++) {
+	    if (depth > 0) {
+		printf("%20s", "<- ");
+	    }
+	    print_addr(context[n].addr);
+	}
+    }
+
+    free(list);
+}
+
+//----------------------------------------------------------------------
+
+static void
+read_file(const char *name, long top)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0) {
+	err(1, "unable to open: %s", name);
+    }
+    if (fstat(fd, &st) != 0) {
+	err(1, "stat failed: %s", name);
+    }
+    if (st.st_size < (off_t) sizeof(struct rts_header)) {
+	errx(1, "%s: too short for a sample file", name);
+    }
+
+    const uint8_t *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+	err(1, "mmap failed: %s", name);
+    }
+    close(fd);
+
+    const uint8_t *end = base + st.st_size;
+    const struct rts_header *hdr = (const struct rts_header *) base;
+
+    if (memcmp(hdr->magic, RTS_MAGIC, sizeof(hdr->magic)) != 0) {
+	errx(1, "%s: not a sample file", name);
+    }
+    if (hdr->version < RTS_VERSION_MIN || hdr->version > RTS_VERSION
+	|| hdr->header_size != sizeof(*hdr)) {
+	errx(1, "%s: unsupported version %u", name, hdr->version);
+    }
+    if (hdr->thread_off > (uint64_t) st.st_size
+	|| hdr->module_off > (uint64_t) st.st_size) {
+	errx(1, "%s: bad table offsets", name);
+    }
+
+    // perf periods are usec for the clock events, else event counts
+    printf("file: %s\npid: %u   clock: %s   period: %lu%s\n",
+	   name, hdr->pid,
+	   (hdr->clock == RTS_CLOCK_PERF) ? "PERF"
+	   : (hdr->clock == RTS_CLOCK_CPU) ? "CPUTIME" : "REALTIME",
+	   hdr->period, (hdr->clock == RTS_CLOCK_PERF) ? "" : " usec");
+
+    memset(interval, 0, sizeof(interval));
+    total_samples = 0;
+    unknown_samples = 0;
+    stack_samples = 0;
+    stack_frames = 0;
+    stack_max = 0;
+    num_modules = 0;
+    module = NULL;
+    context = NULL;
+    num_contexts = 0;
+    pc_table_init(1024);
+
+    if (hdr->thread_off != 0) {
+	read_chunks(name, base, base + hdr->thread_off, hdr->version);
+	print_threads(name, base, end, hdr);
+	if (hdr->module_off != 0) {
+	    read_modules(name, base, end, hdr);
+	}
+    }
+    else {
+	warnx("%s: no thread table or load map, process did not finish", name);
+	read_chunks(name, base, end, hdr->version);
+    }
+
+    printf("\ntotal samples: %ld\n", total_samples);
+    if (stack_samples > 0) {
+	printf("stacks: %ld   mean callers: %.1f   max callers: %ld\n",
+	       stack_samples, ((double) stack_frames) / stack_samples, stack_max);
+    }
+
+    print_intervals();
+    print_pcs(top);
+    print_contexts(top < DEFAULT_CONTEXTS ? top : DEFAULT_CONTEXTS);
+
+    free(pc_table);
+    free(module);
+    free(context);
+    munmap((void *) base, st.st_size);
+}
+
+int
+main(int argc, char **argv)
+{
+    long top = DEFAULT_TOP;
+    int n = 1;
+
+    if (n + 1 < argc && strcmp(argv[n], "-n") == 0) {
+	top = atol(argv[n + 1]);
+	n += 2;
+    }
+
+    if (n >= argc) {
+	errx(1, "usage: rtread [-n num] file ...");
+    }
+
+    for (; n < argc; n++) {
+	read_file(argv[n], top);
+	if (n + 1 < argc) {
+	    printf("\n");
+	}
+    }
+
+    return 0;
+}
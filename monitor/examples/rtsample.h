@@ -0,0 +1,181 @@
+/*
+ *  Copyright (c) 2019-2020, Rice University.
+ *  See LICENSE for details.
+ *
+ *  ----------------------------------------------------------------------
+ *
+ *  Binary sample file format, written by realtime.c and read by
+ *  rtread.c and rtsym.c.
+ *
+ *  The file is a fixed header, a sequence of sample chunks (and maybe
+ *  a context tree), then the thread table and the load map.  The
+ *  tables are written at end of process and the header is rewritten
+ *  with their offsets, so a file with zero offsets was cut short (the
+ *  chunks are still usable).
+ *
+ *  All integers after the header are LEB128 varints, signed values
+ *  are zigzag encoded.
+ *
+ *  Chunk:
+ *    tag (RTS_TAG_CHUNK), tnum, num samples, length in bytes of
+ *    the rest of the chunk, base usec, then num samples of
+ *    ((zigzag delta usec << 2) | flags, zigzag delta pc), each delta
+ *    from the previous sample in the chunk (the first usec from
+ *    base, the first pc from 0).
+ *
+ *    If flags has RTS_FLAG_WEIGHT, the weight follows, otherwise the
+ *    weight is 1.  The weight is the number of timer expirations the
+ *    sample stands for.
+ *
+ *    If flags has RTS_FLAG_STACK, the number of callers follows and
+ *    then the callers' return addresses, innermost first, each as a
+ *    zigzag delta from the previous frame (the first from the pc).
+ *
+ *  Context tree (at most one, after the chunks):
+ *    tag (RTS_TAG_CCT), num nodes, length in bytes of the rest, then
+ *    num nodes of (parent, zigzag delta addr, self weight).  Nodes
+ *    are numbered from 1 in order, 0 is the root, and a parent comes
+ *    before its children.  The addr delta is from the parent's addr
+ *    (0 for the root).  The addr is a return address, or the pc for
+ *    the innermost node of a sample.
+ *
+ *  Version 4 has no context tree, version 3 has only the weight flag
+ *  (usec << 1 | w) and version 2 has no flags.  Readers accept all of
+ *  them.
+ *
+ *  Thread table (num_threads entries):
+ *    tnum, start usec, count, written, dropped
+ *
+ *  Load map (num_modules entries):
+ *    start, length, start address in the file, path length, path
+ *    bytes
+ *
+ *  Times are usec since the process start.
+ */
+
+#ifndef _RTSAMPLE_H_
+#define _RTSAMPLE_H_
+
+#include <stdint.h>
+
+#define RTS_MAGIC    "RTSAMPLE"
+#define RTS_VERSION  5
+#define RTS_VERSION_MIN  2
+
+#define RTS_TAG_CHUNK  1
+#define RTS_TAG_CCT    2
+
+#define RTS_FLAG_WEIGHT  1
+#define RTS_FLAG_STACK   2
+
+#define RTS_CLOCK_REAL  0
+#define RTS_CLOCK_CPU   1
+#define RTS_CLOCK_PERF  2
+
+// max bytes for one varint
+#define RTS_VARINT_MAX  10
+
+struct rts_header {
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  header_size;
+    uint32_t  pid;
+    uint32_t  clock;
+    uint64_t  period;
+    uint64_t  start_sec;
+    uint64_t  start_usec;
+    uint64_t  thread_off;
+    uint64_t  thread_num;
+    uint64_t  module_off;
+    uint64_t  module_num;
+};
+
+//----------------------------------------------------------------------
+
+static inline uint64_t
+rts_zigzag(int64_t val)
+{
+    return ((uint64_t) val << 1) ^ (uint64_t) (val >> 63);
+}
+
+static inline int64_t
+rts_unzigzag(uint64_t val)
+{
+    return (int64_t) (val >> 1) ^ - (int64_t) (val & 1);
+}
+
+/*
+ *  Encode val at buf and return the new end.
+ */
+static inline uint8_t *
+rts_put_varint(uint8_t *buf, uint64_t val)
+{
+    while (val >= 0x80) {
+	*buf++ = (uint8_t) (val | 0x80);
+	val >>= 7;
+    }
+    *buf++ = (uint8_t) val;
+
+    return buf;
+}
+
+static inline int
+rts_varint_len(uint64_t val)
+{
+    int len = 1;
+
+    while (val >= 0x80) {
+	val >>= 7;
+	len++;
+    }
+
+    return len;
+}
+
+/*
+ *  Decode a varint at *pos, not reading past end.  Returns 0 on
+ *  success, or -1 if the varint runs off the end.
+ */
+static inline int
+rts_get_varint(const uint8_t **pos, const uint8_t *end, uint64_t *val)
+{
+    const uint8_t *p = *pos;
+    uint64_t ans = 0;
+    int shift = 0;
+
+    while (p < end && shift < 64) {
+	uint8_t byte = *p++;
+
+	ans |= (uint64_t) (byte & 0x7f) << shift;
+	if ((byte & 0x80) == 0) {
+	    *pos = p;
+	    *val = ans;
+	    return 0;
+	}
+	shift += 7;
+    }
+
+    return -1;
+}
+
+/*
+ *  Decode the usec field of a sample, returning the zigzag delta in
+ *  *delta and the RTS_FLAG bits.
+ */
+static inline int
+rts_usec_field(uint64_t val, uint32_t version, uint64_t *delta)
+{
+    if (version < 3) {
+	*delta = val;
+	return 0;
+    }
+    if (version < 4) {
+	*delta = val >> 1;
+	return (int) (val & RTS_FLAG_WEIGHT);
+    }
+    *delta = val >> 2;
+
+    return (int) (val & (RTS_FLAG_WEIGHT | RTS_FLAG_STACK));
+}
+
+#endif  // _RTSAMPLE_H_
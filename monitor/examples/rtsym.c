@@ -0,0 +1,763 @@
+/*
+ *  Copyright (c) 2019-2020, Rice University.
+ *  See LICENSE for details.
+ *
+ *  ----------------------------------------------------------------------
+ *
+ *  Offline symbolization for sample files from realtime.c (see
+ *  rtsample.h).  Map each PC to a module through the file's load map,
+ *  then resolve the addresses to function, file and line with
+ *  elfutils (libelf for the symbol table, libdw for line tables).
+ *
+ *  Usage:
+ *    rtsym [-l] [-n num] [-j threads] file ...
+ *
+ *  where -l reports by source line instead of by function, num is the
+ *  number of entries to print (default 30), and threads is the number
+ *  of threads for symbolization (default is the number of CPUs).
+ *
+ *  Build with: make rtsym ELFUTILS=/path/to/elfutils/install
+ *
+ *  The work is batched per module: all the addresses for a module
+ *  are sorted, then the module is opened once and its addresses are
+ *  resolved in order, so the current CU and its line table (cached
+ *  inside libdw) are reused for neighboring addresses.  Modules are
+ *  spread across threads, each module in only one thread, so no
+ *  libelf or libdw handle is shared.  Separate debuginfo files are
+ *  not followed.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <gelf.h>
+#include <libelf.h>
+#include <elfutils/libdw.h>
+
+#include "rtsample.h"
+
+#define DEFAULT_TOP  30
+#define UNKNOWN  "??"
+
+struct addr_info {
+    uint64_t  addr;
+    long      count;
+    const char * func;
+    const char * file;
+    int       line;
+};
+
+struct func_sym {
+    uint64_t  value;
+    uint64_t  size;
+    const char * name;
+};
+
+struct sym_module {
+    const char * path;
+    struct addr_info * addr;
+    long   num_addr;
+    long   max_addr;
+    long   count;
+    int    fd;
+    Elf  * elf;
+    Dwarf * dwarf;
+    struct func_sym * sym;
+    long   num_sym;
+};
+
+struct pc_weight {
+    uint64_t  pc;
+    uint64_t  weight;
+};
+
+struct file_module {
+    uint64_t  start;
+    uint64_t  len;
+    uint64_t  file_start;
+    struct sym_module * mod;
+};
+
+struct report_entry {
+    long   count;
+    const char * path;
+    const char * func;
+    const char * file;
+    int    line;
+};
+
+static struct sym_module ** module_list;
+static long num_modules;
+static long max_modules;
+
+static long total_samples;
+static long unknown_samples;
+
+static long next_module;
+static int  by_line = 0;
+
+//----------------------------------------------------------------------
+//  Collect addresses per module
+//----------------------------------------------------------------------
+
+static struct sym_module *
+get_module(const char *path, int len)
+{
+    for (long i = 0; i < num_modules; i++) {
+	if (strncmp(module_list[i]->path, path, len) == 0
+	    && module_list[i]->path[len] == 0) {
+	    return module_list[i];
+	}
+    }
+
+    if (num_modules >= max_modules) {
+	max_modules = (max_modules > 0) ? 2 * max_modules : 32;
+	module_list = realloc(module_list, max_modules * sizeof(*module_list));
+	if (module_list == NULL) {
+	    err(1, "realloc for module list failed");
+	}
+    }
+
+    struct sym_module *mod = calloc(1, sizeof(*mod));
+    if (mod == NULL || (mod->path = strndup(path, len)) == NULL) {
+	err(1, "malloc for module failed");
+    }
+    mod->fd = -1;
+    module_list[num_modules++] = mod;
+
+    return mod;
+}
+
+static void
+add_addr(struct sym_module *mod, uint64_t addr, long count)
+{
+    if (mod->num_addr >= mod->max_addr) {
+	mod->max_addr = (mod->max_addr > 0) ? 2 * mod->max_addr : 1024;
+	mod->addr = realloc(mod->addr, mod->max_addr * sizeof(struct addr_info));
+	if (mod->addr == NULL) {
+	    err(1, "realloc for addresses failed");
+	}
+    }
+
+    struct addr_info *ai = &mod->addr[mod->num_addr++];
+    memset(ai, 0, sizeof(*ai));
+    ai->addr = addr;
+    ai->count = count;
+    mod->count += count;
+}
+
+static int
+cmp_pc_weight(const void *p1, const void *p2)
+{
+    uint64_t a = ((const struct pc_weight *) p1)->pc;
+    uint64_t b = ((const struct pc_weight *) p2)->pc;
+
+    return (a < b) ? -1 : (a > b);
+}
+
+static int
+cmp_file_module(const void *p1, const void *p2)
+{
+    const struct file_module *a = p1, *b = p2;
+
+    return (a->start < b->start) ? -1 : (a->start > b->start);
+}
+
+static struct file_module *
+find_file_module(struct file_module *fmod, long num, uint64_t pc)
+{
+    long lo = 0, hi = num;
+
+    while (lo < hi) {
+	long mid = (lo + hi) / 2;
+
+	if (pc < fmod[mid].start) {
+	    hi = mid;
+	}
+	else if (pc >= fmod[mid].start + fmod[mid].len) {
+	    lo = mid + 1;
+	}
+	else {
+	    return &fmod[mid];
+	}
+    }
+
+    return NULL;
+}
+
+#define GET(var)  do {					\
+    if (rts_get_varint(&p, end, &(var)) != 0) {		\
+	errx(1, "%s: truncated at offset %ld",		\
+	     name, (long) (p - base));			\
+    }							\
+} while (0)
+
+/*
+ *  Decode one sample file and add its PCs to the modules as file
+ *  addresses.  The PCs are sorted first, so each module lookup and
+ *  each add is for a run of samples at one PC.
+ */
+static void
+read_file(const char *name)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0) {
+	err(1, "unable to open: %s", name);
+    }
+    if (fstat(fd, &st) != 0) {
+	err(1, "stat failed: %s", name);
+    }
+    if (st.st_size < (off_t) sizeof(struct rts_header)) {
+	errx(1, "%s: too short for a sample file", name);
+    }
+
+    const uint8_t *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+	err(1, "mmap failed: %s", name);
+    }
+    close(fd);
+
+    const uint8_t *limit = base + st.st_size;
+    const uint8_t *end = limit;
+    const uint8_t *p;
+    const struct rts_header *hdr = (const struct rts_header *) base;
+
+    if (memcmp(hdr->magic, RTS_MAGIC, sizeof(hdr->magic)) != 0) {
+	errx(1, "%s: not a sample file", name);
+    }
+    if (hdr->version < RTS_VERSION_MIN || hdr->version > RTS_VERSION
+	|| hdr->header_size != sizeof(*hdr)) {
+	errx(1, "%s: unsupported version %u", name, hdr->version);
+    }
+    if (hdr->thread_off == 0 || hdr->module_off == 0
+	|| hdr->thread_off > (uint64_t) st.st_size
+	|| hdr->module_off > (uint64_t) st.st_size) {
+	errx(1, "%s: no load map, process did not finish", name);
+    }
+
+    // load map
+    long num_fmod = hdr->module_num;
+    struct file_module *fmod = calloc(num_fmod + 1, sizeof(*fmod));
+    if (fmod == NULL) {
+	err(1, "calloc for load map failed");
+    }
+
+    p = base + hdr->module_off;
+    for (long i = 0; i < num_fmod; i++) {
+	uint64_t path_len;
+
+	GET(fmod[i].start);
+	GET(fmod[i].len);
+	GET(fmod[i].file_start);
+	GET(path_len);
+	if (path_len > (uint64_t) (end - p)) {
+	    errx(1, "%s: bad module path length", name);
+	}
+	fmod[i].mod = get_module((const char *) p, path_len);
+	p += path_len;
+    }
+    qsort(fmod, num_fmod, sizeof(*fmod), cmp_file_module);
+
+    // samples
+    struct pc_weight *pcs = NULL;
+    long num_pcs = 0, max_pcs = 0;
+    uint64_t tag, tnum, num, len, usec, val, delta, weight, depth;
+
+    p = base + sizeof(struct rts_header);
+    limit = base + hdr->thread_off;
+
+    while (p < limit) {
+	end = limit;
+	GET(tag);
+	// flat profile, skip the context tree
+	if (tag == RTS_TAG_CCT) {
+	    GET(num);
+	    GET(len);
+	    if (len > (uint64_t) (limit - p)) {
+		errx(1, "%s: bad context tree length at offset %ld",
+		     name, (long) (p - base));
+	    }
+	    p += len;
+	    continue;
+	}
+	if (tag != RTS_TAG_CHUNK) {
+	    errx(1, "%s: bad chunk tag %lu at offset %ld",
+		 name, tag, (long) (p - base));
+	}
+	GET(tnum);
+	GET(num);
+	GET(len);
+	if (len > (uint64_t) (limit - p)) {
+	    errx(1, "%s: bad chunk length at offset %ld", name, (long) (p - base));
+	}
+	end = p + len;
+
+	if (num_pcs + num > max_pcs) {
+	    max_pcs = 2 * (num_pcs + num);
+	    pcs = realloc(pcs, max_pcs * sizeof(struct pc_weight));
+	    if (pcs == NULL) {
+		err(1, "realloc for samples failed");
+	    }
+	}
+
+	GET(usec);
+	uint64_t last_pc = 0;
+
+	for (uint64_t j = 0; j < num; j++) {
+	    GET(val);
+	    int flags = rts_usec_field(val, hdr->version, &delta);
+	    GET(val);
+	    last_pc += rts_unzigzag(val);
+	    weight = 1;
+	    if (flags & RTS_FLAG_WEIGHT) {
+		GET(weight);
+	    }
+	    // flat profile, skip the callers
+	    if (flags & RTS_FLAG_STACK) {
+		GET(depth);
+		for (uint64_t k = 0; k < depth; k++) {
+		    GET(val);
+		}
+	    }
+	    pcs[num_pcs].pc = last_pc;
+	    pcs[num_pcs].weight = weight;
+	    num_pcs++;
+	}
+    }
+
+    qsort(pcs, num_pcs, sizeof(struct pc_weight), cmp_pc_weight);
+
+    struct file_module *fm = NULL;
+
+    for (long i = 0; i < num_pcs; ) {
+	long j = i + 1;
+
+	uint64_t pc = pcs[i].pc;
+	long count = pcs[i].weight;
+
+	while (j < num_pcs && pcs[j].pc == pc) {
+	    count += pcs[j].weight;
+	    j++;
+	}
+	if (fm == NULL || pc < fm->start || pc >= fm->start + fm->len) {
+	    fm = find_file_module(fmod, num_fmod, pc);
+	}
+	if (fm != NULL) {
+	    add_addr(fm->mod, pc - fm->start + fm->file_start, count);
+	}
+	else {
+	    unknown_samples += count;
+	}
+	total_samples += count;
+	i = j;
+    }
+
+    free(pcs);
+    free(fmod);
+    munmap((void *) base, st.st_size);
+}
+
+//----------------------------------------------------------------------
+//  Symbolize one module
+//----------------------------------------------------------------------
+
+static int
+cmp_addr(const void *p1, const void *p2)
+{
+    const struct addr_info *a = p1, *b = p2;
+
+    return (a->addr < b->addr) ? -1 : (a->addr > b->addr);
+}
+
+static int
+cmp_sym(const void *p1, const void *p2)
+{
+    const struct func_sym *a = p1, *b = p2;
+
+    return (a->value < b->value) ? -1 : (a->value > b->value);
+}
+
+/*
+ *  Read the function symbols from .symtab, or from .dynsym if the
+ *  module is stripped.
+ */
+static void
+read_symbols(struct sym_module *mod)
+{
+    Elf_Scn *scn = NULL, *symtab = NULL;
+    GElf_Shdr shdr, symtab_shdr;
+
+    memset(&symtab_shdr, 0, sizeof(symtab_shdr));
+
+    while ((scn = elf_nextscn(mod->elf, scn)) != NULL) {
+	if (gelf_getshdr(scn, &shdr) == NULL) {
+	    continue;
+	}
+	if (shdr.sh_type == SHT_SYMTAB
+	    || (shdr.sh_type == SHT_DYNSYM && symtab == NULL)) {
+	    symtab = scn;
+	    symtab_shdr = shdr;
+	}
+    }
+    if (symtab == NULL || symtab_shdr.sh_entsize == 0) {
+	return;
+    }
+
+    Elf_Data *data = elf_getdata(symtab, NULL);
+    long num = symtab_shdr.sh_size / symtab_shdr.sh_entsize;
+
+    mod->sym = malloc((num + 1) * sizeof(struct func_sym));
+    if (data == NULL || mod->sym == NULL) {
+	return;
+    }
+
+    for (long i = 0; i < num; i++) {
+	GElf_Sym sym;
+
+	if (gelf_getsym(data, i, &sym) == NULL || sym.st_value == 0
+	    || sym.st_shndx == SHN_UNDEF
+	    || (GELF_ST_TYPE(sym.st_info) != STT_FUNC
+		&& GELF_ST_TYPE(sym.st_info) != STT_GNU_IFUNC)) {
+	    continue;
+	}
+
+	struct func_sym *fs = &mod->sym[mod->num_sym++];
+	fs->value = sym.st_value;
+	fs->size = sym.st_size;
+	fs->name = elf_strptr(mod->elf, symtab_shdr.sh_link, sym.st_name);
+    }
+
+    qsort(mod->sym, mod->num_sym, sizeof(struct func_sym), cmp_sym);
+}
+
+static const char *
+find_symbol(struct sym_module *mod, uint64_t addr)
+{
+    long lo = 0, hi = mod->num_sym;
+
+    // last symbol with value <= addr
+    while (lo < hi) {
+	long mid = (lo + hi) / 2;
+
+	if (mod->sym[mid].value <= addr) {
+	    lo = mid + 1;
+	}
+	else {
+	    hi = mid;
+	}
+    }
+    if (lo == 0) {
+	return NULL;
+    }
+
+    struct func_sym *fs = &mod->sym[lo - 1];
+
+    if (fs->size != 0 && addr >= fs->value + fs->size) {
+	return NULL;
+    }
+
+    return fs->name;
+}
+
+static void
+symbolize_module(struct sym_module *mod)
+{
+    Dwarf_Die cu_die;
+    int have_cu = 0;
+
+    qsort(mod->addr, mod->num_addr, sizeof(struct addr_info), cmp_addr);
+
+    // merge the same address from different sample files
+    long n = 0;
+    for (long i = 0; i < mod->num_addr; i++) {
+	if (n > 0 && mod->addr[n - 1].addr == mod->addr[i].addr) {
+	    mod->addr[n - 1].count += mod->addr[i].count;
+	}
+	else {
+	    mod->addr[n++] = mod->addr[i];
+	}
+    }
+    mod->num_addr = n;
+
+    mod->fd = open(mod->path, O_RDONLY);
+    if (mod->fd >= 0) {
+	mod->elf = elf_begin(mod->fd, ELF_C_READ_MMAP, NULL);
+    }
+    if (mod->elf != NULL) {
+	read_symbols(mod);
+	mod->dwarf = dwarf_begin_elf(mod->elf, DWARF_C_READ, NULL);
+    }
+
+    for (long i = 0; i < mod->num_addr; i++) {
+	struct addr_info *ai = &mod->addr[i];
+
+	if (mod->num_sym > 0) {
+	    ai->func = find_symbol(mod, ai->addr);
+	}
+	if (mod->dwarf == NULL) {
+	    continue;
+	}
+
+	// the addresses are sorted, so usually in the same CU as the
+	// last one
+	if (! have_cu || dwarf_haspc(&cu_die, ai->addr) != 1) {
+	    have_cu = (dwarf_addrdie(mod->dwarf, ai->addr, &cu_die) != NULL);
+	}
+	if (have_cu) {
+	    Dwarf_Line *line = dwarf_getsrc_die(&cu_die, ai->addr);
+
+	    if (line != NULL) {
+		ai->file = dwarf_linesrc(line, NULL, NULL);
+		dwarf_lineno(line, &ai->line);
+	    }
+	}
+    }
+}
+
+static void *
+worker(void *arg)
+{
+    for (;;) {
+	long i = __sync_fetch_and_add(&next_module, 1);
+
+	if (i >= num_modules) {
+	    break;
+	}
+	symbolize_module(module_list[i]);
+    }
+
+    return NULL;
+}
+
+//----------------------------------------------------------------------
+//  Report
+//----------------------------------------------------------------------
+
+static int
+cmp_str(const char *a, const char *b)
+{
+    if (a == b) {
+	return 0;
+    }
+    return strcmp((a != NULL) ? a : "", (b != NULL) ? b : "");
+}
+
+static int
+cmp_key(const void *p1, const void *p2)
+{
+    const struct report_entry *a = p1, *b = p2;
+    int ans;
+
+    if ((ans = cmp_str(a->path, b->path)) != 0) {
+	return ans;
+    }
+    if ((ans = cmp_str(a->func, b->func)) != 0) {
+	return ans;
+    }
+    if (by_line) {
+	if ((ans = cmp_str(a->file, b->file)) != 0) {
+	    return ans;
+	}
+	return a->line - b->line;
+    }
+    return 0;
+}
+
+static int
+cmp_count(const void *p1, const void *p2)
+{
+    const struct report_entry *a = p1, *b = p2;
+
+    if (a->count != b->count) {
+	return (a->count > b->count) ? -1 : 1;
+    }
+    return cmp_key(p1, p2);
+}
+
+static int
+cmp_module_size(const void *p1, const void *p2)
+{
+    const struct sym_module *a = *(struct sym_module * const *) p1;
+    const struct sym_module *b = *(struct sym_module * const *) p2;
+
+    return (a->num_addr > b->num_addr) ? -1 : (a->num_addr < b->num_addr);
+}
+
+static void
+print_report(long top)
+{
+    struct report_entry *list;
+    long num = 0, n = 0;
+
+    for (long i = 0; i < num_modules; i++) {
+	num += module_list[i]->num_addr;
+    }
+    list = malloc((num + 1) * sizeof(struct report_entry));
+    if (list == NULL) {
+	err(1, "malloc for report failed");
+    }
+
+    for (long i = 0; i < num_modules; i++) {
+	struct sym_module *mod = module_list[i];
+	const char *path = strrchr(mod->path, '/');
+
+	path = (path != NULL) ? path + 1 : mod->path;
+
+	for (long j = 0; j < mod->num_addr; j++) {
+	    struct addr_info *ai = &mod->addr[j];
+
+	    list[n].count = ai->count;
+	    list[n].path = path;
+	    list[n].func = ai->func;
+	    list[n].file = ai->file;
+	    list[n].line = ai->line;
+	    n++;
+	}
+    }
+
+    // merge equal keys, then sort by count
+    qsort(list, n, sizeof(struct report_entry), cmp_key);
+    num = 0;
+    for (long i = 0; i < n; i++) {
+	if (num > 0 && cmp_key(&list[num - 1], &list[i]) == 0) {
+	    list[num - 1].count += list[i].count;
+	}
+	else {
+	    list[num++] = list[i];
+	}
+    }
+    qsort(list, num, sizeof(struct report_entry), cmp_count);
+
+    printf("total samples: %ld   unknown: %ld\n\n", total_samples, unknown_samples);
+    printf("%10s  %6s  %-24s  %s\n", "samples", "pct", "module",
+	   by_line ? "function   file:line" : "function");
+
+    for (long i = 0; i < num && i < top; i++) {
+	struct report_entry *re = &list[i];
+
+	printf("%10ld  %5.1f%%  %-24s  %s", re->count,
+	       100.0 * re->count / (total_samples > 0 ? total_samples : 1),
+	       re->path, (re->func != NULL) ? re->func : UNKNOWN);
+	if (by_line) {
+	    printf("   %s:%d", (re->file != NULL) ? re->file : UNKNOWN, re->line);
+	}
+	printf("\n");
+    }
+
+    free(list);
+}
+
+//----------------------------------------------------------------------
+
+int
+main(int argc, char **argv)
+{
+    struct timeval start, mid, now;
+    long top = DEFAULT_TOP;
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = 1;
+
+    for (; n < argc && argv[n][0] == '-'; n++) {
+	if (strcmp(argv[n], "-l") == 0) {
+	    by_line = 1;
+	}
+	else if (strcmp(argv[n], "-n") == 0 && n + 1 < argc) {
+	    top = atol(argv[++n]);
+	}
+	else if (strcmp(argv[n], "-j") == 0 && n + 1 < argc) {
+	    num_threads = atol(argv[++n]);
+	}
+	else {
+	    break;
+	}
+    }
+
+    if (n >= argc) {
+	errx(1, "usage: rtsym [-l] [-n num] [-j threads] file ...");
+    }
+    if (num_threads < 1) {
+	num_threads = 1;
+    }
+
+    if (elf_version(EV_CURRENT) == EV_NONE) {
+	errx(1, "libelf is out of date");
+    }
+
+    gettimeofday(&start, NULL);
+
+    for (; n < argc; n++) {
+	read_file(argv[n]);
+    }
+
+    gettimeofday(&mid, NULL);
+
+    // biggest modules first, for balance
+    qsort(module_list, num_modules, sizeof(*module_list), cmp_module_size);
+
+    if (num_threads > num_modules) {
+	num_threads = (num_modules > 0) ? num_modules : 1;
+    }
+
+    pthread_t *td = malloc(num_threads * sizeof(pthread_t));
+    if (td == NULL) {
+	err(1, "malloc for threads failed");
+    }
+    for (long i = 1; i < num_threads; i++) {
+	if (pthread_create(&td[i], NULL, worker, NULL) != 0) {
+	    errx(1, "pthread_create failed");
+	}
+    }
+    worker(NULL);
+    for (long i = 1; i < num_threads; i++) {
+	pthread_join(td[i], NULL);
+    }
+    free(td);
+
+    gettimeofday(&now, NULL);
+
+    long num_addr = 0;
+    for (long i = 0; i < num_modules; i++) {
+	num_addr += module_list[i]->num_addr;
+    }
+
+    fprintf(stderr, "read %ld samples in %.3f sec, symbolized %ld addresses "
+	    "in %ld modules in %.3f sec (%ld threads)\n",
+	    total_samples,
+	    (mid.tv_sec - start.tv_sec) + (mid.tv_usec - start.tv_usec) / 1000000.0,
+	    num_addr, num_modules,
+	    (now.tv_sec - mid.tv_sec) + (now.tv_usec - mid.tv_usec) / 1000000.0,
+	    num_threads);
+
+    print_report(top);
+
+    for (long i = 0; i < num_modules; i++) {
+	struct sym_module *mod = module_list[i];
+
+	if (mod->dwarf != NULL) {
+	    dwarf_end(mod->dwarf);
+	}
+	if (mod->elf != NULL) {
+	    elf_end(mod->elf);
+	}
+	if (mod->fd >= 0) {
+	    close(mod->fd);
+	}
+    }
+
+    return 0;
+}
@@ -1,5 +1,5 @@
 /*
- *  Libmonitor default callback functions.
+ *  Libmonitor callbacks and event log.
  *
  *  Copyright (c) 2019-2020, Rice University.
  *  All rights reserved.
@@ -32,79 +32,522 @@
  *  if advised of the possibility of such damage.
  */
 
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "monitor.h"
 #include "monitor-common.h"
 
 #define DEBUG_PREFIX  "---> monitor: "
 
-#define MONITOR_DEBUG1(fmt) 			\
-    if (monitor_debug()) { 			\
-	fprintf(stderr, DEBUG_PREFIX fmt);	\
-    }
+struct monitor_cb_table monitor_cb_table;
+monitor_once_t monitor_cb_once = MONITOR_ONCE_INITIALIZER;
 
-#define MONITOR_DEBUG(fmt, ...) 		\
-    if (monitor_debug()) { 			\
-        fprintf(stderr, DEBUG_PREFIX fmt, __VA_ARGS__);  \
-    }
+static struct monitor_callbacks monitor_clients [MONITOR_MAX_CLIENTS];
+static int monitor_num_clients = 0;
+static int monitor_cb_frozen = 0;
 
 //----------------------------------------------------------------------
 
-void  __attribute__ ((weak))
-monitor_begin_process_cb(void)
+/*
+ *  The default callbacks only print with MONITOR_DEBUG.  The
+ *  monitor_*_cb names are weak aliases for them, so if a name's
+ *  address is not the default, the client has overridden it.
+ */
+static void
+default_begin_process(void)
 {
-    MONITOR_DEBUG1("begin process\n");
+    fprintf(stderr, DEBUG_PREFIX "begin process\n");
 }
 
-void  __attribute__ ((weak))
-monitor_at_main_cb(void)
+static void
+default_at_main(void)
 {
-    MONITOR_DEBUG1("at main\n");
+    fprintf(stderr, DEBUG_PREFIX "at main\n");
 }
 
-void  __attribute__ ((weak))
-monitor_end_process_cb(void)
+static void
+default_end_process(void)
 {
-    MONITOR_DEBUG1("end process\n");
+    fprintf(stderr, DEBUG_PREFIX "end process\n");
 }
 
-void  __attribute__ ((weak))
-monitor_begin_thread_cb(void)
+static void
+default_begin_thread(void)
 {
-    MONITOR_DEBUG1("begin thread\n");
+    fprintf(stderr, DEBUG_PREFIX "begin thread\n");
 }
 
-void  __attribute__ ((weak))
-monitor_end_thread_cb(void)
+static void
+default_end_thread(void)
 {
-    MONITOR_DEBUG1("end thread\n");
+    fprintf(stderr, DEBUG_PREFIX "end thread\n");
 }
 
+void monitor_begin_process_cb(void)
+    __attribute__ ((weak, alias ("default_begin_process")));
+void monitor_at_main_cb(void)
+    __attribute__ ((weak, alias ("default_at_main")));
+void monitor_end_process_cb(void)
+    __attribute__ ((weak, alias ("default_end_process")));
+void monitor_begin_thread_cb(void)
+    __attribute__ ((weak, alias ("default_begin_thread")));
+void monitor_end_thread_cb(void)
+    __attribute__ ((weak, alias ("default_end_thread")));
+
 //----------------------------------------------------------------------
 
-void * __attribute__ ((weak))
-monitor_pre_dlopen_cb(const char *name, int flags)
+static void *
+default_pre_dlopen(const char *name, int flags)
+{
+    fprintf(stderr, DEBUG_PREFIX "pre-dlopen (%s, %d)\n", name, flags);
+    return NULL;
+}
+
+static void
+default_post_dlopen(void *data, void * handle)
 {
-    MONITOR_DEBUG("pre-dlopen (%s, %d)\n", name, flags);
+    fprintf(stderr, DEBUG_PREFIX "post-dlopen: %p\n", handle);
+}
+
+static void *
+default_pre_dlclose(void * handle)
+{
+    fprintf(stderr, DEBUG_PREFIX "pre-dlclose (%p)\n", handle);
     return NULL;
 }
 
-void  __attribute__ ((weak))
-monitor_post_dlopen_cb(void *data, void * handle)
+static void
+default_post_dlclose(void *data, void * handle, int ret)
 {
-    MONITOR_DEBUG("post-dlopen: %p\n", handle);
+    fprintf(stderr, DEBUG_PREFIX "post-dlclose: %p  ret: %d\n", handle, ret);
 }
 
-void * __attribute__ ((weak))
-monitor_pre_dlclose_cb(void * handle)
+void * monitor_pre_dlopen_cb(const char *, int)
+    __attribute__ ((weak, alias ("default_pre_dlopen")));
+void monitor_post_dlopen_cb(void *, void *)
+    __attribute__ ((weak, alias ("default_post_dlopen")));
+void * monitor_pre_dlclose_cb(void *)
+    __attribute__ ((weak, alias ("default_pre_dlclose")));
+void monitor_post_dlclose_cb(void *, void *, int)
+    __attribute__ ((weak, alias ("default_post_dlclose")));
+
+//----------------------------------------------------------------------
+
+static void *
+default_pre_fork(void)
 {
-    MONITOR_DEBUG("pre-dlclose (%p)\n", handle);
+    fprintf(stderr, DEBUG_PREFIX "pre-fork\n");
     return NULL;
 }
 
-void  __attribute__ ((weak))
-monitor_post_dlclose_cb(void *data, void * handle, int ret)
+static void
+default_post_fork_parent(pid_t child, void *data)
+{
+    fprintf(stderr, DEBUG_PREFIX "post-fork parent: child %d\n", (int) child);
+}
+
+static void
+default_post_fork_child(void *data)
 {
-    MONITOR_DEBUG("post-dlclose: %p  ret: %d\n", handle, ret);
+    fprintf(stderr, DEBUG_PREFIX "post-fork child: pid %d\n", (int) getpid());
+}
+
+void * monitor_pre_fork_cb(void)
+    __attribute__ ((weak, alias ("default_pre_fork")));
+void monitor_post_fork_parent_cb(pid_t, void *)
+    __attribute__ ((weak, alias ("default_post_fork_parent")));
+void monitor_post_fork_child_cb(void *)
+    __attribute__ ((weak, alias ("default_post_fork_child")));
+
+//----------------------------------------------------------------------
+
+int
+monitor_register_callbacks(const struct monitor_callbacks * cb)
+{
+    if (cb == NULL || monitor_cb_frozen
+	|| monitor_num_clients >= MONITOR_MAX_CLIENTS) {
+	return -1;
+    }
+
+    monitor_clients[monitor_num_clients] = *cb;
+    monitor_num_clients++;
+
+    return 0;
+}
+
+/*
+ *  The overridden callbacks as a set, plus the defaults with
+ *  MONITOR_DEBUG.
+ */
+#define LEGACY_CB(name)							\
+    legacy->mc_ ## name = (monitor_ ## name ## _cb != default_ ## name)	\
+	? monitor_ ## name ## _cb					\
+	: (monitor_debug() ? default_ ## name : NULL)
+
+static void
+monitor_legacy_callbacks(struct monitor_callbacks * legacy)
+{
+    legacy->mc_priority = MONITOR_PRIORITY_DEFAULT;
+    LEGACY_CB(begin_process);
+    LEGACY_CB(at_main);
+    LEGACY_CB(end_process);
+    LEGACY_CB(begin_thread);
+    LEGACY_CB(end_thread);
+    LEGACY_CB(pre_dlopen);
+    LEGACY_CB(post_dlopen);
+    LEGACY_CB(pre_dlclose);
+    LEGACY_CB(post_dlclose);
+    LEGACY_CB(pre_fork);
+    LEGACY_CB(post_fork_parent);
+    LEGACY_CB(post_fork_child);
+    legacy->mc_module_load = NULL;
+    legacy->mc_module_unload = NULL;
+}
+
+/*
+ *  Fill in one event's list from the sets in priority order, or in
+ *  reverse.  The member is at offset in struct monitor_callbacks.
+ *  For a pre event, pos gets each set's index in the list, and for a
+ *  post event, pos is the pre event's.
+ */
+static void
+monitor_cb_build(struct monitor_cb_list * list, struct monitor_callbacks ** order,
+		 int num, size_t offset, int reverse, int * pos)
+{
+    list->cl_num = 0;
+
+    for (int k = 0; k < num; k++) {
+	int n = reverse ? num - 1 - k : k;
+	void (* fcn) (void) = * (void (**) (void)) ((char *) order[n] + offset);
+	struct monitor_cb_entry * entry;
+
+	if (fcn == NULL) {
+	    if (pos != NULL && ! reverse) {
+		pos[n] = -1;
+	    }
+	    continue;
+	}
+
+	entry = &list->cl_entry[list->cl_num];
+	entry->ce_fcn = fcn;
+	entry->ce_data = -1;
+
+	if (pos != NULL) {
+	    if (reverse) {
+		entry->ce_data = pos[n];
+	    }
+	    else {
+		pos[n] = list->cl_num;
+	    }
+	}
+	list->cl_num++;
+    }
+}
+
+#define CB_BUILD(name, reverse, pos)					\
+    monitor_cb_build(&monitor_cb_table.ct_ ## name, order, num,	\
+		     offsetof(struct monitor_callbacks, mc_ ## name), reverse, pos)
+
+/*
+ *  Freeze the callbacks, called once through monitor_callback_freeze()
+ *  before the first event.
+ */
+void
+monitor_callback_init(void)
+{
+    struct monitor_callbacks legacy;
+    struct monitor_callbacks * order [MONITOR_CB_SLOTS];
+    int pos [MONITOR_CB_SLOTS];
+    int num = 0;
+
+    monitor_cb_frozen = 1;
+
+    monitor_legacy_callbacks(&legacy);
+    order[num++] = &legacy;
+    for (int n = 0; n < monitor_num_clients; n++) {
+	order[num++] = &monitor_clients[n];
+    }
+
+    // stable insertion sort by priority
+    for (int i = 1; i < num; i++) {
+	struct monitor_callbacks * cb = order[i];
+	int j;
+
+	for (j = i; j > 0 && order[j - 1]->mc_priority > cb->mc_priority; j--) {
+	    order[j] = order[j - 1];
+	}
+	order[j] = cb;
+    }
+
+    CB_BUILD(begin_process, 0, NULL);
+    CB_BUILD(at_main, 0, NULL);
+    CB_BUILD(end_process, 1, NULL);
+    CB_BUILD(begin_thread, 0, NULL);
+    CB_BUILD(end_thread, 1, NULL);
+
+    CB_BUILD(pre_dlopen, 0, pos);
+    CB_BUILD(post_dlopen, 1, pos);
+
+    CB_BUILD(pre_dlclose, 0, pos);
+    CB_BUILD(post_dlclose, 1, pos);
+
+    CB_BUILD(pre_fork, 0, pos);
+    CB_BUILD(post_fork_parent, 1, pos);
+    CB_BUILD(post_fork_child, 1, pos);
+
+    CB_BUILD(module_load, 0, NULL);
+    CB_BUILD(module_unload, 1, NULL);
+}
+
+//----------------------------------------------------------------------
+//  Event log
+//----------------------------------------------------------------------
+
+#define MONITOR_LOG_VAR  "MONITOR_LOG"
+#define LOG_RING_MASK  (MONITOR_LOG_RING_SIZE - 1)
+#define LOG_WRITE_BATCH  64
+#define LOG_MAX_SUFFIX  100
+#define LOG_NUM_STRIPES  16
+#define LOG_STRIPE_MASK  (LOG_NUM_STRIPES - 1)
+
+/*
+ *  A slot is a tiny seqlock.  The writer clears ls_seq, fills in the
+ *  event and then stores its sequence number, and the reader keeps a
+ *  copy only if ls_seq has that number before and after.  Ring slots
+ *  use ticket + 1, the first events use 1 while being written and 2
+ *  when done.
+ */
+struct log_slot {
+    uint64_t  ls_seq;
+    struct monitor_log_event  ls_event;
+};
+
+static struct log_slot log_ring [MONITOR_LOG_RING_SIZE];
+static uint64_t log_head = 0;
+
+/*
+ *  The totals are striped by thread number, each stripe on its own
+ *  cache lines, so threads don't bounce one line on every event.
+ *  monitor_log_dump() sums the stripes.
+ */
+struct log_stripe {
+    struct monitor_log_total  lt [MONITOR_LOG_NUM_TYPES];
+} __attribute__ ((aligned (64)));
+
+static struct log_slot log_first [MONITOR_LOG_NUM_TYPES];
+static struct log_stripe log_total [LOG_NUM_STRIPES];
+
+static char * log_dir = NULL;
+
+/*
+ *  Record an event that began at start (from monitor_log_time()) and
+ *  ends now.  Lock-free and doesn't call malloc().  The first event
+ *  slot is only written once, the shared cost is the fetch and add
+ *  for the ring ticket and the ring slot itself.
+ */
+void
+monitor_log_event(int type, uint64_t start, void * arg)
+{
+    struct monitor_thread_info * info = monitor_get_thread_info();
+    long thread_num = (info != NULL) ? info->mti_thread_num : -1;
+    struct monitor_log_total * total =
+	&log_total[(unsigned long) thread_num & LOG_STRIPE_MASK].lt[type];
+    struct monitor_log_event event;
+    struct log_slot * slot;
+    uint64_t dur, max, ticket;
+
+    dur = monitor_log_time() - start;
+
+    event.le_time = start;
+    event.le_dur = dur;
+    event.le_arg = (uint64_t) (uintptr_t) arg;
+    event.le_thread = thread_num;
+    event.le_type = type;
+
+    __atomic_add_fetch(&total->lt_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&total->lt_total, dur, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&total->lt_max, __ATOMIC_RELAXED);
+    while (dur > max
+	   && ! __atomic_compare_exchange_n(&total->lt_max, &max, dur, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    slot = &log_first[type];
+    if (__atomic_load_n(&slot->ls_seq, __ATOMIC_RELAXED) == 0
+	&& __sync_bool_compare_and_swap(&slot->ls_seq, 0, 1)) {
+	slot->ls_event = event;
+	__atomic_store_n(&slot->ls_seq, 2, __ATOMIC_RELEASE);
+    }
+
+    ticket = __atomic_fetch_add(&log_head, 1, __ATOMIC_RELAXED);
+    slot = &log_ring[ticket & LOG_RING_MASK];
+
+    __atomic_store_n(&slot->ls_seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->ls_event = event;
+    __atomic_store_n(&slot->ls_seq, ticket + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *  Copy the slot's event if it has sequence number seq, otherwise
+ *  return an event of type MONITOR_LOG_NONE.
+ */
+static void
+log_copy_slot(struct log_slot * slot, uint64_t seq, struct monitor_log_event * event)
+{
+    if (__atomic_load_n(&slot->ls_seq, __ATOMIC_ACQUIRE) == seq) {
+	*event = slot->ls_event;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->ls_seq, __ATOMIC_RELAXED) == seq) {
+	    return;
+	}
+    }
+    memset(event, 0, sizeof(*event));
+}
+
+static int
+log_write(int fd, const void * buf, size_t len)
+{
+    const char * pos = buf;
+
+    while (len > 0) {
+	ssize_t ret = write(fd, pos, len);
+
+	if (ret < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return -1;
+	}
+	pos += ret;
+	len -= ret;
+    }
+
+    return 0;
+}
+
+/*
+ *  Write the log to fd.  Events written while we copy may or may not
+ *  be included.  A ring slot that is overwritten during the copy
+ *  comes out as type MONITOR_LOG_NONE, so the number of events always
+ *  matches the header.
+ */
+int
+monitor_log_dump(int fd)
+{
+    struct monitor_log_header header;
+    struct monitor_log_total total [MONITOR_LOG_NUM_TYPES];
+    struct monitor_log_event event [LOG_WRITE_BATCH];
+    uint64_t head, start, ticket;
+    int type, num;
+
+    head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+    start = (head > MONITOR_LOG_RING_SIZE) ? head - MONITOR_LOG_RING_SIZE : 0;
+
+    memset(&header, 0, sizeof(header));
+    strncpy(header.lh_magic, MONITOR_LOG_MAGIC, sizeof(header.lh_magic));
+    header.lh_version = MONITOR_LOG_VERSION;
+    header.lh_header_size = sizeof(header);
+    header.lh_pid = getpid();
+    header.lh_num_types = MONITOR_LOG_NUM_TYPES;
+    header.lh_num_events = head - start;
+    header.lh_lost = start;
+    header.lh_dump_time = monitor_log_time();
+
+    memset(total, 0, sizeof(total));
+    for (int n = 0; n < LOG_NUM_STRIPES; n++) {
+	for (type = 0; type < MONITOR_LOG_NUM_TYPES; type++) {
+	    struct monitor_log_total * lt = &log_total[n].lt[type];
+	    uint64_t max = __atomic_load_n(&lt->lt_max, __ATOMIC_RELAXED);
+
+	    total[type].lt_count += __atomic_load_n(&lt->lt_count, __ATOMIC_RELAXED);
+	    total[type].lt_total += __atomic_load_n(&lt->lt_total, __ATOMIC_RELAXED);
+	    if (max > total[type].lt_max) {
+		total[type].lt_max = max;
+	    }
+	}
+    }
+
+    if (log_write(fd, &header, sizeof(header)) != 0
+	|| log_write(fd, total, sizeof(total)) != 0) {
+	return -1;
+    }
+
+    // MONITOR_LOG_NUM_TYPES is less than one batch
+    for (type = 0; type < MONITOR_LOG_NUM_TYPES; type++) {
+	log_copy_slot(&log_first[type], 2, &event[type]);
+    }
+    if (log_write(fd, event, MONITOR_LOG_NUM_TYPES * sizeof(event[0])) != 0) {
+	return -1;
+    }
+
+    for (ticket = start; ticket < head; ticket += num) {
+	num = (head - ticket < LOG_WRITE_BATCH) ? head - ticket : LOG_WRITE_BATCH;
+
+	for (int k = 0; k < num; k++) {
+	    log_copy_slot(&log_ring[(ticket + k) & LOG_RING_MASK],
+			  ticket + k + 1, &event[k]);
+	}
+	if (log_write(fd, event, num * sizeof(event[0])) != 0) {
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ *  Called from monitor init, too early for anything but getenv().
+ */
+void
+monitor_log_init(void)
+{
+    char * str = getenv(MONITOR_LOG_VAR);
+
+    if (str != NULL && str[0] != 0) {
+	log_dir = str;
+    }
+}
+
+/*
+ *  With MONITOR_LOG, write the log after the end process callbacks.
+ *  Exec keeps the pid, so don't overwrite the log from before exec,
+ *  use monitor-<pid>.<n>.log for the later images.
+ */
+void
+monitor_log_end_process(void)
+{
+    char path [PATH_MAX];
+    int fd, n;
+
+    if (log_dir == NULL) {
+	return;
+    }
+
+    snprintf(path, sizeof(path), "%s/monitor-%d.log", log_dir, (int) getpid());
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+    for (n = 1; fd < 0 && errno == EEXIST && n < LOG_MAX_SUFFIX; n++) {
+	snprintf(path, sizeof(path), "%s/monitor-%d.%d.log",
+		 log_dir, (int) getpid(), n);
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    }
+    if (fd < 0) {
+	warn("unable to open event log: %s", path);
+	return;
+    }
+    if (monitor_log_dump(fd) != 0) {
+	warn("unable to write event log: %s", path);
+    }
+    close(fd);
 }
@@ -52,47 +52,25 @@
 #include "monitor-common.h"
 #include "monitor.h"
 
-typedef void * dlopen_fcn_t (const char *, int);
-typedef int dlclose_fcn_t (void *);
-
 //----------------------------------------------------------------------
 
 #if defined(MONITOR_PURE_PRELOAD)
 
 /*
- *  Initialization for the pure preload case.  We enter this code from
- *  a preload override, regardless of thread.
- *
- *  At the first override, use dlsym(RTLD_NEXT) to get the real
- *  versions.
+ *  Fill in the real functions for the pure preload case, from
+ *  dlsym(RTLD_NEXT).  Called once from the table of real functions.
  */
-
-static volatile int dlopen_init_start = 0;
-static volatile int dlopen_init_done = 0;
-
-static dlopen_fcn_t  * real_dlopen = NULL;
-static dlclose_fcn_t * real_dlclose = NULL;
-
-static void
-monitor_preload_init_dlopen(void)
+void
+monitor_real_init_dlopen(struct monitor_real_fcns * table)
 {
-    if (dlopen_init_done) {
-	return;
-    }
-
-    if (__sync_bool_compare_and_swap(&dlopen_init_start, 0, 1))
-    {
-	GET_DLSYM_FUNC(real_dlopen, "dlopen");
-	GET_DLSYM_FUNC(real_dlclose, "dlclose");
+    dlopen_fcn_t  * real_dlopen = NULL;
+    dlclose_fcn_t * real_dlclose = NULL;
 
-	__sync_synchronize();
+    GET_DLSYM_FUNC(real_dlopen, "dlopen");
+    GET_DLSYM_FUNC(real_dlclose, "dlclose");
 
-	dlopen_init_done = 1;
-    }
-    else {
-	while (! dlopen_init_done)
-	    ;
-    }
+    table->mr_dlopen = real_dlopen;
+    table->mr_dlclose = real_dlclose;
 }
 #endif
 
@@ -103,6 +81,10 @@ monitor_preload_init_dlopen(void)
 /*
  *  Initialization for the gotcha preload and gotcha link cases.
  *  This is already serialized from gotcha-init.
+ *
+ *  Only dlopen() is wrapped at startup.  A handle for dlclose() comes
+ *  from dlopen(), so dlclose() is wrapped on the first dlopen(), and
+ *  a process that never calls dlopen() doesn't pay for it.
  */
 
 void * __wrap_dlopen (const char *, int);
@@ -111,20 +93,70 @@ int __wrap_dlclose (void *);
 static gotcha_wrappee_handle_t dlopen_handle;
 static gotcha_wrappee_handle_t dlclose_handle;
 
+static monitor_once_t dlclose_wrap_once = MONITOR_ONCE_INITIALIZER;
+
 static gotcha_binding_t dlopen_bindings [] = {
     { "dlopen",  __wrap_dlopen,  &dlopen_handle },
+};
+
+static gotcha_binding_t dlclose_bindings [] = {
     { "dlclose", __wrap_dlclose, &dlclose_handle },
 };
 
 void
 monitor_gotcha_init_dlopen(void)
 {
-    gotcha_wrap(dlopen_bindings, 2, "libmonitor");
+    monitor_gotcha_wrap(dlopen_bindings, 1);
+}
+
+static void
+gotcha_wrap_dlclose(void)
+{
+    monitor_gotcha_wrap(dlclose_bindings, 1);
+    monitor_real_rebind();
+}
+
+/*
+ *  Fill in the real functions from the gotcha wrappees.  Called once
+ *  after gotcha init and again after dlopen, in case gotcha rebinds.
+ *  Until dlclose() is wrapped, the real one is just dlclose().
+ */
+void
+monitor_real_init_dlopen(struct monitor_real_fcns * table)
+{
+    __atomic_store_n(&table->mr_dlopen,
+	(dlopen_fcn_t *) gotcha_get_wrappee(dlopen_handle), __ATOMIC_RELAXED);
+    __atomic_store_n(&table->mr_dlclose,
+	(dlclose_handle != NULL) ? (dlclose_fcn_t *) gotcha_get_wrappee(dlclose_handle)
+	: &dlclose, __ATOMIC_RELAXED);
 }
 #endif
 
 //----------------------------------------------------------------------
 
+/*
+ *  Update the load map after dlopen or dlclose, and if any client
+ *  wants them, deliver the modules removed and added since the last
+ *  map.
+ */
+static void
+monitor_dl_update(void)
+{
+    struct monitor_load_diff diff;
+    int want = monitor_cb_table.ct_module_load.cl_num > 0
+	|| monitor_cb_table.ct_module_unload.cl_num > 0;
+
+    monitor_load_map_update(want ? &diff : NULL);
+
+    if (want) {
+	monitor_cb_module_unload(diff.ld_removed, diff.ld_num_removed);
+	monitor_cb_module_load(diff.ld_added, diff.ld_num_added);
+	monitor_load_diff_release(&diff);
+    }
+}
+
+//----------------------------------------------------------------------
+
 /*
  *  Override dlopen.
  */
@@ -137,23 +169,28 @@ void * __wrap_dlopen
 {
     monitor_first_entry();
 
-#if defined(MONITOR_PURE_PRELOAD)
-    monitor_preload_init_dlopen();
-
-#elif defined(MONITOR_GOTCHA_PRELOAD) || defined(MONITOR_GOTCHA_LINK)
-    dlopen_fcn_t * real_dlopen = gotcha_get_wrappee(dlopen_handle);
+    uint64_t start = monitor_log_time();
+    monitor_cb_data_t data;
 
+#if defined(MONITOR_GOTCHA_ANY)
+    monitor_run_once(&dlclose_wrap_once, gotcha_wrap_dlclose);
 #endif
 
-    if (real_dlopen == NULL) {
-	errx(1, "unable to get real version of dlopen");
-    }
+    monitor_callback_freeze();
+    monitor_cb_pre_dlopen(&data, name, flags);
 
-    void * data = monitor_pre_dlopen_cb(name, flags);
+    void * handle = (MONITOR_REAL(dlopen)) (name, flags);
 
-    void * handle = (* real_dlopen) (name, flags);
+    if (handle != NULL) {
+#if defined(MONITOR_GOTCHA_ANY)
+	monitor_real_rebind();
+#endif
+	monitor_dl_update();
+    }
+
+    monitor_cb_post_dlopen(&data, handle);
 
-    monitor_post_dlopen_cb(data, handle);
+    monitor_log_event(MONITOR_LOG_DLOPEN, start, handle);
 
     return handle;
 }
@@ -172,23 +209,21 @@ int __wrap_dlclose
 {
     monitor_first_entry();
 
-#if defined(MONITOR_PURE_PRELOAD)
-    monitor_preload_init_dlopen();
+    uint64_t start = monitor_log_time();
+    monitor_cb_data_t data;
 
-#elif defined(MONITOR_GOTCHA_PRELOAD) || defined(MONITOR_GOTCHA_LINK)
-    dlclose_fcn_t * real_dlclose = gotcha_get_wrappee(dlclose_handle);
+    monitor_callback_freeze();
+    monitor_cb_pre_dlclose(&data, handle);
 
-#endif
+    int ret = (MONITOR_REAL(dlclose)) (handle);
 
-    if (real_dlclose == NULL) {
-	errx(1, "unable to get real version of dlclose");
+    if (ret == 0) {
+	monitor_dl_update();
     }
 
-    void * data = monitor_pre_dlclose_cb(handle);
-
-    int ret = (* real_dlclose) (handle);
+    monitor_cb_post_dlclose(&data, handle, ret);
 
-    monitor_post_dlclose_cb(data, handle, ret);
+    monitor_log_event(MONITOR_LOG_DLCLOSE, start, handle);
 
     return ret;
 }
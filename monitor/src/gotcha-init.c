@@ -34,12 +34,34 @@
  *  ----------------------------------------------------------------------
  *
  *  This file is only included for the two gotcha cases.
+ *
+ *  With many libraries, gotcha wrap is a real part of startup.  These
+ *  variables limit and measure it:
+ *
+ *    MONITOR_GOTCHA_INCLUDE=name:name:...  wrap only the libraries
+ *      that match one of the names (plus the main program)
+ *    MONITOR_GOTCHA_EXCLUDE=name:name:...  don't wrap these
+ *    MONITOR_GOTCHA_TIMING=1  print the wrap time per library at end
+ *      of process
+ *
+ *  A name matches a library if it is the library's basename, or a
+ *  prefix of the basename followed by '.' or '-'.  So libm matches
+ *  libm.so.6 and libm-2.31.so, but not libmonitor-preload.so, and
+ *  libstdc++.so matches libstdc++.so.6.
+ *
+ *  Calls from a library that isn't wrapped go straight to libc, so
+ *  exclude only libraries that don't create threads, fork, exec, exit
+ *  or dlopen in ways the client needs to see.
  */
 
 #include <sys/types.h>
 #include <err.h>
 #include <errno.h>
+#include <link.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <gotcha/gotcha.h>
 
@@ -47,31 +69,338 @@
 #include "monitor-common.h"
 #include "monitor.h"
 
-static volatile int gotcha_init_start = 0;
-static volatile int gotcha_init_done = 0;
+#define GOTCHA_INCLUDE_VAR  "MONITOR_GOTCHA_INCLUDE"
+#define GOTCHA_EXCLUDE_VAR  "MONITOR_GOTCHA_EXCLUDE"
+#define GOTCHA_TIMING_VAR   "MONITOR_GOTCHA_TIMING"
+
+#define MAX_PATTERNS  32
+#define TIMING_SIZE   1024
+#define TIMING_NAME_LEN  64
+
+struct pattern_list {
+    int  num;
+    const char * str [MAX_PATTERNS];
+    int  len [MAX_PATTERNS];
+};
+
+struct lib_timing {
+    struct link_map * lm;
+    uint64_t  nsec;
+    int   visits;
+    int   wrapped;
+    char  name [TIMING_NAME_LEN];
+};
+
+extern char ** environ;
+
+static monitor_once_t gotcha_init_once = MONITOR_ONCE_INITIALIZER;
 
+static struct pattern_list include_list;
+static struct pattern_list exclude_list;
+static int gotcha_env_done = 0;
+static int gotcha_use_filter = 0;
+static int gotcha_timing = 0;
+
+static struct lib_timing timing_table [TIMING_SIZE];
+static struct lib_timing * timing_current = NULL;
+static int timing_num_libs = 0;
+static int timing_num_wraps = 0;
+static uint64_t timing_other_nsec = 0;
+static uint64_t timing_total_nsec = 0;
+static uint64_t timing_last = 0;
+
+// gotcha calls the filter from other threads' dlopen, only time our wraps
+static __thread int timing_self
+    __attribute__ ((tls_model ("initial-exec"))) = 0;
+
+//----------------------------------------------------------------------
+//  Library filter and timing
 //----------------------------------------------------------------------
 
 /*
- *  The first thread to get here calls gotcha init for each module.
- *  The other threads wait until init finishes.
+ *  Preinit is too early for getenv(), so look in the envp that
+ *  preinit gets.
+ */
+static const char *
+env_value(char ** envp, const char * name)
+{
+    size_t len = strlen(name);
+
+    for (; envp != NULL && *envp != NULL; envp++) {
+	if (strncmp(*envp, name, len) == 0 && (*envp)[len] == '=') {
+	    return *envp + len + 1;
+	}
+    }
+
+    return NULL;
+}
+
+/*
+ *  A colon-separated list of names, kept as pointers into the
+ *  environment, no malloc().
+ */
+static void
+parse_patterns(struct pattern_list * list, const char * str)
+{
+    list->num = 0;
+
+    while (str != NULL && *str != 0 && list->num < MAX_PATTERNS) {
+	const char * end = strchr(str, ':');
+	int len = (end != NULL) ? end - str : (int) strlen(str);
+
+	if (len > 0) {
+	    list->str[list->num] = str;
+	    list->len[list->num] = len;
+	    list->num++;
+	}
+	str = (end != NULL) ? end + 1 : NULL;
+    }
+}
+
+// returns 1 if any pattern matches the basename of path
+static int
+match_patterns(struct pattern_list * list, const char * path)
+{
+    const char * base = strrchr(path, '/');
+
+    base = (base != NULL) ? base + 1 : path;
+
+    for (int n = 0; n < list->num; n++) {
+	if (strncmp(base, list->str[n], list->len[n]) == 0) {
+	    char next = base[list->len[n]];
+
+	    if (next == 0 || next == '.' || next == '-') {
+		return 1;
+	    }
+	}
+    }
+
+    return 0;
+}
+
+/*
+ *  Read the filter and timing variables, from the preinit envp in
+ *  the gotcha link case, else from environ.  Serialized by the
+ *  callers (preinit and gotcha init).
  */
 void
-monitor_gotcha_init(void)
+monitor_gotcha_env(char ** envp)
 {
-    if (gotcha_init_done) {
+    const char * str;
+
+    if (gotcha_env_done) {
 	return;
     }
+    gotcha_env_done = 1;
 
-    if (__sync_bool_compare_and_swap(&gotcha_init_start, 0, 1))
-    {
-#ifdef MONITOR_USE_DLOPEN
-	monitor_gotcha_init_dlopen();
-#endif
-	gotcha_init_done = 1;
+    parse_patterns(&include_list, env_value(envp, GOTCHA_INCLUDE_VAR));
+    parse_patterns(&exclude_list, env_value(envp, GOTCHA_EXCLUDE_VAR));
+
+    str = env_value(envp, GOTCHA_TIMING_VAR);
+    gotcha_timing = (str != NULL && atoi(str) != 0);
+
+    gotcha_use_filter = include_list.num > 0 || exclude_list.num > 0 || gotcha_timing;
+}
+
+/*
+ *  The timing entry for lm, or NULL if the table is full.
+ */
+static struct lib_timing *
+timing_find(struct link_map * lm)
+{
+    const char * name = (lm->l_name != NULL && lm->l_name[0] != 0) ? lm->l_name : "(main)";
+    const char * base = strrchr(name, '/');
+    long n = ((uintptr_t) lm >> 4) & (TIMING_SIZE - 1);
+
+    while (timing_table[n].lm != NULL) {
+	if (timing_table[n].lm == lm) {
+	    return &timing_table[n];
+	}
+	n = (n + 1) & (TIMING_SIZE - 1);
+    }
+
+    if (timing_num_libs >= TIMING_SIZE / 2) {
+	return NULL;
+    }
+    timing_num_libs++;
+    timing_table[n].lm = lm;
+    strncpy(timing_table[n].name, (base != NULL) ? base + 1 : name, TIMING_NAME_LEN - 1);
+
+    return &timing_table[n];
+}
+
+/*
+ *  Charge the time since the last mark to the current library, or to
+ *  other for the symbol lookup before the first one.
+ */
+static void
+timing_charge(uint64_t now)
+{
+    if (timing_current != NULL) {
+	timing_current->nsec += now - timing_last;
     }
     else {
-	while (! gotcha_init_done)
-	    ;
+	timing_other_nsec += now - timing_last;
     }
+    timing_last = now;
+}
+
+/*
+ *  Gotcha calls the filter for each library before it rewrites the
+ *  library's GOT, so the time between calls is the previous
+ *  library's cost.
+ */
+static int
+gotcha_library_filter(struct link_map * lm)
+{
+    const char * name = (lm->l_name != NULL) ? lm->l_name : "";
+    int wrap = 1;
+
+    // always wrap the main program
+    if (name[0] != 0) {
+	if (include_list.num > 0 && ! match_patterns(&include_list, name)) {
+	    wrap = 0;
+	}
+	if (match_patterns(&exclude_list, name)) {
+	    wrap = 0;
+	}
+    }
+
+    if (gotcha_timing && timing_self) {
+	timing_charge(monitor_log_time());
+	timing_current = timing_find(lm);
+	if (timing_current != NULL) {
+	    timing_current->visits++;
+	    timing_current->wrapped = wrap;
+	}
+    }
+
+    return wrap;
+}
+
+/*
+ *  Gotcha wrap bindings in the libraries that pass the filter.  The
+ *  filter is restored after each wrap, so it doesn't apply to other
+ *  gotcha tools or to gotcha's own rewrap after dlopen.  Serialized
+ *  by the callers.
+ */
+void
+monitor_gotcha_wrap(struct gotcha_binding_t * bindings, int num)
+{
+    uint64_t start = 0;
+
+    if (gotcha_use_filter) {
+	gotcha_set_library_filter_func(gotcha_library_filter);
+    }
+    if (gotcha_timing) {
+	start = timing_last = monitor_log_time();
+	timing_current = NULL;
+	timing_self = 1;
+    }
+
+    gotcha_wrap(bindings, num, "libmonitor");
+
+    if (gotcha_timing) {
+	uint64_t now = monitor_log_time();
+
+	timing_charge(now);
+	timing_current = NULL;
+	timing_self = 0;
+	timing_total_nsec += now - start;
+	timing_num_wraps++;
+    }
+    if (gotcha_use_filter) {
+	gotcha_restore_library_filter_func();
+    }
+}
+
+static int
+timing_cmp(const void * p1, const void * p2)
+{
+    const struct lib_timing * t1 = * (struct lib_timing * const *) p1;
+    const struct lib_timing * t2 = * (struct lib_timing * const *) p2;
+
+    return (t1->nsec < t2->nsec) - (t1->nsec > t2->nsec);
+}
+
+/*
+ *  With MONITOR_GOTCHA_TIMING, print the gotcha wrap time per
+ *  library at end of process, most expensive first.
+ */
+void
+monitor_gotcha_report(void)
+{
+    struct lib_timing * order [TIMING_SIZE / 2];
+    int num = 0;
+
+    if (! gotcha_timing || timing_num_wraps == 0) {
+	return;
+    }
+
+    for (int n = 0; n < TIMING_SIZE && num < TIMING_SIZE / 2; n++) {
+	if (timing_table[n].lm != NULL) {
+	    order[num++] = &timing_table[n];
+	}
+    }
+    qsort(order, num, sizeof(order[0]), timing_cmp);
+
+    fprintf(stderr, "monitor: gotcha wrap: %d calls, %d libraries, %.1f usec\n",
+	    timing_num_wraps, num, (double) timing_total_nsec / 1000.0);
+    fprintf(stderr, "  %10s  %6s  %s\n", "usec", "visits", "library");
+    fprintf(stderr, "  %10.1f  %6s  %s\n", (double) timing_other_nsec / 1000.0,
+	    "", "(symbol lookup and other)");
+
+    for (int n = 0; n < num; n++) {
+	fprintf(stderr, "  %10.1f  %6d  %s%s\n", (double) order[n]->nsec / 1000.0,
+		order[n]->visits, order[n]->name, order[n]->wrapped ? "" : "  (skipped)");
+    }
+}
+
+/*
+ *  The child of fork didn't do the parent's wraps, so clear the
+ *  timing and report only the child's own wraps (if any).
+ */
+void
+monitor_gotcha_fork_child(void)
+{
+    if (! gotcha_timing) {
+	return;
+    }
+
+    memset(timing_table, 0, sizeof(timing_table));
+    timing_current = NULL;
+    timing_num_libs = 0;
+    timing_num_wraps = 0;
+    timing_other_nsec = 0;
+    timing_total_nsec = 0;
+}
+
+//----------------------------------------------------------------------
+
+static void
+gotcha_init_modules(void)
+{
+    uint64_t start = monitor_log_time();
+
+    monitor_gotcha_env(environ);
+
+#ifdef MONITOR_USE_DLOPEN
+    monitor_gotcha_init_dlopen();
+#endif
+#ifdef MONITOR_GOTCHA_LINK
+    monitor_gotcha_init_process();
+    monitor_gotcha_init_signal();
+#endif
+
+    monitor_log_event(MONITOR_LOG_GOTCHA_INIT, start, NULL);
+}
+
+/*
+ *  The first thread to get here calls gotcha init for each module.
+ *  The other threads wait until init finishes.
+ */
+void
+monitor_gotcha_init(void)
+{
+    monitor_run_once(&gotcha_init_once, gotcha_init_modules);
 }
@@ -0,0 +1,608 @@
+/*
+ *  Track the load map for PC to module lookups.
+ *
+ *  Copyright (c) 2019-2020, Rice University.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of Rice University (RICE) nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  This software is provided by RICE and contributors "as is" and any
+ *  express or implied warranties, including, but not limited to, the
+ *  implied warranties of merchantability and fitness for a particular
+ *  purpose are disclaimed. In no event shall RICE or contributors be
+ *  liable for any direct, indirect, incidental, special, exemplary, or
+ *  consequential damages (including, but not limited to, procurement of
+ *  substitute goods or services; loss of use, data, or profits; or
+ *  business interruption) however caused and on any theory of liability,
+ *  whether in contract, strict liability, or tort (including negligence
+ *  or otherwise) arising in any way out of the use of this software, even
+ *  if advised of the possibility of such damage.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <err.h>
+#include <limits.h>
+#include <link.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include "monitor-config.h"
+#include "monitor-common.h"
+#include "monitor.h"
+
+/*
+ *  The load map is an immutable, sorted array of modules.  An update
+ *  builds a new map and publishes it with one pointer store, so
+ *  readers never see a partial map.  Readers announce the map they're
+ *  using in their thread's hazard pointer (or the anonymous reader
+ *  count for threads unknown to monitor), and the writer waits for
+ *  both to clear before unmapping the old map.
+ *
+ *  Module names live in an append-only arena and are never freed, so
+ *  a copy of a module stays valid after the map changes, and a module
+ *  in two maps has the same name pointer.
+ *
+ *  The loader counts objects added and removed (dlpi_adds and
+ *  dlpi_subs).  An update first checks them and skips the rebuild if
+ *  nothing changed (eg, dlopen of a library that's already loaded).
+ *  If a client wants the changes, the update diffs the new map
+ *  against the old one, both sorted, in one pass.
+ */
+#define NAME_CHUNK_SIZE  (64 * 1024)
+
+struct monitor_load_map {
+    unsigned long  lm_generation;
+    unsigned long long  lm_adds;
+    unsigned long long  lm_subs;
+    size_t   lm_size;
+    long     lm_num;
+    long     lm_max;
+    struct monitor_module  lm_module [];
+};
+
+struct diff_buf {
+    size_t  db_size;
+    long    db_max;
+    struct monitor_module  db_module [];
+};
+
+struct name_chunk {
+    struct name_chunk * nc_next;
+    size_t  nc_used;
+    char    nc_buf [];
+};
+
+static struct monitor_load_map * load_map = NULL;
+static struct monitor_load_map * spare_map = NULL;
+static struct diff_buf * spare_diff = NULL;
+static unsigned long load_map_generation = 0;
+static long anon_readers = 0;
+
+static pthread_mutex_t load_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct name_chunk * name_chunk_list = NULL;
+static const char * exe_name = NULL;
+
+//----------------------------------------------------------------------
+//  Writer side, serialized by load_map_lock
+//----------------------------------------------------------------------
+
+/*
+ *  Return a permanent copy of name, reusing an existing copy if there
+ *  is one.  There are only a few distinct names, so a linear search
+ *  is fine.
+ */
+static const char *
+monitor_intern_name(const char *name)
+{
+    struct name_chunk *nc;
+    size_t len = strlen(name) + 1;
+
+    for (nc = name_chunk_list; nc != NULL; nc = nc->nc_next) {
+	for (size_t pos = 0; pos < nc->nc_used; ) {
+	    const char *str = &nc->nc_buf[pos];
+	    size_t str_len = strlen(str) + 1;
+
+	    if (str_len == len && memcmp(str, name, len) == 0) {
+		return str;
+	    }
+	    pos += str_len;
+	}
+    }
+
+    nc = name_chunk_list;
+    if (nc == NULL || nc->nc_used + len > NAME_CHUNK_SIZE - sizeof(*nc)) {
+	size_t size = sizeof(*nc) + len;
+
+	if (size < NAME_CHUNK_SIZE) {
+	    size = NAME_CHUNK_SIZE;
+	}
+	nc = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (nc == MAP_FAILED) {
+	    err(1, "mmap for load map names failed");
+	}
+	nc->nc_next = name_chunk_list;
+	nc->nc_used = 0;
+	name_chunk_list = nc;
+    }
+
+    char *str = &nc->nc_buf[nc->nc_used];
+    memcpy(str, name, len);
+    nc->nc_used += len;
+
+    return str;
+}
+
+/*
+ *  Get a map with room for max modules.  We keep the last retired map
+ *  as a spare and reuse it if it's big enough, to avoid an mmap() and
+ *  munmap() on every dlopen.
+ */
+static struct monitor_load_map *
+monitor_load_map_alloc(long max)
+{
+    struct monitor_load_map *spare = spare_map;
+
+    if (spare != NULL) {
+	spare_map = NULL;
+	if (spare->lm_max >= max) {
+	    spare->lm_num = 0;
+	    return spare;
+	}
+	munmap(spare, spare->lm_size);
+    }
+
+    size_t size = sizeof(struct monitor_load_map)
+	+ max * sizeof(struct monitor_module);
+
+    struct monitor_load_map *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+	err(1, "mmap for load map failed");
+    }
+
+    map->lm_size = size;
+    map->lm_num = 0;
+    map->lm_max = max;
+
+    return map;
+}
+
+/*
+ *  Get a diff buffer with room for max modules, the spare if it's big
+ *  enough.
+ */
+static struct diff_buf *
+monitor_diff_alloc(long max)
+{
+    struct diff_buf *buf = spare_diff;
+
+    if (buf != NULL) {
+	spare_diff = NULL;
+	if (buf->db_max >= max) {
+	    return buf;
+	}
+	munmap(buf, buf->db_size);
+    }
+
+    size_t size = sizeof(struct diff_buf) + max * sizeof(struct monitor_module);
+
+    buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+	err(1, "mmap for load map diff failed");
+    }
+
+    buf->db_size = size;
+    buf->db_max = max;
+
+    return buf;
+}
+
+static int
+monitor_module_same(const struct monitor_module *m1, const struct monitor_module *m2)
+{
+    return m1->mm_start == m2->mm_start && m1->mm_end == m2->mm_end
+	&& m1->mm_name == m2->mm_name;
+}
+
+/*
+ *  Walk the old and new maps in address order.  With diff NULL, just
+ *  count the added and removed modules, otherwise fill them in.
+ */
+static void
+monitor_load_map_walk(struct monitor_load_map *old, struct monitor_load_map *map,
+		      struct monitor_load_diff *diff, long *num_added, long *num_removed)
+{
+    long i = 0, j = 0, na = 0, nr = 0;
+
+    while (i < old->lm_num || j < map->lm_num) {
+	struct monitor_module *m1 = &old->lm_module[i];
+	struct monitor_module *m2 = &map->lm_module[j];
+
+	if (i < old->lm_num && j < map->lm_num && monitor_module_same(m1, m2)) {
+	    i++;
+	    j++;
+	    continue;
+	}
+	if (j >= map->lm_num || (i < old->lm_num && m1->mm_start <= m2->mm_start)) {
+	    if (diff != NULL) {
+		diff->ld_removed[nr] = *m1;
+	    }
+	    nr++;
+	    i++;
+	}
+	else {
+	    if (diff != NULL) {
+		diff->ld_added[na] = *m2;
+	    }
+	    na++;
+	    j++;
+	}
+    }
+
+    *num_added = na;
+    *num_removed = nr;
+}
+
+/*
+ *  Fill in diff with the modules in map but not old (added) and in
+ *  old but not map (removed).
+ */
+static void
+monitor_load_map_diff(struct monitor_load_map *old, struct monitor_load_map *map,
+		      struct monitor_load_diff *diff)
+{
+    struct diff_buf *buf;
+    long na, nr;
+
+    monitor_load_map_walk(old, map, NULL, &na, &nr);
+    if (na + nr == 0) {
+	return;
+    }
+
+    buf = monitor_diff_alloc(na + nr);
+    diff->ld_buf = buf;
+    diff->ld_added = &buf->db_module[0];
+    diff->ld_removed = &buf->db_module[na];
+
+    monitor_load_map_walk(old, map, diff, &diff->ld_num_added, &diff->ld_num_removed);
+}
+
+#define HAVE_DLPI_SUBS(size)  \
+    ((size) >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(unsigned long long))
+
+/*
+ *  dl_iterate_phdr() callback, get the loader's add and sub counts
+ *  from the first object and stop.  Older loaders don't have them, so
+ *  they stay 0 and we always rebuild.
+ */
+static int
+monitor_load_map_counts(struct dl_phdr_info *info, size_t size, void *data)
+{
+    unsigned long long *counts = data;
+
+    if (HAVE_DLPI_SUBS(size)) {
+	counts[0] = info->dlpi_adds;
+	counts[1] = info->dlpi_subs;
+    }
+
+    return 1;
+}
+
+/*
+ *  dl_iterate_phdr() callback, add one object to the map.  If the map
+ *  is full, keep counting so the caller knows how big to make it.
+ */
+static int
+monitor_load_map_callback(struct dl_phdr_info *info, size_t size, void *data)
+{
+    struct monitor_load_map *map = data;
+    uintptr_t start = UINTPTR_MAX;
+    uintptr_t end = 0;
+
+    if (HAVE_DLPI_SUBS(size)) {
+	map->lm_adds = info->dlpi_adds;
+	map->lm_subs = info->dlpi_subs;
+    }
+
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+	const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+
+	if (ph->p_type == PT_LOAD) {
+	    uintptr_t lo = info->dlpi_addr + ph->p_vaddr;
+	    uintptr_t hi = lo + ph->p_memsz;
+
+	    if (lo < start) { start = lo; }
+	    if (hi > end) { end = hi; }
+	}
+    }
+
+    if (start >= end) {
+	return 0;
+    }
+
+    if (map->lm_num < map->lm_max) {
+	struct monitor_module *mod = &map->lm_module[map->lm_num];
+	const char *name = info->dlpi_name;
+
+	if (name == NULL || name[0] == 0) {
+	    name = (map->lm_num == 0 && exe_name != NULL) ? exe_name : "";
+	}
+	mod->mm_name = monitor_intern_name(name);
+	mod->mm_start = (void *) start;
+	mod->mm_end = (void *) end;
+	mod->mm_load_addr = info->dlpi_addr;
+    }
+    map->lm_num++;
+
+    return 0;
+}
+
+static int
+monitor_module_cmp(const void *p1, const void *p2)
+{
+    const struct monitor_module *m1 = p1, *m2 = p2;
+
+    if (m1->mm_start < m2->mm_start) { return -1; }
+    if (m1->mm_start > m2->mm_start) { return 1; }
+    return 0;
+}
+
+/*
+ *  Build a new map from dl_iterate_phdr(), publish it and retire the
+ *  old one.  Called at begin process and after dlopen and dlclose.
+ *  If diff is not NULL, it gets the modules added and removed since
+ *  the old map, and the caller must release it.
+ */
+void
+monitor_load_map_update(struct monitor_load_diff *diff)
+{
+    struct monitor_load_map *map, *old;
+    unsigned long long counts[2] = { 0, 0 };
+
+    if (diff != NULL) {
+	memset(diff, 0, sizeof(*diff));
+    }
+
+    pthread_mutex_lock(&load_map_lock);
+
+    old = load_map;
+
+    if (old != NULL) {
+	dl_iterate_phdr(monitor_load_map_counts, counts);
+
+	if (counts[0] != 0 && counts[0] == old->lm_adds && counts[1] == old->lm_subs) {
+	    pthread_mutex_unlock(&load_map_lock);
+	    return;
+	}
+    }
+
+    if (exe_name == NULL) {
+	char path[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+
+	if (len > 0) {
+	    path[len] = 0;
+	    exe_name = monitor_intern_name(path);
+	}
+    }
+
+    // the set of objects can change between passes, so retry until
+    // it fits
+    long max = (old != NULL) ? old->lm_num + 16 : 64;
+    for (;;) {
+	map = monitor_load_map_alloc(max);
+	map->lm_adds = 0;
+	map->lm_subs = 0;
+	dl_iterate_phdr(monitor_load_map_callback, map);
+
+	if (map->lm_num <= map->lm_max) {
+	    break;
+	}
+	max = map->lm_num + 16;
+	spare_map = map;
+    }
+
+    qsort(map->lm_module, map->lm_num, sizeof(struct monitor_module),
+	  monitor_module_cmp);
+
+    map->lm_generation = (old != NULL) ? old->lm_generation + 1 : 1;
+
+    if (old != NULL && diff != NULL) {
+	monitor_load_map_diff(old, map, diff);
+    }
+
+    __atomic_store_n(&load_map, map, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&load_map_generation, map->lm_generation, __ATOMIC_RELEASE);
+
+    if (old != NULL) {
+	monitor_thread_hazard_wait(old);
+	while (__atomic_load_n(&anon_readers, __ATOMIC_SEQ_CST) != 0) {
+	    sched_yield();
+	}
+	if (spare_map == NULL) {
+	    spare_map = old;
+	}
+	else {
+	    munmap(old, old->lm_size);
+	}
+    }
+
+    if (monitor_debug()) {
+	fprintf(stderr, "---> monitor: load map generation %lu, %ld modules\n",
+		map->lm_generation, map->lm_num);
+	if (diff != NULL) {
+	    fprintf(stderr, "---> monitor: %ld added, %ld removed\n",
+		    diff->ld_num_added, diff->ld_num_removed);
+	}
+    }
+
+    pthread_mutex_unlock(&load_map_lock);
+}
+
+/*
+ *  Return the diff's buffer, keeping one as a spare.
+ */
+void
+monitor_load_diff_release(struct monitor_load_diff *diff)
+{
+    struct diff_buf *buf = diff->ld_buf;
+
+    if (buf == NULL) {
+	return;
+    }
+    diff->ld_buf = NULL;
+
+    pthread_mutex_lock(&load_map_lock);
+
+    if (spare_diff == NULL) {
+	spare_diff = buf;
+	buf = NULL;
+    }
+
+    pthread_mutex_unlock(&load_map_lock);
+
+    if (buf != NULL) {
+	munmap(buf, buf->db_size);
+    }
+}
+
+/*
+ *  In a forked child, another thread may have held the lock or been
+ *  counted as a reader at the time of fork.
+ */
+void
+monitor_load_map_fork_child(void)
+{
+    pthread_mutex_init(&load_map_lock, NULL);
+    anon_readers = 0;
+}
+
+//----------------------------------------------------------------------
+//  Reader side, signal safe
+//----------------------------------------------------------------------
+
+/*
+ *  Pin the current map, either in this thread's hazard pointer or the
+ *  anonymous count, and return it with the previous hazard value in
+ *  *save.  The hazard is saved and restored, in case we interrupted
+ *  another reader in the same thread.
+ */
+static struct monitor_load_map *
+monitor_load_map_acquire(void ***hazard, void **save)
+{
+    struct monitor_load_map *map;
+    void **hz = monitor_thread_hazard();
+
+    *hazard = hz;
+
+    if (hz == NULL) {
+	__atomic_fetch_add(&anon_readers, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&load_map, __ATOMIC_SEQ_CST);
+    }
+
+    *save = *hz;
+    do {
+	map = __atomic_load_n(&load_map, __ATOMIC_ACQUIRE);
+	__atomic_store_n(hz, map, __ATOMIC_SEQ_CST);
+    }
+    while (map != __atomic_load_n(&load_map, __ATOMIC_SEQ_CST));
+
+    return map;
+}
+
+static void
+monitor_load_map_release(void **hz, void *save)
+{
+    if (hz == NULL) {
+	__atomic_fetch_sub(&anon_readers, 1, __ATOMIC_RELEASE);
+    }
+    else {
+	__atomic_store_n(hz, save, __ATOMIC_RELEASE);
+    }
+}
+
+int
+monitor_find_module(const void *pc, struct monitor_module *mod)
+{
+    void **hz, *save = NULL;
+    int ans = 0;
+
+    struct monitor_load_map *map = monitor_load_map_acquire(&hz, &save);
+
+    if (map != NULL) {
+	long lo = 0, hi = map->lm_num;
+
+	while (lo < hi) {
+	    long mid = (lo + hi) / 2;
+	    struct monitor_module *m = &map->lm_module[mid];
+
+	    if (pc < m->mm_start) {
+		hi = mid;
+	    }
+	    else if (pc >= m->mm_end) {
+		lo = mid + 1;
+	    }
+	    else {
+		*mod = *m;
+		ans = 1;
+		break;
+	    }
+	}
+    }
+
+    monitor_load_map_release(hz, save);
+
+    return ans;
+}
+
+unsigned long
+monitor_load_map_generation(void)
+{
+    return __atomic_load_n(&load_map_generation, __ATOMIC_ACQUIRE);
+}
+
+long
+monitor_get_load_map(struct monitor_module *buf, long max)
+{
+    void **hz, *save = NULL;
+    long num = 0;
+
+    struct monitor_load_map *map = monitor_load_map_acquire(&hz, &save);
+
+    if (map != NULL) {
+	num = map->lm_num;
+	for (long i = 0; i < num && i < max; i++) {
+	    buf[i] = map->lm_module[i];
+	}
+    }
+
+    monitor_load_map_release(hz, save);
+
+    return num;
+}
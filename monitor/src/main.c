@@ -33,13 +33,20 @@
  */
 
 #include <sys/types.h>
+#include <alloca.h>
 #include <err.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #if defined(MONITOR_PURE_PRELOAD) || defined(MONITOR_GOTCHA_PRELOAD)
 #include <dlfcn.h>
 #endif
+#if defined(MONITOR_GOTCHA_LINK)
+#include <gotcha/gotcha.h>
+#endif
 
 #include "monitor-config.h"
 #include "monitor-common.h"
@@ -65,6 +72,21 @@ typedef int main_fcn_t (int, char **, char **  AUXVEC_DECL );
 static main_fcn_t  *real_main = NULL;
 extern main_fcn_t  __real_main;
 
+#if defined(MONITOR_STATIC)
+extern fork_fcn_t    __real_fork;
+extern execve_fcn_t  __real_execve;
+extern execve_fcn_t  __real_execvpe;
+extern exit_fcn_t    __real_exit;
+extern exit_fcn_t    __real__exit;
+#endif
+
+extern char ** environ;
+
+static int begin_process_called = 0;
+static monitor_once_t end_process_once = MONITOR_ONCE_INITIALIZER;
+static __thread int in_end_process
+    __attribute__ ((tls_model ("initial-exec"))) = 0;
+
 //----------------------------------------------------------------------
 
 /*
@@ -75,15 +97,55 @@ extern main_fcn_t  __real_main;
 void
 monitor_try_begin_process(void)
 {
-    static int begin_process_called = 0;
-
     // test and test-and-set
     if (begin_process_called
 	|| __sync_val_compare_and_swap(&begin_process_called, 0, 1)) {
 	return;
     }
 
-    monitor_begin_process_cb();
+    uint64_t start = monitor_log_time();
+
+    monitor_callback_freeze();
+    monitor_thread_init_main();
+    monitor_load_map_update(NULL);
+
+    monitor_cb_begin_process();
+
+    monitor_log_event(MONITOR_LOG_BEGIN_PROCESS, start, NULL);
+}
+
+static void
+monitor_end_process_fcn(void)
+{
+    uint64_t start = monitor_log_time();
+
+    in_end_process = 1;
+    monitor_cb_end_process();
+    in_end_process = 0;
+
+    monitor_log_event(MONITOR_LOG_END_PROCESS, start, NULL);
+    monitor_log_end_process();
+#if defined(MONITOR_GOTCHA_ANY)
+    monitor_gotcha_report();
+#endif
+}
+
+/*
+ *  Deliver the end_process() callback, once, and only if begin
+ *  process was delivered.  All the exit paths call this.  If two
+ *  threads race to exit, the second one waits until the callback
+ *  finishes.  If the callback itself exits, we return and let the
+ *  exit proceed instead of waiting on ourself.
+ */
+void
+monitor_end_process(void)
+{
+    if (! __atomic_load_n(&begin_process_called, __ATOMIC_ACQUIRE)
+	|| in_end_process) {
+	return;
+    }
+
+    monitor_run_once(&end_process_once, monitor_end_process_fcn);
 }
 
 //----------------------------------------------------------------------
@@ -104,7 +166,11 @@ __wrap_main(int argc, char **argv, char **envp  AUXVEC_DECL )
 
     monitor_try_begin_process();
 
-    monitor_at_main_cb();
+    uint64_t start = monitor_log_time();
+
+    monitor_cb_at_main();
+
+    monitor_log_event(MONITOR_LOG_AT_MAIN, start, NULL);
 
 #if defined(MONITOR_PURE_PRELOAD) || defined(MONITOR_GOTCHA_PRELOAD)
     ret = (* real_main) (argc, argv, envp  AUXVEC_ARG );
@@ -112,7 +178,7 @@ __wrap_main(int argc, char **argv, char **envp  AUXVEC_DECL )
     ret = __real_main (argc, argv, envp  AUXVEC_ARG );
 #endif
 
-    monitor_end_process_cb();
+    monitor_end_process();
 
     return ret;
 }
@@ -191,3 +257,288 @@ __libc_start_main(main_fcn_t *main, int argc, char **argv, void *init,
 
 #endif  // libc_start_main type
 #endif  // preload case for libc_start_main
+
+//----------------------------------------------------------------------
+//  Fork, exec and exit
+//----------------------------------------------------------------------
+
+#if defined(MONITOR_GOTCHA_LINK)
+
+pid_t __wrap_fork (void);
+pid_t __wrap_vfork (void);
+int __wrap_execve (const char *, char * const [], char * const []);
+int __wrap_execv (const char *, char * const []);
+int __wrap_execvp (const char *, char * const []);
+int __wrap_execvpe (const char *, char * const [], char * const []);
+int __wrap_execl (const char *, const char *, ...);
+int __wrap_execlp (const char *, const char *, ...);
+int __wrap_execle (const char *, const char *, ...);
+void __wrap_exit (int);
+void __wrap__exit (int);
+void __wrap__Exit (int);
+
+static gotcha_wrappee_handle_t fork_handle;
+static gotcha_wrappee_handle_t execve_handle;
+static gotcha_wrappee_handle_t execvpe_handle;
+static gotcha_wrappee_handle_t exit_handle;
+static gotcha_wrappee_handle_t _exit_handle;
+static gotcha_wrappee_handle_t other_handle [7];
+
+static gotcha_binding_t process_bindings [] = {
+    { "fork",    __wrap_fork,    &fork_handle },
+    { "execve",  __wrap_execve,  &execve_handle },
+    { "execvpe", __wrap_execvpe, &execvpe_handle },
+    { "exit",    __wrap_exit,    &exit_handle },
+    { "_exit",   __wrap__exit,   &_exit_handle },
+    { "_Exit",   __wrap__Exit,   &other_handle[0] },
+    { "execv",   __wrap_execv,   &other_handle[1] },
+    { "execvp",  __wrap_execvp,  &other_handle[2] },
+    { "execl",   __wrap_execl,   &other_handle[3] },
+    { "execlp",  __wrap_execlp,  &other_handle[4] },
+    { "execle",  __wrap_execle,  &other_handle[5] },
+    { "vfork",   __wrap_vfork,   &other_handle[6] },
+};
+
+/*
+ *  Gotcha wrap fork, exec and exit for the gotcha link case.  This
+ *  is already serialized from gotcha-init.
+ */
+void
+monitor_gotcha_init_process(void)
+{
+    monitor_gotcha_wrap(process_bindings,
+			sizeof(process_bindings) / sizeof(process_bindings[0]));
+}
+#endif
+
+/*
+ *  Fill in the real fork, exec and exit functions.  The other exec
+ *  variants are all implemented on top of execve() and execvpe().
+ */
+void
+monitor_real_init_process(struct monitor_real_fcns * table)
+{
+#if defined(MONITOR_PURE_PRELOAD) || defined(MONITOR_GOTCHA_PRELOAD)
+    fork_fcn_t   * real_fork = NULL;
+    execve_fcn_t * real_execve = NULL;
+    execve_fcn_t * real_execvpe = NULL;
+    exit_fcn_t   * real_exit = NULL;
+    exit_fcn_t   * real__exit = NULL;
+
+    GET_DLSYM_FUNC(real_fork, "fork");
+    GET_DLSYM_FUNC(real_execve, "execve");
+    GET_DLSYM_FUNC(real_execvpe, "execvpe");
+    GET_DLSYM_FUNC(real_exit, "exit");
+    GET_DLSYM_FUNC(real__exit, "_exit");
+
+    table->mr_fork = real_fork;
+    table->mr_execve = real_execve;
+    table->mr_execvpe = real_execvpe;
+    table->mr_exit = real_exit;
+    table->mr__exit = real__exit;
+
+#elif defined(MONITOR_GOTCHA_LINK)
+    __atomic_store_n(&table->mr_fork,
+	(fork_fcn_t *) gotcha_get_wrappee(fork_handle), __ATOMIC_RELAXED);
+    __atomic_store_n(&table->mr_execve,
+	(execve_fcn_t *) gotcha_get_wrappee(execve_handle), __ATOMIC_RELAXED);
+    __atomic_store_n(&table->mr_execvpe,
+	(execve_fcn_t *) gotcha_get_wrappee(execvpe_handle), __ATOMIC_RELAXED);
+    __atomic_store_n(&table->mr_exit,
+	(exit_fcn_t *) gotcha_get_wrappee(exit_handle), __ATOMIC_RELAXED);
+    __atomic_store_n(&table->mr__exit,
+	(exit_fcn_t *) gotcha_get_wrappee(_exit_handle), __ATOMIC_RELAXED);
+
+#else
+    table->mr_fork = __real_fork;
+    table->mr_execve = __real_execve;
+    table->mr_execvpe = __real_execvpe;
+    table->mr_exit = __real_exit;
+    table->mr__exit = __real__exit;
+#endif
+}
+
+//----------------------------------------------------------------------
+
+/*
+ *  Override fork().  The child has only the forking thread, so reset
+ *  monitor's thread and load map state before the child callback.
+ */
+pid_t
+MONITOR_WRAP_NAME(fork) (void)
+{
+    monitor_first_entry();
+
+    monitor_cb_data_t data;
+
+    monitor_callback_freeze();
+    monitor_cb_pre_fork(&data);
+
+    pid_t pid = (MONITOR_REAL(fork)) ();
+
+    if (pid == 0) {
+	monitor_thread_fork_child();
+	monitor_load_map_fork_child();
+	monitor_signal_fork_child();
+#if defined(MONITOR_GOTCHA_ANY)
+	monitor_gotcha_fork_child();
+#endif
+	monitor_cb_post_fork_child(&data);
+    }
+    else {
+	monitor_cb_post_fork_parent(&data, pid);
+    }
+
+    return pid;
+}
+
+/*
+ *  Override vfork() as a real fork().  A vfork child shares the
+ *  parent's memory until it execs, so running end process and the
+ *  client callbacks there would clobber the parent's state.  POSIX
+ *  allows vfork() to be fork(), and this way the child gets the same
+ *  fork callbacks as any other.
+ */
+pid_t
+MONITOR_WRAP_NAME(vfork) (void)
+{
+    return MONITOR_WRAP_NAME(fork) ();
+}
+
+//----------------------------------------------------------------------
+
+/*
+ *  Override the exec family.  Exec replaces the process image, so
+ *  deliver end process first.
+ */
+int
+MONITOR_WRAP_NAME(execve)
+  (const char * path, char * const argv [], char * const envp [])
+{
+    monitor_first_entry();
+    monitor_end_process();
+
+    return (MONITOR_REAL(execve)) (path, argv, envp);
+}
+
+int
+MONITOR_WRAP_NAME(execvpe)
+  (const char * file, char * const argv [], char * const envp [])
+{
+    monitor_first_entry();
+    monitor_end_process();
+
+    return (MONITOR_REAL(execvpe)) (file, argv, envp);
+}
+
+int
+MONITOR_WRAP_NAME(execv) (const char * path, char * const argv [])
+{
+    return MONITOR_WRAP_NAME(execve) (path, argv, environ);
+}
+
+int
+MONITOR_WRAP_NAME(execvp) (const char * file, char * const argv [])
+{
+    return MONITOR_WRAP_NAME(execvpe) (file, argv, environ);
+}
+
+/*
+ *  Copy the execl() args into argv (on our stack).  If envpp is not
+ *  NULL, also return the envp after the NULL (execle only).
+ */
+#define MONITOR_EXECL_ARGV(argv, arg, envpp)  do {		\
+    char *** envpp_ = (envpp);					\
+    va_list ap, ap2;						\
+    size_t n = 1;						\
+								\
+    va_start(ap, arg);						\
+    va_copy(ap2, ap);						\
+    while (va_arg(ap2, char *) != NULL) {			\
+	n++;							\
+    }								\
+    va_end(ap2);						\
+								\
+    argv = alloca((n + 1) * sizeof(char *));			\
+    argv[0] = (char *) arg;					\
+    for (size_t i = 1; i <= n; i++) {				\
+	argv[i] = va_arg(ap, char *);				\
+    }								\
+    if (envpp_ != NULL) {					\
+	*envpp_ = va_arg(ap, char **);				\
+    }								\
+    va_end(ap);							\
+} while (0)
+
+int
+MONITOR_WRAP_NAME(execl) (const char * path, const char * arg, ...)
+{
+    char ** argv;
+
+    MONITOR_EXECL_ARGV(argv, arg, NULL);
+
+    return MONITOR_WRAP_NAME(execve) (path, argv, environ);
+}
+
+int
+MONITOR_WRAP_NAME(execlp) (const char * file, const char * arg, ...)
+{
+    char ** argv;
+
+    MONITOR_EXECL_ARGV(argv, arg, NULL);
+
+    return MONITOR_WRAP_NAME(execvpe) (file, argv, environ);
+}
+
+int
+MONITOR_WRAP_NAME(execle) (const char * path, const char * arg, ...)
+{
+    char ** argv;
+    char ** envp = NULL;
+
+    MONITOR_EXECL_ARGV(argv, arg, &envp);
+
+    return MONITOR_WRAP_NAME(execve) (path, argv, envp);
+}
+
+//----------------------------------------------------------------------
+
+/*
+ *  Override exit(), _exit() and _Exit().  Return from main() already
+ *  delivered end process, so then this is just the once check.
+ */
+void
+MONITOR_WRAP_NAME(exit) (int status)
+{
+    monitor_first_entry();
+    monitor_end_process();
+
+    (MONITOR_REAL(exit)) (status);
+
+    // not reached
+    __builtin_unreachable();
+}
+
+void
+MONITOR_WRAP_NAME(_exit) (int status)
+{
+    monitor_first_entry();
+    monitor_end_process();
+
+    (MONITOR_REAL(_exit)) (status);
+
+    // not reached
+    __builtin_unreachable();
+}
+
+void
+MONITOR_WRAP_NAME(_Exit) (int status)
+{
+    monitor_first_entry();
+    monitor_end_process();
+
+    (MONITOR_REAL(_exit)) (status);
+
+    // not reached
+    __builtin_unreachable();
+}
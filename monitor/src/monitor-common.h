@@ -35,11 +35,18 @@
 #ifndef _MONITOR_COMMON_H_
 #define _MONITOR_COMMON_H_
 
+#include <sys/types.h>
 #include <dlfcn.h>
 #include <err.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "monitor-config.h"
+#include "monitor.h"
 
 /*
  *  There are four build cases and exactly one of these must be
@@ -80,13 +87,345 @@ MONITOR_GOTCHA_LINK or MONITOR_STATIC
 	}					\
     }
 
+/*
+ *  Name of an override: the real name in the preload cases, and
+ *  __wrap_name for gotcha link and static.
+ */
+#if defined(MONITOR_PURE_PRELOAD) || defined(MONITOR_GOTCHA_PRELOAD)
+#define MONITOR_WRAP_NAME(name)  name
+#else
+#define MONITOR_WRAP_NAME(name)  __wrap_ ## name
+#endif
+
+//----------------------------------------------------------------------
+
+/*
+ *  Run once init.  The first thread to arrive runs the init function
+ *  and the others wait until it finishes, first with a short spin
+ *  and then with a futex wait.
+ */
+#define MONITOR_ONCE_NONE  0
+#define MONITOR_ONCE_BUSY  1
+#define MONITOR_ONCE_WAIT  2
+#define MONITOR_ONCE_DONE  3
+
+typedef struct monitor_once {
+    atomic_int  mo_state;
+} monitor_once_t;
+
+#define MONITOR_ONCE_INITIALIZER  { MONITOR_ONCE_NONE }
+
+void monitor_run_once_slow(monitor_once_t *, void (*)(void));
+
+static inline void
+monitor_run_once(monitor_once_t * once, void (* init_fcn)(void))
+{
+    if (atomic_load_explicit(&once->mo_state, memory_order_acquire)
+	== MONITOR_ONCE_DONE) {
+	return;
+    }
+
+    monitor_run_once_slow(once, init_fcn);
+}
+
+//----------------------------------------------------------------------
+
+typedef void * (pthread_start_fcn_t) (void *);
+typedef int (pthread_create_fcn_t)
+    (pthread_t *, const pthread_attr_t *, pthread_start_fcn_t *, void *);
+
+typedef void pthread_exit_fcn_t (void *);
+
+typedef void * dlopen_fcn_t (const char *, int);
+typedef int dlclose_fcn_t (void *);
+
+typedef pid_t fork_fcn_t (void);
+typedef int execve_fcn_t (const char *, char * const [], char * const []);
+typedef void exit_fcn_t (int);
+
+typedef void sig_handler_fcn_t (int);
+typedef int sigaction_fcn_t (int, const struct sigaction *, struct sigaction *);
+typedef sig_handler_fcn_t * signal_fcn_t (int, sig_handler_fcn_t *);
+typedef int sigprocmask_fcn_t (int, const sigset_t *, sigset_t *);
+
+/*
+ *  Table of the real versions of the functions we override.  The
+ *  table pointer starts at a table of lazy stubs that resolve every
+ *  entry on first use and then switch the pointer to the resolved
+ *  table.  After that, a call is two loads and an indirect call, no
+ *  branches.
+ *
+ *  In the gotcha cases, the entries are refreshed in place after
+ *  dlopen in case gotcha rebinds.  Any entry a reader sees is a valid
+ *  function, old or new.
+ */
+struct monitor_real_fcns {
+    pthread_create_fcn_t * mr_pthread_create;
+    pthread_exit_fcn_t   * mr_pthread_exit;
+    dlopen_fcn_t  * mr_dlopen;
+    dlclose_fcn_t * mr_dlclose;
+    fork_fcn_t    * mr_fork;
+    execve_fcn_t  * mr_execve;
+    execve_fcn_t  * mr_execvpe;
+    exit_fcn_t    * mr_exit;
+    exit_fcn_t    * mr__exit;
+    sigaction_fcn_t   * mr_sigaction;
+    signal_fcn_t      * mr_signal;
+    sigprocmask_fcn_t * mr_sigprocmask;
+    sigprocmask_fcn_t * mr_pthread_sigmask;
+};
+
+extern struct monitor_real_fcns * monitor_real_fcns;
+
+#define MONITOR_REAL(name)						\
+    (__atomic_load_n(&__atomic_load_n(&monitor_real_fcns,		\
+	__ATOMIC_CONSUME)->mr_ ## name, __ATOMIC_RELAXED))
+
+void monitor_real_init(void);
+void monitor_real_rebind(void);
+void monitor_real_init_pthread(struct monitor_real_fcns *);
+void monitor_real_init_dlopen(struct monitor_real_fcns *);
+void monitor_real_init_process(struct monitor_real_fcns *);
+void monitor_real_init_signal(struct monitor_real_fcns *);
+
+//----------------------------------------------------------------------
+
+/*
+ *  Callback dispatch.  Before the first event, the overridden
+ *  callbacks and the registered sets are frozen into one flat list
+ *  per event, in the order to call them, so an event with no clients
+ *  costs one branch.  The extra slot is for the overridden callbacks.
+ *
+ *  Begin process freezes the lists, and so do dlopen, dlclose and
+ *  fork, which can come first from a constructor.  Not at first
+ *  entry, that can be a preinit constructor, before the clients'
+ *  constructors register.
+ *
+ *  For a post event, ce_data is the index of the same client's entry
+ *  in the pre event's list, or -1 if it has no pre callback.  The
+ *  caller keeps the pre callbacks' return values in a
+ *  monitor_cb_data_t between the two.
+ */
+#define MONITOR_CB_SLOTS  (MONITOR_MAX_CLIENTS + 1)
+
+struct monitor_cb_entry {
+    void (* ce_fcn) (void);
+    int  ce_data;
+};
+
+struct monitor_cb_list {
+    int  cl_num;
+    struct monitor_cb_entry  cl_entry [MONITOR_CB_SLOTS];
+};
+
+struct monitor_cb_table {
+    struct monitor_cb_list  ct_begin_process;
+    struct monitor_cb_list  ct_at_main;
+    struct monitor_cb_list  ct_end_process;
+    struct monitor_cb_list  ct_begin_thread;
+    struct monitor_cb_list  ct_end_thread;
+    struct monitor_cb_list  ct_pre_dlopen;
+    struct monitor_cb_list  ct_post_dlopen;
+    struct monitor_cb_list  ct_pre_dlclose;
+    struct monitor_cb_list  ct_post_dlclose;
+    struct monitor_cb_list  ct_pre_fork;
+    struct monitor_cb_list  ct_post_fork_parent;
+    struct monitor_cb_list  ct_post_fork_child;
+    struct monitor_cb_list  ct_module_load;
+    struct monitor_cb_list  ct_module_unload;
+};
+
+typedef struct monitor_cb_data {
+    void * cd_data [MONITOR_CB_SLOTS];
+} monitor_cb_data_t;
+
+extern struct monitor_cb_table monitor_cb_table;
+extern monitor_once_t monitor_cb_once;
+
+void monitor_callback_init(void);
+
+static inline void
+monitor_callback_freeze(void)
+{
+    monitor_run_once(&monitor_cb_once, monitor_callback_init);
+}
+
+#define MONITOR_CB_FCN(entry, name)  \
+    ((__typeof__ (((struct monitor_callbacks *) 0)->mc_ ## name)) (entry)->ce_fcn)
+
+#define MONITOR_CB_DATA(data, entry)  \
+    (((entry)->ce_data >= 0) ? (data)->cd_data[(entry)->ce_data] : NULL)
+
+// events without data
+#define MONITOR_CB_VOID_EVENT(name)					\
+static inline void							\
+monitor_cb_ ## name (void)						\
+{									\
+    struct monitor_cb_list * list = &monitor_cb_table.ct_ ## name;	\
+									\
+    for (int i = 0; i < list->cl_num; i++) {				\
+	(MONITOR_CB_FCN(&list->cl_entry[i], name)) ();			\
+    }									\
+}
+
+MONITOR_CB_VOID_EVENT(begin_process)
+MONITOR_CB_VOID_EVENT(at_main)
+MONITOR_CB_VOID_EVENT(end_process)
+MONITOR_CB_VOID_EVENT(begin_thread)
+MONITOR_CB_VOID_EVENT(end_thread)
+
+// events with a list of modules
+#define MONITOR_CB_MODULE_EVENT(name)					\
+static inline void							\
+monitor_cb_ ## name (const struct monitor_module * mods, long num)	\
+{									\
+    struct monitor_cb_list * list = &monitor_cb_table.ct_ ## name;	\
+									\
+    if (num <= 0) {							\
+	return;								\
+    }									\
+    for (int i = 0; i < list->cl_num; i++) {				\
+	(MONITOR_CB_FCN(&list->cl_entry[i], name)) (mods, num);		\
+    }									\
+}
+
+MONITOR_CB_MODULE_EVENT(module_load)
+MONITOR_CB_MODULE_EVENT(module_unload)
+
+static inline void
+monitor_cb_pre_dlopen(monitor_cb_data_t * data, const char * name, int flags)
+{
+    struct monitor_cb_list * list = &monitor_cb_table.ct_pre_dlopen;
+
+    for (int i = 0; i < list->cl_num; i++) {
+	data->cd_data[i] = (MONITOR_CB_FCN(&list->cl_entry[i], pre_dlopen)) (name, flags);
+    }
+}
+
+static inline void
+monitor_cb_post_dlopen(monitor_cb_data_t * data, void * handle)
+{
+    struct monitor_cb_list * list = &monitor_cb_table.ct_post_dlopen;
+
+    for (int i = 0; i < list->cl_num; i++) {
+	struct monitor_cb_entry * entry = &list->cl_entry[i];
+
+	(MONITOR_CB_FCN(entry, post_dlopen)) (MONITOR_CB_DATA(data, entry), handle);
+    }
+}
+
+static inline void
+monitor_cb_pre_dlclose(monitor_cb_data_t * data, void * handle)
+{
+    struct monitor_cb_list * list = &monitor_cb_table.ct_pre_dlclose;
+
+    for (int i = 0; i < list->cl_num; i++) {
+	data->cd_data[i] = (MONITOR_CB_FCN(&list->cl_entry[i], pre_dlclose)) (handle);
+    }
+}
+
+static inline void
+monitor_cb_post_dlclose(monitor_cb_data_t * data, void * handle, int ret)
+{
+    struct monitor_cb_list * list = &monitor_cb_table.ct_post_dlclose;
+
+    for (int i = 0; i < list->cl_num; i++) {
+	struct monitor_cb_entry * entry = &list->cl_entry[i];
+
+	(MONITOR_CB_FCN(entry, post_dlclose)) (MONITOR_CB_DATA(data, entry), handle, ret);
+    }
+}
+
+static inline void
+monitor_cb_pre_fork(monitor_cb_data_t * data)
+{
+    struct monitor_cb_list * list = &monitor_cb_table.ct_pre_fork;
+
+    for (int i = 0; i < list->cl_num; i++) {
+	data->cd_data[i] = (MONITOR_CB_FCN(&list->cl_entry[i], pre_fork)) ();
+    }
+}
+
+static inline void
+monitor_cb_post_fork_parent(monitor_cb_data_t * data, pid_t child)
+{
+    struct monitor_cb_list * list = &monitor_cb_table.ct_post_fork_parent;
+
+    for (int i = 0; i < list->cl_num; i++) {
+	struct monitor_cb_entry * entry = &list->cl_entry[i];
+
+	(MONITOR_CB_FCN(entry, post_fork_parent)) (child, MONITOR_CB_DATA(data, entry));
+    }
+}
+
+static inline void
+monitor_cb_post_fork_child(monitor_cb_data_t * data)
+{
+    struct monitor_cb_list * list = &monitor_cb_table.ct_post_fork_child;
+
+    for (int i = 0; i < list->cl_num; i++) {
+	struct monitor_cb_entry * entry = &list->cl_entry[i];
+
+	(MONITOR_CB_FCN(entry, post_fork_child)) (MONITOR_CB_DATA(data, entry));
+    }
+}
+
+//----------------------------------------------------------------------
+
+/*
+ *  The modules added and removed by one load map update, in one
+ *  buffer that the caller returns with monitor_load_diff_release().
+ */
+struct monitor_load_diff {
+    struct monitor_module * ld_added;
+    struct monitor_module * ld_removed;
+    long    ld_num_added;
+    long    ld_num_removed;
+    void *  ld_buf;
+};
+
+//----------------------------------------------------------------------
+//  Event log
+//----------------------------------------------------------------------
+
+static inline uint64_t
+monitor_log_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+void monitor_log_event(int, uint64_t, void *);
+void monitor_log_init(void);
+void monitor_log_end_process(void);
+
 //----------------------------------------------------------------------
 
 int  monitor_debug(void);
 void monitor_first_entry(void);
 void monitor_try_begin_process(void);
+void monitor_end_process(void);
+void monitor_thread_init_main(void);
+void monitor_thread_fork_child(void);
+void ** monitor_thread_hazard(void);
+void monitor_thread_hazard_wait(void *);
+void monitor_load_map_update(struct monitor_load_diff *);
+void monitor_load_diff_release(struct monitor_load_diff *);
+void monitor_load_map_fork_child(void);
+void monitor_signal_fork_child(void);
+
+struct gotcha_binding_t;
 
 void monitor_gotcha_init(void);
+void monitor_gotcha_env(char **);
+void monitor_gotcha_wrap(struct gotcha_binding_t *, int);
+void monitor_gotcha_report(void);
+void monitor_gotcha_fork_child(void);
 void monitor_gotcha_init_dlopen(void);
+void monitor_gotcha_init_process(void);
+void monitor_gotcha_init_signal(void);
 
 #endif  // _MONITOR_COMMON_H_
@@ -38,10 +38,15 @@
  */
 
 #include <sys/types.h>
+#include <sys/syscall.h>
 #include <err.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
 
 #include "monitor-config.h"
 #include "monitor-common.h"
@@ -49,10 +54,89 @@
 
 #define MONITOR_DEBUG_VAR  "MONITOR_DEBUG"
 
+#define MONITOR_ONCE_SPIN  200
+
 static int monitor_debug_flag = 0;
 
-static volatile int monitor_init_start = 0;
-static volatile int monitor_init_done = 0;
+static monitor_once_t monitor_init_once = MONITOR_ONCE_INITIALIZER;
+static monitor_once_t monitor_real_once = MONITOR_ONCE_INITIALIZER;
+
+//----------------------------------------------------------------------
+
+/*
+ *  Hint to the cpu that we are in a spin loop.
+ */
+static inline void
+monitor_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__ ("pause" ::: "memory");
+#elif defined(__aarch64__)
+    __asm__ __volatile__ ("yield" ::: "memory");
+#elif defined(__powerpc64__) || defined(__powerpc__)
+    __asm__ __volatile__ ("or 27,27,27" ::: "memory");
+#else
+    atomic_signal_fence(memory_order_seq_cst);
+#endif
+}
+
+static void
+monitor_futex_wait(atomic_int * addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void
+monitor_futex_wake_all(atomic_int * addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ *  Slow path for monitor_run_once().  The state goes NONE -> BUSY ->
+ *  DONE, or BUSY -> WAIT if some thread sleeps on the futex, in
+ *  which case the init thread has to wake it.
+ */
+void
+monitor_run_once_slow(monitor_once_t * once, void (* init_fcn)(void))
+{
+    int state = MONITOR_ONCE_NONE;
+
+    if (atomic_compare_exchange_strong_explicit(&once->mo_state, &state,
+	    MONITOR_ONCE_BUSY, memory_order_acquire, memory_order_acquire))
+    {
+	(* init_fcn) ();
+
+	state = atomic_exchange_explicit(&once->mo_state, MONITOR_ONCE_DONE,
+					 memory_order_acq_rel);
+	if (state == MONITOR_ONCE_WAIT) {
+	    monitor_futex_wake_all(&once->mo_state);
+	}
+	return;
+    }
+
+    for (int i = 0; i < MONITOR_ONCE_SPIN; i++) {
+	if (atomic_load_explicit(&once->mo_state, memory_order_acquire)
+	    == MONITOR_ONCE_DONE) {
+	    return;
+	}
+	monitor_cpu_relax();
+    }
+
+    for (;;) {
+	state = atomic_load_explicit(&once->mo_state, memory_order_acquire);
+
+	if (state == MONITOR_ONCE_DONE) {
+	    return;
+	}
+	if (state == MONITOR_ONCE_BUSY
+	    && ! atomic_compare_exchange_weak_explicit(&once->mo_state, &state,
+		   MONITOR_ONCE_WAIT, memory_order_acquire, memory_order_acquire)) {
+	    continue;
+	}
+	monitor_futex_wait(&once->mo_state, MONITOR_ONCE_WAIT);
+    }
+}
 
 //----------------------------------------------------------------------
 
@@ -67,6 +151,7 @@ monitor_debug(void)
 static void
 monitor_init(void)
 {
+    uint64_t start = monitor_log_time();
     char * str = getenv(MONITOR_DEBUG_VAR);
 
     if (str != NULL) {
@@ -76,31 +161,247 @@ monitor_init(void)
 	    monitor_debug_flag = 1;
 	}
     }
+
+    monitor_log_init();
+    monitor_log_event(MONITOR_LOG_FIRST_ENTRY, start, NULL);
 }
 
 //----------------------------------------------------------------------
 
 /*
- *  The first thread to get here runs monitor init.  The other threads
- *  wait until init finishes.
+ *  Lazy stubs for the table of real functions.  Each one resolves the
+ *  whole table and then calls through the real entry.
  */
-void
-monitor_first_entry(void)
+static int
+lazy_pthread_create(pthread_t * thread, const pthread_attr_t * attr,
+		    pthread_start_fcn_t * start_routine, void * arg)
 {
-    if (monitor_init_done) {
-	return;
+    monitor_real_init();
+
+    return (MONITOR_REAL(pthread_create)) (thread, attr, start_routine, arg);
+}
+
+static void
+lazy_pthread_exit(void * retval)
+{
+    monitor_real_init();
+
+    (MONITOR_REAL(pthread_exit)) (retval);
+}
+
+static pid_t
+lazy_fork(void)
+{
+    monitor_real_init();
+
+    return (MONITOR_REAL(fork)) ();
+}
+
+static int
+lazy_execve(const char * path, char * const argv [], char * const envp [])
+{
+    monitor_real_init();
+
+    return (MONITOR_REAL(execve)) (path, argv, envp);
+}
+
+static int
+lazy_execvpe(const char * file, char * const argv [], char * const envp [])
+{
+    monitor_real_init();
+
+    return (MONITOR_REAL(execvpe)) (file, argv, envp);
+}
+
+static void
+lazy_exit(int status)
+{
+    monitor_real_init();
+
+    (MONITOR_REAL(exit)) (status);
+}
+
+static void
+lazy__exit(int status)
+{
+    monitor_real_init();
+
+    (MONITOR_REAL(_exit)) (status);
+}
+
+static int
+lazy_sigaction(int sig, const struct sigaction * act, struct sigaction * oldact)
+{
+    monitor_real_init();
+
+    return (MONITOR_REAL(sigaction)) (sig, act, oldact);
+}
+
+static sig_handler_fcn_t *
+lazy_signal(int sig, sig_handler_fcn_t * handler)
+{
+    monitor_real_init();
+
+    return (MONITOR_REAL(signal)) (sig, handler);
+}
+
+static int
+lazy_sigprocmask(int how, const sigset_t * set, sigset_t * oldset)
+{
+    monitor_real_init();
+
+    return (MONITOR_REAL(sigprocmask)) (how, set, oldset);
+}
+
+static int
+lazy_pthread_sigmask(int how, const sigset_t * set, sigset_t * oldset)
+{
+    monitor_real_init();
+
+    return (MONITOR_REAL(pthread_sigmask)) (how, set, oldset);
+}
+
+#if defined(MONITOR_USE_DLOPEN) && !defined(MONITOR_STATIC)
+static void *
+lazy_dlopen(const char * name, int flags)
+{
+    monitor_real_init();
+
+    return (MONITOR_REAL(dlopen)) (name, flags);
+}
+
+static int
+lazy_dlclose(void * handle)
+{
+    monitor_real_init();
+
+    return (MONITOR_REAL(dlclose)) (handle);
+}
+#endif
+
+static struct monitor_real_fcns monitor_lazy_table = {
+    .mr_pthread_create = lazy_pthread_create,
+    .mr_pthread_exit = lazy_pthread_exit,
+    .mr_fork    = lazy_fork,
+    .mr_execve  = lazy_execve,
+    .mr_execvpe = lazy_execvpe,
+    .mr_exit    = lazy_exit,
+    .mr__exit   = lazy__exit,
+    .mr_sigaction   = lazy_sigaction,
+    .mr_signal      = lazy_signal,
+    .mr_sigprocmask = lazy_sigprocmask,
+    .mr_pthread_sigmask = lazy_pthread_sigmask,
+#if defined(MONITOR_USE_DLOPEN) && !defined(MONITOR_STATIC)
+    .mr_dlopen  = lazy_dlopen,
+    .mr_dlclose = lazy_dlclose,
+#endif
+};
+
+static struct monitor_real_fcns monitor_resolved_table;
+
+struct monitor_real_fcns * monitor_real_fcns = &monitor_lazy_table;
+
+//----------------------------------------------------------------------
+
+static void
+monitor_real_fill(void)
+{
+    monitor_real_init_pthread(&monitor_resolved_table);
+    if (monitor_resolved_table.mr_pthread_create == NULL) {
+	errx(1, "unable to get real version of pthread_create");
+    }
+    if (monitor_resolved_table.mr_pthread_exit == NULL) {
+	errx(1, "unable to get real version of pthread_exit");
     }
 
-    if (__sync_bool_compare_and_swap(&monitor_init_start, 0, 1))
-    {
-	monitor_init();
+    monitor_real_init_process(&monitor_resolved_table);
+    if (monitor_resolved_table.mr_fork == NULL) {
+	errx(1, "unable to get real version of fork");
+    }
+    if (monitor_resolved_table.mr_execve == NULL
+	|| monitor_resolved_table.mr_execvpe == NULL) {
+	errx(1, "unable to get real version of exec");
+    }
+    if (monitor_resolved_table.mr_exit == NULL
+	|| monitor_resolved_table.mr__exit == NULL) {
+	errx(1, "unable to get real version of exit");
+    }
 
-	__sync_synchronize();
+    monitor_real_init_signal(&monitor_resolved_table);
+    if (monitor_resolved_table.mr_sigaction == NULL
+	|| monitor_resolved_table.mr_signal == NULL) {
+	errx(1, "unable to get real version of sigaction");
+    }
+    if (monitor_resolved_table.mr_sigprocmask == NULL
+	|| monitor_resolved_table.mr_pthread_sigmask == NULL) {
+	errx(1, "unable to get real version of sigprocmask");
+    }
 
-	monitor_init_done = 1;
+#if defined(MONITOR_USE_DLOPEN) && !defined(MONITOR_STATIC)
+    monitor_real_init_dlopen(&monitor_resolved_table);
+    if (monitor_resolved_table.mr_dlopen == NULL) {
+	errx(1, "unable to get real version of dlopen");
     }
-    else {
-	while (! monitor_init_done)
-	    ;
+    if (monitor_resolved_table.mr_dlclose == NULL) {
+	errx(1, "unable to get real version of dlclose");
     }
+#endif
+}
+
+static void
+monitor_real_resolve(void)
+{
+    monitor_real_fill();
+
+    __atomic_store_n(&monitor_real_fcns, &monitor_resolved_table, __ATOMIC_RELEASE);
+}
+
+/*
+ *  Resolve the table of real functions, once.  In the gotcha cases,
+ *  the wrappee handles are not valid until gotcha init finishes.
+ */
+void
+monitor_real_init(void)
+{
+#if defined(MONITOR_GOTCHA_ANY)
+    monitor_gotcha_init();
+#endif
+
+    monitor_run_once(&monitor_real_once, monitor_real_resolve);
+}
+
+/*
+ *  Refresh the gotcha entries in the resolved table in place, after a
+ *  new library may have caused gotcha to rebind.  Entries from dlsym()
+ *  don't change.  If the table is not yet resolved, then the lazy
+ *  stubs will pick up the current values.
+ */
+void
+monitor_real_rebind(void)
+{
+    if (atomic_load_explicit(&monitor_real_once.mo_state, memory_order_acquire)
+	!= MONITOR_ONCE_DONE) {
+	return;
+    }
+
+#if defined(MONITOR_GOTCHA_LINK)
+    monitor_real_init_pthread(&monitor_resolved_table);
+    monitor_real_init_process(&monitor_resolved_table);
+    monitor_real_init_signal(&monitor_resolved_table);
+#endif
+#if defined(MONITOR_GOTCHA_ANY) && defined(MONITOR_USE_DLOPEN)
+    monitor_real_init_dlopen(&monitor_resolved_table);
+#endif
+}
+
+//----------------------------------------------------------------------
+
+/*
+ *  The first thread to get here runs monitor init.  The other threads
+ *  wait until init finishes.
+ */
+void
+monitor_first_entry(void)
+{
+    monitor_run_once(&monitor_init_once, monitor_init);
 }
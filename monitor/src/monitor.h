@@ -35,10 +35,65 @@
 #ifndef  _MONITOR_H_
 #define  _MONITOR_H_
 
+#include <sys/types.h>
+#include <signal.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ *  Per-thread context.  The main thread is number 0 and other threads
+ *  are numbered 1, 2, ... in the order they start.  Numbers are not
+ *  reused.  Client data is NULL at thread start and is for the client
+ *  to use.
+ */
+struct monitor_thread_info {
+    long   mti_thread_num;
+    void * mti_client_data;
+};
+
+/*
+ *  Return the context for the current thread, or NULL if the thread
+ *  is not (or no longer) known to monitor.  This is a single TLS
+ *  load and is safe to call from a signal handler.
+ */
+extern struct monitor_thread_info * monitor_get_thread_info(void);
+
+/*
+ *  One loaded object in the load map: the range of its PT_LOAD
+ *  segments and the load bias (dlpi_addr), so pc - mm_load_addr is
+ *  the address in the file.  The name is the full path, or the
+ *  program's path for the main executable.  Names stay valid for the
+ *  life of the process.
+ */
+struct monitor_module {
+    const char * mm_name;
+    void *  mm_start;
+    void *  mm_end;
+    unsigned long  mm_load_addr;
+};
+
+/*
+ *  The load map is built at begin process and rebuilt after a dlopen
+ *  or dlclose that changes the set of loaded objects, and each new
+ *  map has a new generation number.  Clients that need the changes
+ *  can register module load and unload callbacks instead of
+ *  rescanning the map (see monitor_register_callbacks).
+ *
+ *  monitor_find_module() copies the module containing pc into mod and
+ *  returns 1, or returns 0 if pc is not in any module or the map is
+ *  not yet built.  It's a binary search without locks or malloc and
+ *  is safe to call from a signal handler.
+ *
+ *  monitor_get_load_map() copies up to max modules, sorted by address,
+ *  into buf and returns the total number of modules.
+ */
+extern int monitor_find_module(const void * pc, struct monitor_module * mod);
+extern unsigned long monitor_load_map_generation(void);
+extern long monitor_get_load_map(struct monitor_module * buf, long max);
+
 /*
  *  Callback functions for the client to override.
  */
@@ -53,6 +108,211 @@ extern void monitor_post_dlopen_cb(void *, void *);
 extern void * monitor_pre_dlclose_cb(void *);
 extern void monitor_post_dlclose_cb(void *, void *, int);
 
+/*
+ *  Fork: pre fork runs in the parent and its return value is passed
+ *  to post fork in the parent (with the child's pid, or -1 if fork
+ *  failed) and in the child.  The child starts with only the forking
+ *  thread and gets end process when it exits, but not another begin
+ *  process.  vfork() is run as fork().
+ *
+ *  End process is delivered once, from whichever comes first: return
+ *  from main(), exit(), _exit(), _Exit(), exec, or the last thread
+ *  exiting after the main thread calls pthread_exit().  If exec
+ *  fails, the process continues without monitor callbacks.
+ */
+extern void * monitor_pre_fork_cb(void);
+extern void monitor_post_fork_parent_cb(pid_t, void *);
+extern void monitor_post_fork_child_cb(void *);
+
+/*
+ *  Callback sets.  Overriding the callbacks above works for one
+ *  client per process.  Several clients can instead each register a
+ *  set of callbacks (NULL for events they don't want), from a
+ *  constructor, before monitor's first event (normally begin process).
+ *  The sets are copied and frozen into one dispatch list per event at
+ *  that point, and later calls fail.  With monitor-link (gotcha),
+ *  begin process comes from monitor's own constructor, so use a
+ *  constructor priority, eg, __attribute__ ((constructor (101))).
+ *
+ *  Begin process, at main, begin thread and the pre callbacks run in
+ *  increasing priority, and end process, end thread and the post
+ *  callbacks in decreasing priority, so the lower numbers wrap around
+ *  the higher.  Equal priorities go in order of registration.  Each
+ *  client's post callbacks get the value that its own pre callback
+ *  returned (or NULL if it has none).  The overridden monitor_*_cb
+ *  functions act as one set with priority MONITOR_PRIORITY_DEFAULT,
+ *  registered first.
+ *
+ *  Module load and unload are only in callback sets.  After dlopen
+ *  or dlclose changes the load map, they get the modules that were
+ *  added or removed since the previous map, as an array of num
+ *  modules sorted by address, before post dlopen or post dlclose.
+ *  Every change is reported once, by the update that first sees it,
+ *  so an unload can come from a dlopen (another thread's dlclose).
+ *  The modules in the map at begin process are not reported, use
+ *  monitor_get_load_map() there.  Load runs in increasing priority
+ *  and unload in decreasing.
+ *
+ *  Returns 0 on success, or -1 if monitor has started or there are
+ *  already MONITOR_MAX_CLIENTS sets.
+ */
+#define MONITOR_MAX_CLIENTS  8
+#define MONITOR_PRIORITY_DEFAULT  0
+
+struct monitor_callbacks {
+    int  mc_priority;
+    void (* mc_begin_process) (void);
+    void (* mc_at_main) (void);
+    void (* mc_end_process) (void);
+    void (* mc_begin_thread) (void);
+    void (* mc_end_thread) (void);
+    void * (* mc_pre_dlopen) (const char *, int);
+    void (* mc_post_dlopen) (void *, void *);
+    void * (* mc_pre_dlclose) (void *);
+    void (* mc_post_dlclose) (void *, void *, int);
+    void * (* mc_pre_fork) (void);
+    void (* mc_post_fork_parent) (pid_t, void *);
+    void (* mc_post_fork_child) (void *);
+    void (* mc_module_load) (const struct monitor_module *, long);
+    void (* mc_module_unload) (const struct monitor_module *, long);
+};
+
+extern int monitor_register_callbacks(const struct monitor_callbacks *);
+
+/*
+ *  Client signals.  monitor_sigaction() reserves sig for the client,
+ *  installs handler and unblocks sig in the calling thread.  The
+ *  handler returns 0 if it handled the signal, or non-zero to pass
+ *  it on to the application's handler (or the default action).  The
+ *  sa_mask and SA_RESTART and SA_NODEFER flags from act are used if
+ *  act is not NULL, and the handler always runs with SA_ONSTACK (so
+ *  the application's handler gets its sigaltstack).  Flags is unused
+ *  and should be 0.
+ *
+ *  After that, the application's sigaction() and signal() for sig
+ *  only change the action it chains to, and the application can't
+ *  block sig with sigprocmask(), pthread_sigmask() or a handler's
+ *  sa_mask.  The monitor_real versions bypass this.
+ */
+typedef int monitor_sighandler_t (int, siginfo_t *, void *);
+
+extern int monitor_sigaction(int, monitor_sighandler_t *, int, struct sigaction *);
+extern int monitor_real_sigprocmask(int, const sigset_t *, sigset_t *);
+extern int monitor_real_pthread_sigmask(int, const sigset_t *, sigset_t *);
+
+/*
+ *  Client threads.  Threads that the calling thread creates between
+ *  monitor_disable_new_threads() and monitor_enable_new_threads() are
+ *  not monitored: they get no begin or end thread callbacks, no
+ *  context (monitor_get_thread_info() returns NULL) and don't keep
+ *  end process waiting after main calls pthread_exit().  This is for
+ *  the client's own helper threads.
+ */
+extern void monitor_disable_new_threads(void);
+extern void monitor_enable_new_threads(void);
+
+/*
+ *  Registry of fixed size records, for per-thread data.  Records live
+ *  in chunks of MONITOR_REGISTRY_CHUNK_SIZE that are mmap()ed on
+ *  demand and never moved or unmapped, so a record's address and
+ *  index are permanent and readers don't need locks.  Monitor keeps
+ *  its own thread nodes in one.
+ *
+ *  monitor_registry_alloc() returns a zeroed record, recycling freed
+ *  ones first, and monitor_registry_free() returns it.  Both are
+ *  lock-free, don't call malloc() and are safe in a signal handler.
+ *
+ *  To visit the records, call monitor_registry_lookup() for each
+ *  index below monitor_registry_size().  It returns NULL for free
+ *  slots.  A record is visible as soon as it's allocated, so the
+ *  client should publish its own ready flag if it needs one.
+ *
+ *  Define a registry with:
+ *    static struct monitor_registry reg =
+ *      MONITOR_REGISTRY_INITIALIZER(sizeof(struct my_record));
+ */
+#define MONITOR_REGISTRY_CHUNK_SIZE   256
+#define MONITOR_REGISTRY_MAX_CHUNKS  4096
+
+struct monitor_registry {
+    size_t    rg_size;
+    uint32_t  rg_next_index;
+    uint64_t  rg_free_head;
+    void *    rg_chunk [MONITOR_REGISTRY_MAX_CHUNKS];
+};
+
+#define MONITOR_REGISTRY_INITIALIZER(size)  { (size), 0, 0, { NULL } }
+
+extern void * monitor_registry_alloc(struct monitor_registry *);
+extern void monitor_registry_free(struct monitor_registry *, void *);
+extern void * monitor_registry_lookup(struct monitor_registry *, long);
+extern long monitor_registry_index(struct monitor_registry *, void *);
+extern long monitor_registry_size(struct monitor_registry *);
+
+/*
+ *  Event log of monitor's own work: when the process and threads
+ *  begin and end, gotcha init and dlopen/dlclose, with how long each
+ *  one took (including the client callbacks).  It's always on.  Per
+ *  event, it costs two clock reads, a few relaxed atomics on totals
+ *  striped by thread (mostly uncontended), and a fetch and add plus
+ *  a seqlock write on the shared ring.
+ *
+ *  The log keeps the first event of each type, running totals per
+ *  type and a ring of the last MONITOR_LOG_RING_SIZE events from all
+ *  threads.  With MONITOR_LOG=dir in the environment, it's written to
+ *  dir/monitor-<pid>.log at end of process (monitor-<pid>.1.log, etc,
+ *  after exec), and monitor_log_dump() writes it to fd at any time.
+ *  Returns 0 on success, or -1 with errno set.
+ *
+ *  The file is a monitor_log_header, then num_types totals, then
+ *  num_types first events (type MONITOR_LOG_NONE if none yet), then
+ *  num_events events from the ring, oldest first.  Times are
+ *  CLOCK_MONOTONIC nsec.
+ */
+#define MONITOR_LOG_MAGIC    "MONLOG"
+#define MONITOR_LOG_VERSION  1
+#define MONITOR_LOG_RING_SIZE  4096
+
+#define MONITOR_LOG_NONE           0
+#define MONITOR_LOG_FIRST_ENTRY    1
+#define MONITOR_LOG_GOTCHA_INIT    2
+#define MONITOR_LOG_BEGIN_PROCESS  3
+#define MONITOR_LOG_AT_MAIN        4
+#define MONITOR_LOG_END_PROCESS    5
+#define MONITOR_LOG_THREAD_CREATE  6
+#define MONITOR_LOG_BEGIN_THREAD   7
+#define MONITOR_LOG_END_THREAD     8
+#define MONITOR_LOG_DLOPEN         9
+#define MONITOR_LOG_DLCLOSE       10
+#define MONITOR_LOG_NUM_TYPES     11
+
+struct monitor_log_event {
+    uint64_t  le_time;    // start of the event
+    uint64_t  le_dur;
+    uint64_t  le_arg;     // dlopen/dlclose handle
+    int32_t   le_thread;  // monitor thread number, -1 if unknown
+    uint32_t  le_type;
+};
+
+struct monitor_log_total {
+    uint64_t  lt_count;
+    uint64_t  lt_total;
+    uint64_t  lt_max;
+};
+
+struct monitor_log_header {
+    char      lh_magic[8];
+    uint32_t  lh_version;
+    uint32_t  lh_header_size;
+    uint32_t  lh_pid;
+    uint32_t  lh_num_types;
+    uint64_t  lh_num_events;
+    uint64_t  lh_lost;      // events overwritten in the ring
+    uint64_t  lh_dump_time;
+};
+
+extern int monitor_log_dump(int);
+
 #ifdef __cplusplus
 }
 #endif
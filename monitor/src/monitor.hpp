@@ -0,0 +1,196 @@
+/*
+ *  Header-only C++17 layer for libmonitor clients.
+ *
+ *  Copyright (c) 2019-2020, Rice University.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of Rice University (RICE) nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  This software is provided by RICE and contributors "as is" and any
+ *  express or implied warranties, including, but not limited to, the
+ *  implied warranties of merchantability and fitness for a particular
+ *  purpose are disclaimed. In no event shall RICE or contributors be
+ *  liable for any direct, indirect, incidental, special, exemplary, or
+ *  consequential damages (including, but not limited to, procurement of
+ *  substitute goods or services; loss of use, data, or profits; or
+ *  business interruption) however caused and on any theory of liability,
+ *  whether in contract, strict liability, or tort (including negligence
+ *  or otherwise) arising in any way out of the use of this software, even
+ *  if advised of the possibility of such damage.
+ */
+
+#ifndef  _MONITOR_HPP_
+#define  _MONITOR_HPP_
+
+#include <err.h>
+#include <type_traits>
+
+#include "monitor.h"
+
+/*
+ *  A tool is a class with member functions named for the events it
+ *  handles, with the same arguments as the monitor_*_cb functions in
+ *  monitor.h (or the mc_module_load and mc_module_unload members of
+ *  struct monitor_callbacks), for example:
+ *
+ *    struct my_tool {
+ *        void begin_thread();
+ *        void end_thread();
+ *        void * pre_fork();
+ *        void post_fork_child(void * data);
+ *    };
+ *
+ *    MONITOR_TOOL(my_tool, 10);
+ *
+ *  MONITOR_TOOL defines the tool object and registers a callback set
+ *  (see monitor_register_callbacks) with the given priority.  Which
+ *  members the tool has is decided at compile time, and the set has
+ *  entries only for those, so monitor calls nothing for the other
+ *  events.  Each entry is a static trampoline that calls the tool's
+ *  member directly and it can inline there.
+ *
+ *  Both objects are constructed with init_priority 101, before
+ *  monitor's own constructor in the monitor-link case.  Use
+ *  MONITOR_TOOL once per program, and monitor::tool<T>() to get the
+ *  object.
+ */
+
+namespace monitor {
+namespace detail {
+
+#define MONITOR_HAS_MEMBER(name)					\
+    template <class T, class = void>					\
+    struct has_ ## name : std::false_type { };				\
+    template <class T>							\
+    struct has_ ## name <T, std::void_t<decltype(&T::name)>>		\
+	: std::true_type { };
+
+MONITOR_HAS_MEMBER(begin_process)
+MONITOR_HAS_MEMBER(at_main)
+MONITOR_HAS_MEMBER(end_process)
+MONITOR_HAS_MEMBER(begin_thread)
+MONITOR_HAS_MEMBER(end_thread)
+MONITOR_HAS_MEMBER(pre_dlopen)
+MONITOR_HAS_MEMBER(post_dlopen)
+MONITOR_HAS_MEMBER(pre_dlclose)
+MONITOR_HAS_MEMBER(post_dlclose)
+MONITOR_HAS_MEMBER(pre_fork)
+MONITOR_HAS_MEMBER(post_fork_parent)
+MONITOR_HAS_MEMBER(post_fork_child)
+MONITOR_HAS_MEMBER(module_load)
+MONITOR_HAS_MEMBER(module_unload)
+
+#undef MONITOR_HAS_MEMBER
+
+/*
+ *  The trampolines are only instantiated for members the tool has.
+ */
+template <class Tool>
+struct client {
+    static inline Tool * self = nullptr;
+
+    static void begin_process() { self->begin_process(); }
+    static void at_main() { self->at_main(); }
+    static void end_process() { self->end_process(); }
+    static void begin_thread() { self->begin_thread(); }
+    static void end_thread() { self->end_thread(); }
+
+    static void * pre_dlopen(const char * name, int flags)
+	{ return self->pre_dlopen(name, flags); }
+    static void post_dlopen(void * data, void * handle)
+	{ self->post_dlopen(data, handle); }
+    static void * pre_dlclose(void * handle)
+	{ return self->pre_dlclose(handle); }
+    static void post_dlclose(void * data, void * handle, int ret)
+	{ self->post_dlclose(data, handle, ret); }
+
+    static void * pre_fork() { return self->pre_fork(); }
+    static void post_fork_parent(pid_t child, void * data)
+	{ self->post_fork_parent(child, data); }
+    static void post_fork_child(void * data)
+	{ self->post_fork_child(data); }
+
+    static void module_load(const struct monitor_module * mods, long num)
+	{ self->module_load(mods, num); }
+    static void module_unload(const struct monitor_module * mods, long num)
+	{ self->module_unload(mods, num); }
+
+    static struct monitor_callbacks
+    callbacks(int priority)
+    {
+	struct monitor_callbacks cb = { };
+
+	cb.mc_priority = priority;
+
+#define MONITOR_SET_MEMBER(name)			\
+	if constexpr (has_ ## name <Tool>::value) {	\
+	    cb.mc_ ## name = name;			\
+	}
+
+	MONITOR_SET_MEMBER(begin_process)
+	MONITOR_SET_MEMBER(at_main)
+	MONITOR_SET_MEMBER(end_process)
+	MONITOR_SET_MEMBER(begin_thread)
+	MONITOR_SET_MEMBER(end_thread)
+	MONITOR_SET_MEMBER(pre_dlopen)
+	MONITOR_SET_MEMBER(post_dlopen)
+	MONITOR_SET_MEMBER(pre_dlclose)
+	MONITOR_SET_MEMBER(post_dlclose)
+	MONITOR_SET_MEMBER(pre_fork)
+	MONITOR_SET_MEMBER(post_fork_parent)
+	MONITOR_SET_MEMBER(post_fork_child)
+	MONITOR_SET_MEMBER(module_load)
+	MONITOR_SET_MEMBER(module_unload)
+
+#undef MONITOR_SET_MEMBER
+
+	return cb;
+    }
+};
+
+}  // namespace detail
+
+template <class Tool>
+class registration {
+public:
+    registration(Tool & tool, int priority)
+    {
+	detail::client<Tool>::self = &tool;
+
+	struct monitor_callbacks cb = detail::client<Tool>::callbacks(priority);
+
+	if (monitor_register_callbacks(&cb) != 0) {
+	    warnx("monitor_register_callbacks failed, tool is not registered");
+	}
+    }
+};
+
+template <class Tool>
+inline Tool &
+tool()
+{
+    return *detail::client<Tool>::self;
+}
+
+}  // namespace monitor
+
+#define MONITOR_TOOL(type, priority)					\
+    static type monitor_tool_object					\
+	__attribute__ ((init_priority (101)));				\
+    static monitor::registration<type> monitor_tool_registration	\
+	__attribute__ ((init_priority (101))) (monitor_tool_object, (priority))
+
+#endif  // _MONITOR_HPP_
@@ -33,10 +33,14 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <err.h>
 #include <errno.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #if defined(MONITOR_PURE_PRELOAD) || defined(MONITOR_GOTCHA_PRELOAD)
 #include <dlfcn.h>
@@ -50,24 +54,381 @@
 #include "monitor-common.h"
 #include "monitor.h"
 
-typedef void * (pthread_start_fcn_t) (void *);
-typedef int (pthread_create_fcn_t)
-    (pthread_t *, const pthread_attr_t *, pthread_start_fcn_t *, void *);
-
 struct monitor_thread_node {
+    struct monitor_thread_info  tn_info;
     pthread_start_fcn_t * tn_start_routine;
     void * tn_arg;
+    void * tn_hazard;
 };
 
-#if defined(MONITOR_GOTCHA_PRELOAD) || defined(MONITOR_GOTCHA_LINK)
+#if defined(MONITOR_GOTCHA_LINK)
 static gotcha_wrappee_handle_t  pthread_create_handle;
+static gotcha_wrappee_handle_t  pthread_exit_handle;
 #endif
 
 #if defined(MONITOR_STATIC)
 extern pthread_create_fcn_t  __real_pthread_create;
+extern pthread_exit_fcn_t    __real_pthread_exit;
+#endif
+
+/*
+ *  Thread nodes come from a registry, so we never call malloc(), not
+ *  even for threads created from a preinit or init constructor.
+ */
+static struct monitor_registry thread_node_registry =
+    MONITOR_REGISTRY_INITIALIZER(sizeof(struct monitor_thread_node));
+
+static long monitor_next_thread_num = 1;
+
+/*
+ *  Threads created but not yet finished, not counting main.  If main
+ *  calls pthread_exit(), the last thread to finish delivers end
+ *  process.
+ */
+static long monitor_live_threads = 0;
+static int  monitor_main_exited = 0;
+
+static struct monitor_thread_node monitor_main_thread_node;
+
+static __thread struct monitor_thread_node * monitor_thread_self
+    __attribute__ ((tls_model ("initial-exec"))) = NULL;
+
+// new threads from this thread are the client's, not monitored
+static __thread int monitor_no_new_threads
+    __attribute__ ((tls_model ("initial-exec"))) = 0;
+
+//----------------------------------------------------------------------
+
+/*
+ *  Each record is preceded by a slot header with its index, the free
+ *  list link and whether it's allocated.  The header is 16 bytes and
+ *  records are rounded up to 16, so records are 16-byte aligned.
+ */
+#define REGISTRY_ALIGN  16
+
+struct monitor_registry_slot {
+    uint32_t  rs_index;
+    uint32_t  rs_next;
+    uint32_t  rs_live;
+    uint32_t  rs_pad;
+};
+
+static size_t
+monitor_registry_stride(struct monitor_registry *reg)
+{
+    return sizeof(struct monitor_registry_slot)
+	+ ((reg->rg_size + REGISTRY_ALIGN - 1) & ~((size_t) REGISTRY_ALIGN - 1));
+}
+
+/*
+ *  Returns the slot for index, or NULL if its chunk isn't mapped yet.
+ */
+static struct monitor_registry_slot *
+monitor_registry_slot(struct monitor_registry *reg, uint32_t index)
+{
+    char *chunk = __atomic_load_n(&reg->rg_chunk[index / MONITOR_REGISTRY_CHUNK_SIZE],
+				  __ATOMIC_ACQUIRE);
+
+    if (chunk == NULL) {
+	return NULL;
+    }
+
+    return (struct monitor_registry_slot *)
+	(chunk + (index % MONITOR_REGISTRY_CHUNK_SIZE) * monitor_registry_stride(reg));
+}
+
+/*
+ *  Make a new chunk available for index.  If two threads race to fill
+ *  the same slot, the loser unmaps its copy.
+ */
+static void
+monitor_registry_new_chunk(struct monitor_registry *reg, uint32_t index)
+{
+    uint32_t chunk = index / MONITOR_REGISTRY_CHUNK_SIZE;
+    size_t size = MONITOR_REGISTRY_CHUNK_SIZE * monitor_registry_stride(reg);
+
+    if (chunk >= MONITOR_REGISTRY_MAX_CHUNKS) {
+	errx(1, "out of registry slots: %u", index);
+    }
+
+    if (__atomic_load_n(&reg->rg_chunk[chunk], __ATOMIC_ACQUIRE) != NULL) {
+	return;
+    }
+
+    void * mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (mem == MAP_FAILED) {
+	err(1, "mmap for registry failed");
+    }
+
+    if (! __sync_bool_compare_and_swap(&reg->rg_chunk[chunk], NULL, mem)) {
+	munmap(mem, size);
+    }
+}
+
+/*
+ *  Get a record, first from the free list and else from the end of
+ *  the registry.
+ *
+ *  The free list head is (tag << 32) | (index + 1), where index + 1
+ *  == 0 means empty.  The tag changes on every update to avoid ABA
+ *  problems.
+ */
+void *
+monitor_registry_alloc(struct monitor_registry *reg)
+{
+    struct monitor_registry_slot *slot;
+    uint64_t old_head, new_head;
+    uint32_t index;
+
+    for (;;) {
+	old_head = __atomic_load_n(&reg->rg_free_head, __ATOMIC_ACQUIRE);
+	index = (uint32_t) old_head;
+
+	if (index == 0) {
+	    slot = NULL;
+	    break;
+	}
+
+	// if we lose the race, rs_next may be stale, but then the tag
+	// has changed and the CAS fails.
+	slot = monitor_registry_slot(reg, index - 1);
+	new_head = ((old_head >> 32) + 1) << 32
+	    | __atomic_load_n(&slot->rs_next, __ATOMIC_RELAXED);
+
+	if (__sync_bool_compare_and_swap(&reg->rg_free_head, old_head, new_head)) {
+	    break;
+	}
+    }
+
+    if (slot == NULL) {
+	index = __sync_fetch_and_add(&reg->rg_next_index, 1);
+
+	monitor_registry_new_chunk(reg, index);
+
+	slot = monitor_registry_slot(reg, index);
+	slot->rs_index = index;
+    }
+
+    memset(slot + 1, 0, reg->rg_size);
+    __atomic_store_n(&slot->rs_live, 1, __ATOMIC_RELEASE);
+
+    return slot + 1;
+}
+
+/*
+ *  Return a record to the free list.
+ */
+void
+monitor_registry_free(struct monitor_registry *reg, void *rec)
+{
+    struct monitor_registry_slot *slot = (struct monitor_registry_slot *) rec - 1;
+    uint64_t old_head, new_head;
+
+    __atomic_store_n(&slot->rs_live, 0, __ATOMIC_RELEASE);
+
+    do {
+	old_head = __atomic_load_n(&reg->rg_free_head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&slot->rs_next, (uint32_t) old_head, __ATOMIC_RELAXED);
+	new_head = ((old_head >> 32) + 1) << 32 | (slot->rs_index + 1);
+    }
+    while (! __sync_bool_compare_and_swap(&reg->rg_free_head, old_head, new_head));
+}
+
+/*
+ *  Returns the record at index, or NULL if it's free or out of range.
+ */
+void *
+monitor_registry_lookup(struct monitor_registry *reg, long index)
+{
+    struct monitor_registry_slot *slot;
+
+    if (index < 0 || index >= monitor_registry_size(reg)) {
+	return NULL;
+    }
+
+    slot = monitor_registry_slot(reg, (uint32_t) index);
+
+    if (slot == NULL || ! __atomic_load_n(&slot->rs_live, __ATOMIC_ACQUIRE)) {
+	return NULL;
+    }
+
+    return slot + 1;
+}
+
+long
+monitor_registry_index(struct monitor_registry *reg, void *rec)
+{
+    return ((struct monitor_registry_slot *) rec - 1)->rs_index;
+}
+
+/*
+ *  One more than the highest index ever allocated.
+ */
+long
+monitor_registry_size(struct monitor_registry *reg)
+{
+    return __atomic_load_n(&reg->rg_next_index, __ATOMIC_ACQUIRE);
+}
+
+//----------------------------------------------------------------------
+
+/*
+ *  Fill in the real pthread_create() and pthread_exit() for the table
+ *  of real functions.
+ */
+void
+monitor_real_init_pthread(struct monitor_real_fcns * table)
+{
+#if defined(MONITOR_PURE_PRELOAD) || defined(MONITOR_GOTCHA_PRELOAD)
+    pthread_create_fcn_t * real_pthread_create = NULL;
+    pthread_exit_fcn_t * real_pthread_exit = NULL;
+
+    GET_DLSYM_FUNC(real_pthread_create, "pthread_create");
+    GET_DLSYM_FUNC(real_pthread_exit, "pthread_exit");
+    table->mr_pthread_create = real_pthread_create;
+    table->mr_pthread_exit = real_pthread_exit;
+
+#elif defined(MONITOR_GOTCHA_LINK)
+    __atomic_store_n(&table->mr_pthread_create,
+	(pthread_create_fcn_t *) gotcha_get_wrappee(pthread_create_handle),
+	__ATOMIC_RELAXED);
+    __atomic_store_n(&table->mr_pthread_exit,
+	(pthread_exit_fcn_t *) gotcha_get_wrappee(pthread_exit_handle),
+	__ATOMIC_RELAXED);
+
 #else
-static pthread_create_fcn_t  * real_pthread_create;
+    table->mr_pthread_create = __real_pthread_create;
+    table->mr_pthread_exit = __real_pthread_exit;
 #endif
+}
+
+//----------------------------------------------------------------------
+
+/*
+ *  The client's view of the current thread's node.
+ */
+struct monitor_thread_info *
+monitor_get_thread_info(void)
+{
+    struct monitor_thread_node *tn = monitor_thread_self;
+
+    return (tn != NULL) ? &tn->tn_info : NULL;
+}
+
+/*
+ *  Each thread has one hazard pointer for lock-free readers (the load
+ *  map) to announce what they're using.  Returns NULL if the thread is
+ *  unknown to monitor.  Signal safe.
+ */
+void **
+monitor_thread_hazard(void)
+{
+    struct monitor_thread_node *tn = monitor_thread_self;
+
+    return (tn != NULL) ? &tn->tn_hazard : NULL;
+}
+
+/*
+ *  Wait until no thread's hazard pointer is ptr.  The caller must
+ *  have already unpublished ptr, so no new reader can pick it up.
+ */
+void
+monitor_thread_hazard_wait(void *ptr)
+{
+    long num = monitor_registry_size(&thread_node_registry);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&monitor_main_thread_node.tn_hazard, __ATOMIC_SEQ_CST) == ptr) {
+	sched_yield();
+    }
+
+    for (long index = 0; index < num; index++) {
+	struct monitor_thread_node *tn =
+	    monitor_registry_lookup(&thread_node_registry, index);
+
+	if (tn == NULL) {
+	    continue;
+	}
+
+	while (__atomic_load_n(&tn->tn_hazard, __ATOMIC_SEQ_CST) == ptr) {
+	    sched_yield();
+	}
+    }
+}
+
+/*
+ *  Set the context for the main thread, called from begin process.
+ */
+void
+monitor_thread_init_main(void)
+{
+    monitor_main_thread_node.tn_info.mti_thread_num = 0;
+    monitor_main_thread_node.tn_info.mti_client_data = NULL;
+
+    monitor_thread_self = &monitor_main_thread_node;
+}
+
+/*
+ *  Reset the thread state in a forked child, where the forking thread
+ *  is the only one.  Other threads' nodes go back to the registry, so
+ *  their hazard pointers don't block the load map.
+ */
+void
+monitor_thread_fork_child(void)
+{
+    struct monitor_thread_node *self = monitor_thread_self;
+    long num = monitor_registry_size(&thread_node_registry);
+
+    monitor_main_thread_node.tn_hazard = NULL;
+    for (long index = 0; index < num; index++) {
+	struct monitor_thread_node *tn =
+	    monitor_registry_lookup(&thread_node_registry, index);
+
+	if (tn != NULL && tn != self) {
+	    monitor_registry_free(&thread_node_registry, tn);
+	}
+    }
+
+    if (self == &monitor_main_thread_node) {
+	monitor_live_threads = 0;
+	monitor_main_exited = 0;
+    }
+    else {
+	monitor_live_threads = (self != NULL) ? 1 : 0;
+	monitor_main_exited = 1;
+    }
+}
+
+/*
+ *  If main has called pthread_exit() and this was the last thread,
+ *  then this is the end of the process.
+ */
+static void
+monitor_thread_finished(void)
+{
+    if (__atomic_sub_fetch(&monitor_live_threads, 1, __ATOMIC_SEQ_CST) == 0
+	&& __atomic_load_n(&monitor_main_exited, __ATOMIC_SEQ_CST)) {
+	monitor_end_process();
+    }
+}
+
+/*
+ *  Clear the context before the node goes back to the pool, so a late
+ *  signal sees NULL instead of a recycled node.
+ */
+static void
+monitor_thread_fini(struct monitor_thread_node *tn)
+{
+    monitor_thread_finished();
+
+    monitor_thread_self = NULL;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+    monitor_registry_free(&thread_node_registry, tn);
+}
 
 //----------------------------------------------------------------------
 
@@ -78,7 +439,13 @@ static pthread_create_fcn_t  * real_pthread_create;
 static void
 monitor_thread_cleanup_routine(void *arg)
 {
-    monitor_end_thread_cb();
+    uint64_t start = monitor_log_time();
+
+    monitor_cb_end_thread();
+
+    monitor_log_event(MONITOR_LOG_END_THREAD, start, NULL);
+
+    monitor_thread_fini((struct monitor_thread_node *) arg);
 }
 
 //----------------------------------------------------------------------
@@ -91,17 +458,30 @@ static void *
 monitor_thread_start_routine(void *arg)
 {
     struct monitor_thread_node *tn = (struct monitor_thread_node *) arg;
+    uint64_t start = monitor_log_time();
     void *ret;
 
-    monitor_begin_thread_cb();
+    tn->tn_info.mti_thread_num = __sync_fetch_and_add(&monitor_next_thread_num, 1);
+    tn->tn_info.mti_client_data = NULL;
+    monitor_thread_self = tn;
 
-    pthread_cleanup_push(monitor_thread_cleanup_routine, NULL);
+    monitor_cb_begin_thread();
+
+    monitor_log_event(MONITOR_LOG_BEGIN_THREAD, start, NULL);
+
+    pthread_cleanup_push(monitor_thread_cleanup_routine, tn);
 
     ret = (tn->tn_start_routine) (tn->tn_arg);
 
     pthread_cleanup_pop(0);
 
-    monitor_end_thread_cb();
+    start = monitor_log_time();
+
+    monitor_cb_end_thread();
+
+    monitor_log_event(MONITOR_LOG_END_THREAD, start, NULL);
+
+    monitor_thread_fini(tn);
 
     return ret;
 }
@@ -123,29 +503,81 @@ int __wrap_pthread_create
 
     monitor_first_entry();
 
-    struct monitor_thread_node *tn =
-	(struct monitor_thread_node *) malloc(sizeof(struct monitor_thread_node));
+    if (monitor_no_new_threads) {
+	return (MONITOR_REAL(pthread_create)) (thread, attr, start_routine, arg);
+    }
+
+    struct monitor_thread_node *tn = monitor_registry_alloc(&thread_node_registry);
 
     tn->tn_start_routine = start_routine;
     tn->tn_arg = arg;
 
-#if defined(MONITOR_PURE_PRELOAD) || defined(MONITOR_GOTCHA_PRELOAD)
-    GET_DLSYM_FUNC(real_pthread_create, "pthread_create");
-#endif
-
 #if defined(MONITOR_GOTCHA_PRELOAD) || defined(MONITOR_GOTCHA_LINK)
     monitor_gotcha_init();
 #endif
 
     monitor_try_begin_process();
 
-#if defined(MONITOR_STATIC)
-    ret = __real_pthread_create (thread, attr, &monitor_thread_start_routine, tn);
+    __atomic_add_fetch(&monitor_live_threads, 1, __ATOMIC_SEQ_CST);
+
+    uint64_t start = monitor_log_time();
+
+    ret = (MONITOR_REAL(pthread_create))
+	(thread, attr, &monitor_thread_start_routine, tn);
+
+    monitor_log_event(MONITOR_LOG_THREAD_CREATE, start, NULL);
+
+    if (ret != 0) {
+	__atomic_sub_fetch(&monitor_live_threads, 1, __ATOMIC_SEQ_CST);
+	monitor_registry_free(&thread_node_registry, tn);
+    }
+
+    return ret;
+}
+
+//----------------------------------------------------------------------
+
+void
+monitor_disable_new_threads(void)
+{
+    monitor_no_new_threads = 1;
+}
+
+void
+monitor_enable_new_threads(void)
+{
+    monitor_no_new_threads = 0;
+}
+
+//----------------------------------------------------------------------
+
+/*
+ *  Override pthread_exit().  In other threads, the cleanup routine
+ *  delivers end thread.  If main exits, the process continues until
+ *  the last thread finishes, so mark main as gone and deliver end
+ *  process now only if there are no other threads.
+ */
+#if defined(MONITOR_PURE_PRELOAD) || defined(MONITOR_GOTCHA_PRELOAD)
+void pthread_exit
 #else
-    ret = (* real_pthread_create) (thread, attr, &monitor_thread_start_routine, tn);
+void __wrap_pthread_exit
 #endif
+(void * retval)
+{
+    monitor_first_entry();
 
-    return ret;
+    if (monitor_thread_self == &monitor_main_thread_node) {
+	__atomic_store_n(&monitor_main_exited, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&monitor_live_threads, __ATOMIC_SEQ_CST) == 0) {
+	    monitor_end_process();
+	}
+    }
+
+    (MONITOR_REAL(pthread_exit)) (retval);
+
+    // not reached
+    __builtin_unreachable();
 }
 
 //----------------------------------------------------------------------
@@ -164,18 +596,19 @@ int __wrap_pthread_create
 
 static gotcha_binding_t thread_bindings [] = {
     { "pthread_create", __wrap_pthread_create, &pthread_create_handle },
+    { "pthread_exit",   __wrap_pthread_exit,   &pthread_exit_handle },
 };
 
 /*
- *  Gotcha wrap pthread_create().  This is too early for the other
- *  functions or for the begin process callback.
+ *  Gotcha wrap pthread_create() and pthread_exit().  This is too
+ *  early for the other functions or for the begin process callback.
+ *  Preinit functions get the same arguments as main.
  */
 void
-monitor_preinit_ctor(void)
+monitor_preinit_ctor(int argc, char ** argv, char ** envp)
 {
-    gotcha_wrap(thread_bindings, 1, "libmonitor");
-
-    real_pthread_create = (pthread_create_fcn_t *) gotcha_get_wrappee(pthread_create_handle);
+    monitor_gotcha_env(envp);
+    monitor_gotcha_wrap(thread_bindings, 2);
 }
 
 __attribute__ ((section(".preinit_array")))
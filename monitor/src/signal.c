@@ -0,0 +1,572 @@
+/*
+ *  Override sigaction(), signal(), sigprocmask() and pthread_sigmask().
+ *
+ *  Copyright (c) 2019-2020, Rice University.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of Rice University (RICE) nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  This software is provided by RICE and contributors "as is" and any
+ *  express or implied warranties, including, but not limited to, the
+ *  implied warranties of merchantability and fitness for a particular
+ *  purpose are disclaimed. In no event shall RICE or contributors be
+ *  liable for any direct, indirect, incidental, special, exemplary, or
+ *  consequential damages (including, but not limited to, procurement of
+ *  substitute goods or services; loss of use, data, or profits; or
+ *  business interruption) however caused and on any theory of liability,
+ *  whether in contract, strict liability, or tort (including negligence
+ *  or otherwise) arising in any way out of the use of this software, even
+ *  if advised of the possibility of such damage.
+ *
+ *  ----------------------------------------------------------------------
+ *
+ *  Client signals.  A client reserves a signal with
+ *  monitor_sigaction(), which installs our handler in the kernel.
+ *  After that, the application's sigaction() and signal() for that
+ *  signal only update the application's action in our table, and our
+ *  handler chains to it when the client declines the signal.
+ *
+ *  The application may not block a reserved signal.  sigprocmask(),
+ *  pthread_sigmask() and the sa_mask of the application's handlers
+ *  have the reserved signals removed.  Otherwise, a thread that
+ *  blocks everything would silently stop taking samples.
+ *
+ *  Unreserved signals take the fast path: one bit test and straight
+ *  through to the real function.
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(MONITOR_PURE_PRELOAD) || defined(MONITOR_GOTCHA_PRELOAD)
+#include <dlfcn.h>
+#endif
+#if defined(MONITOR_GOTCHA_LINK)
+#include <gotcha/gotcha.h>
+#endif
+
+#include "monitor-config.h"
+#include "monitor-common.h"
+#include "monitor.h"
+
+#define MONITOR_SIG_WORD_BITS  (8 * sizeof(unsigned long))
+#define MONITOR_SIG_WORDS  ((NSIG + MONITOR_SIG_WORD_BITS - 1) / MONITOR_SIG_WORD_BITS)
+
+/*
+ *  The application's action is a seqlock.  sigaction() writes it
+ *  under the table lock with ms_app_seq odd, and the handler copies
+ *  it without the lock and retries until ms_app_seq is the same even
+ *  number before and after.
+ */
+struct monitor_signal_entry {
+    monitor_sighandler_t * ms_client_handler;
+    struct sigaction  ms_kernel_act;
+    struct sigaction  ms_app_act;
+    unsigned long  ms_app_seq;
+};
+
+static struct monitor_signal_entry monitor_signal_table [NSIG];
+
+static unsigned long monitor_signal_reserved [MONITOR_SIG_WORDS];
+
+static int monitor_signal_list [NSIG];
+static int monitor_signal_num = 0;
+
+static int monitor_signal_lock = 0;
+
+#if defined(MONITOR_STATIC)
+extern sigaction_fcn_t    __real_sigaction;
+extern signal_fcn_t       __real_signal;
+extern sigprocmask_fcn_t  __real_sigprocmask;
+extern sigprocmask_fcn_t  __real_pthread_sigmask;
+#endif
+
+//----------------------------------------------------------------------
+
+static inline int
+monitor_signal_is_reserved(int sig)
+{
+    unsigned int s = (unsigned int) sig;
+
+    return s < NSIG
+	&& ((__atomic_load_n(&monitor_signal_reserved[s / MONITOR_SIG_WORD_BITS],
+			     __ATOMIC_ACQUIRE) >> (s % MONITOR_SIG_WORD_BITS)) & 1);
+}
+
+/*
+ *  Return set, or a copy of set in buf without the reserved signals.
+ *  Entries in the list are written before the count.
+ */
+static inline const sigset_t *
+monitor_signal_strip(const sigset_t * set, sigset_t * buf)
+{
+    int num = __atomic_load_n(&monitor_signal_num, __ATOMIC_ACQUIRE);
+
+    if (set == NULL || num == 0) {
+	return set;
+    }
+
+    *buf = *set;
+    for (int i = 0; i < num; i++) {
+	sigdelset(buf, monitor_signal_list[i]);
+    }
+
+    return buf;
+}
+
+/*
+ *  The table lock is a spin lock held with all signals blocked, so
+ *  it's safe to take from a handler (including ours when it resets
+ *  an SA_RESETHAND action).
+ */
+static void
+monitor_signal_lock_acquire(sigset_t * oldset)
+{
+    sigset_t all;
+
+    sigfillset(&all);
+    (MONITOR_REAL(pthread_sigmask)) (SIG_SETMASK, &all, oldset);
+
+    while (__sync_lock_test_and_set(&monitor_signal_lock, 1)) {
+	while (__atomic_load_n(&monitor_signal_lock, __ATOMIC_RELAXED))
+	    ;
+    }
+}
+
+static void
+monitor_signal_lock_release(sigset_t * oldset)
+{
+    __sync_lock_release(&monitor_signal_lock);
+
+    (MONITOR_REAL(pthread_sigmask)) (SIG_SETMASK, oldset, NULL);
+}
+
+/*
+ *  Get and/or set the application's action for a reserved signal.
+ */
+static void
+monitor_signal_app_action(int sig, const struct sigaction * act,
+			  struct sigaction * oldact)
+{
+    struct monitor_signal_entry * ent = &monitor_signal_table[sig];
+    sigset_t oldset;
+
+    monitor_signal_lock_acquire(&oldset);
+
+    if (oldact != NULL) {
+	*oldact = ent->ms_app_act;
+    }
+    if (act != NULL) {
+	unsigned long seq = ent->ms_app_seq;
+
+	__atomic_store_n(&ent->ms_app_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	ent->ms_app_act = *act;
+	__atomic_store_n(&ent->ms_app_seq, seq + 2, __ATOMIC_RELEASE);
+    }
+
+    monitor_signal_lock_release(&oldset);
+}
+
+/*
+ *  Copy the application's action from the handler.  The writer has
+ *  all signals blocked, so it's never interrupted by a handler in
+ *  its own thread and the retry loop is short.
+ */
+static void
+monitor_signal_app_copy(struct monitor_signal_entry * ent, struct sigaction * act)
+{
+    for (;;) {
+	unsigned long seq = __atomic_load_n(&ent->ms_app_seq, __ATOMIC_ACQUIRE);
+
+	if ((seq & 1) == 0) {
+	    *act = ent->ms_app_act;
+	    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+	    if (__atomic_load_n(&ent->ms_app_seq, __ATOMIC_RELAXED) == seq) {
+		return;
+	    }
+	}
+    }
+}
+
+//----------------------------------------------------------------------
+
+/*
+ *  The application's action is SIG_DFL.  Ignore the signals whose
+ *  default is to ignore.  For a fault from the kernel, reset to the
+ *  default and return, and the fault recurs.  Otherwise, reset and
+ *  raise the signal again, and if we come back (a stop signal), put
+ *  our handler back.
+ */
+static void
+monitor_signal_default(int sig, siginfo_t * info)
+{
+    struct monitor_signal_entry * ent = &monitor_signal_table[sig];
+    struct sigaction dfl;
+    sigset_t set;
+
+    if (sig == SIGCHLD || sig == SIGCONT || sig == SIGURG || sig == SIGWINCH) {
+	return;
+    }
+
+    memset(&dfl, 0, sizeof(dfl));
+    sigemptyset(&dfl.sa_mask);
+    dfl.sa_handler = SIG_DFL;
+    (MONITOR_REAL(sigaction)) (sig, &dfl, NULL);
+
+    if (info != NULL && info->si_code > 0
+	&& (sig == SIGSEGV || sig == SIGBUS || sig == SIGILL
+	    || sig == SIGFPE || sig == SIGTRAP)) {
+	return;
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, sig);
+    (MONITOR_REAL(pthread_sigmask)) (SIG_UNBLOCK, &set, NULL);
+    raise(sig);
+
+    (MONITOR_REAL(sigaction)) (sig, &ent->ms_kernel_act, NULL);
+}
+
+/*
+ *  Run the application's action with its mask, less the reserved
+ *  signals, as the kernel would have.
+ */
+static void
+monitor_signal_chain(int sig, siginfo_t * info, void * context)
+{
+    struct monitor_signal_entry * ent = &monitor_signal_table[sig];
+    struct sigaction act;
+    sigset_t mask, oldset;
+
+    monitor_signal_app_copy(ent, &act);
+
+    if (! (act.sa_flags & SA_SIGINFO)) {
+	if (act.sa_handler == SIG_IGN) {
+	    return;
+	}
+	if (act.sa_handler == SIG_DFL) {
+	    monitor_signal_default(sig, info);
+	    return;
+	}
+    }
+
+    if (act.sa_flags & SA_RESETHAND) {
+	struct sigaction dfl;
+
+	memset(&dfl, 0, sizeof(dfl));
+	sigemptyset(&dfl.sa_mask);
+	dfl.sa_handler = SIG_DFL;
+	monitor_signal_app_action(sig, &dfl, NULL);
+    }
+
+    // the stored action keeps the app's mask, strip it here
+    mask = *monitor_signal_strip(&act.sa_mask, &mask);
+    if (! (act.sa_flags & SA_NODEFER)) {
+	sigaddset(&mask, sig);
+    }
+    (MONITOR_REAL(pthread_sigmask)) (SIG_BLOCK, &mask, &oldset);
+
+    if (act.sa_flags & SA_SIGINFO) {
+	(* act.sa_sigaction) (sig, info, context);
+    }
+    else {
+	(* act.sa_handler) (sig);
+    }
+
+    (MONITOR_REAL(pthread_sigmask)) (SIG_SETMASK, &oldset, NULL);
+}
+
+/*
+ *  Our handler for all reserved signals.  The client handler returns
+ *  0 if it handled the signal, or non-zero to pass it on to the
+ *  application.
+ */
+static void
+monitor_signal_handler(int sig, siginfo_t * info, void * context)
+{
+    monitor_sighandler_t * handler =
+	__atomic_load_n(&monitor_signal_table[sig].ms_client_handler,
+			__ATOMIC_ACQUIRE);
+    int save_errno = errno;
+
+    if (handler == NULL || (* handler) (sig, info, context) != 0) {
+	monitor_signal_chain(sig, info, context);
+    }
+
+    errno = save_errno;
+}
+
+//----------------------------------------------------------------------
+
+/*
+ *  Reserve sig for the client and install handler.  The sa_mask and
+ *  the SA_RESTART and SA_NODEFER flags from act (if not NULL) are
+ *  used for our handler.  Our handler is always SA_ONSTACK, since we
+ *  chain to the application's handler on the same stack and it may
+ *  rely on sigaltstack() (eg, for stack overflow).  Without an
+ *  alternate stack, SA_ONSTACK has no effect.  The application's
+ *  current action becomes the one to chain to, and sig is unblocked
+ *  in the calling thread.  Flags is unused and should be 0.
+ *
+ *  Calling this again for the same signal replaces the handler.
+ */
+int
+monitor_sigaction(int sig, monitor_sighandler_t * handler, int flags,
+		  struct sigaction * act)
+{
+    struct monitor_signal_entry * ent;
+    struct sigaction kact;
+    sigset_t oldset;
+    int ret;
+
+    if (sig <= 0 || sig >= NSIG || sig == SIGKILL || sig == SIGSTOP
+	|| handler == NULL) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    memset(&kact, 0, sizeof(kact));
+    kact.sa_sigaction = monitor_signal_handler;
+    if (act != NULL) {
+	kact.sa_mask = act->sa_mask;
+	kact.sa_flags = act->sa_flags & (SA_RESTART | SA_NODEFER);
+    }
+    else {
+	sigemptyset(&kact.sa_mask);
+	kact.sa_flags = SA_RESTART;
+    }
+    kact.sa_flags |= SA_SIGINFO | SA_ONSTACK;
+
+    ent = &monitor_signal_table[sig];
+
+    monitor_signal_lock_acquire(&oldset);
+
+    __atomic_store_n(&ent->ms_client_handler, handler, __ATOMIC_RELEASE);
+    ent->ms_kernel_act = kact;
+
+    if (! monitor_signal_is_reserved(sig)) {
+	(MONITOR_REAL(sigaction)) (sig, NULL, &ent->ms_app_act);
+
+	monitor_signal_list[monitor_signal_num] = sig;
+	__atomic_store_n(&monitor_signal_num, monitor_signal_num + 1,
+			 __ATOMIC_RELEASE);
+	__atomic_or_fetch(&monitor_signal_reserved[sig / MONITOR_SIG_WORD_BITS],
+			  1UL << (sig % MONITOR_SIG_WORD_BITS), __ATOMIC_SEQ_CST);
+    }
+
+    ret = (MONITOR_REAL(sigaction)) (sig, &kact, NULL);
+
+    // the mask may be inherited across exec, unblock sig here
+    sigdelset(&oldset, sig);
+    monitor_signal_lock_release(&oldset);
+
+    return ret;
+}
+
+/*
+ *  The real mask functions, for a client that needs to block its own
+ *  signals.
+ */
+int
+monitor_real_sigprocmask(int how, const sigset_t * set, sigset_t * oldset)
+{
+    return (MONITOR_REAL(sigprocmask)) (how, set, oldset);
+}
+
+int
+monitor_real_pthread_sigmask(int how, const sigset_t * set, sigset_t * oldset)
+{
+    return (MONITOR_REAL(pthread_sigmask)) (how, set, oldset);
+}
+
+/*
+ *  The child of fork has only the forking thread, which doesn't hold
+ *  the lock, but some other thread may have, and may have been in the
+ *  middle of writing an application action.  Make the seq even so
+ *  the handler doesn't spin on it.
+ */
+void
+monitor_signal_fork_child(void)
+{
+    for (int i = 0; i < monitor_signal_num; i++) {
+	struct monitor_signal_entry * ent = &monitor_signal_table[monitor_signal_list[i]];
+
+	ent->ms_app_seq &= ~1UL;
+    }
+
+    __sync_lock_release(&monitor_signal_lock);
+}
+
+//----------------------------------------------------------------------
+
+#if defined(MONITOR_GOTCHA_LINK)
+
+int __wrap_sigaction (int, const struct sigaction *, struct sigaction *);
+sig_handler_fcn_t * __wrap_signal (int, sig_handler_fcn_t *);
+int __wrap_sigprocmask (int, const sigset_t *, sigset_t *);
+int __wrap_pthread_sigmask (int, const sigset_t *, sigset_t *);
+
+static gotcha_wrappee_handle_t sigaction_handle;
+static gotcha_wrappee_handle_t signal_handle;
+static gotcha_wrappee_handle_t sigprocmask_handle;
+static gotcha_wrappee_handle_t pthread_sigmask_handle;
+
+static gotcha_binding_t signal_bindings [] = {
+    { "sigaction",       __wrap_sigaction,       &sigaction_handle },
+    { "signal",          __wrap_signal,          &signal_handle },
+    { "sigprocmask",     __wrap_sigprocmask,     &sigprocmask_handle },
+    { "pthread_sigmask", __wrap_pthread_sigmask, &pthread_sigmask_handle },
+};
+
+/*
+ *  Gotcha wrap the signal functions for the gotcha link case.  This
+ *  is already serialized from gotcha-init.
+ */
+void
+monitor_gotcha_init_signal(void)
+{
+    monitor_gotcha_wrap(signal_bindings,
+			sizeof(signal_bindings) / sizeof(signal_bindings[0]));
+}
+#endif
+
+void
+monitor_real_init_signal(struct monitor_real_fcns * table)
+{
+#if defined(MONITOR_PURE_PRELOAD) || defined(MONITOR_GOTCHA_PRELOAD)
+    sigaction_fcn_t   * real_sigaction = NULL;
+    signal_fcn_t      * real_signal = NULL;
+    sigprocmask_fcn_t * real_sigprocmask = NULL;
+    sigprocmask_fcn_t * real_pthread_sigmask = NULL;
+
+    GET_DLSYM_FUNC(real_sigaction, "sigaction");
+    GET_DLSYM_FUNC(real_signal, "signal");
+    GET_DLSYM_FUNC(real_sigprocmask, "sigprocmask");
+    GET_DLSYM_FUNC(real_pthread_sigmask, "pthread_sigmask");
+
+    table->mr_sigaction = real_sigaction;
+    table->mr_signal = real_signal;
+    table->mr_sigprocmask = real_sigprocmask;
+    table->mr_pthread_sigmask = real_pthread_sigmask;
+
+#elif defined(MONITOR_GOTCHA_LINK)
+    __atomic_store_n(&table->mr_sigaction,
+	(sigaction_fcn_t *) gotcha_get_wrappee(sigaction_handle),
+	__ATOMIC_RELAXED);
+    __atomic_store_n(&table->mr_signal,
+	(signal_fcn_t *) gotcha_get_wrappee(signal_handle),
+	__ATOMIC_RELAXED);
+    __atomic_store_n(&table->mr_sigprocmask,
+	(sigprocmask_fcn_t *) gotcha_get_wrappee(sigprocmask_handle),
+	__ATOMIC_RELAXED);
+    __atomic_store_n(&table->mr_pthread_sigmask,
+	(sigprocmask_fcn_t *) gotcha_get_wrappee(pthread_sigmask_handle),
+	__ATOMIC_RELAXED);
+
+#else
+    table->mr_sigaction = __real_sigaction;
+    table->mr_signal = __real_signal;
+    table->mr_sigprocmask = __real_sigprocmask;
+    table->mr_pthread_sigmask = __real_pthread_sigmask;
+#endif
+}
+
+//----------------------------------------------------------------------
+
+/*
+ *  Override sigaction().  For a reserved signal, get and set the
+ *  application's action in our table.  Otherwise, pass it through,
+ *  but don't let the handler's mask block a reserved signal.
+ */
+int
+MONITOR_WRAP_NAME(sigaction)
+  (int sig, const struct sigaction * act, struct sigaction * oldact)
+{
+    struct sigaction copy;
+
+    if (! monitor_signal_is_reserved(sig)) {
+	if (act != NULL
+	    && __atomic_load_n(&monitor_signal_num, __ATOMIC_RELAXED) > 0) {
+	    copy = *act;
+	    monitor_signal_strip(&act->sa_mask, &copy.sa_mask);
+	    act = &copy;
+	}
+	return (MONITOR_REAL(sigaction)) (sig, act, oldact);
+    }
+
+    monitor_signal_app_action(sig, act, oldact);
+
+    return 0;
+}
+
+/*
+ *  Override signal(), with the glibc (BSD) semantics: the handler
+ *  stays installed and system calls are restarted.
+ */
+sig_handler_fcn_t *
+MONITOR_WRAP_NAME(signal) (int sig, sig_handler_fcn_t * handler)
+{
+    struct sigaction act, oldact;
+
+    if (! monitor_signal_is_reserved(sig)) {
+	return (MONITOR_REAL(signal)) (sig, handler);
+    }
+
+    memset(&act, 0, sizeof(act));
+    sigemptyset(&act.sa_mask);
+    act.sa_handler = handler;
+    act.sa_flags = SA_RESTART;
+
+    monitor_signal_app_action(sig, &act, &oldact);
+
+    return oldact.sa_handler;
+}
+
+/*
+ *  Override sigprocmask() and pthread_sigmask().  Unblocking is
+ *  always fine, blocking or setting the mask has the reserved
+ *  signals removed.
+ */
+int
+MONITOR_WRAP_NAME(sigprocmask)
+  (int how, const sigset_t * set, sigset_t * oldset)
+{
+    sigset_t buf;
+
+    if (how != SIG_UNBLOCK) {
+	set = monitor_signal_strip(set, &buf);
+    }
+
+    return (MONITOR_REAL(sigprocmask)) (how, set, oldset);
+}
+
+int
+MONITOR_WRAP_NAME(pthread_sigmask)
+  (int how, const sigset_t * set, sigset_t * oldset)
+{
+    sigset_t buf;
+
+    if (how != SIG_UNBLOCK) {
+	set = monitor_signal_strip(set, &buf);
+    }
+
+    return (MONITOR_REAL(pthread_sigmask)) (how, set, oldset);
+}
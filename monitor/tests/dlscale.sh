@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+#  Copyright (c) 2019-2020, Rice University.
+#  See the file LICENSE for details.
+#
+#  Run dlstress for a range of thread counts, without libmonitor and
+#  with the pure preload and gotcha preload libraries, and append the
+#  results to one CSV file.
+#
+#  Usage: dlscale.sh [-o file.csv] [-t secs] [-T "1 2 4 ..."] [-p]
+#             <monitor-build-src-dir>
+#
+#    -o  output file (default: dlscale.csv)
+#    -t  program time per run in seconds (default: 4)
+#    -T  list of thread counts (default: 1 2 4 ... 128)
+#    -p  pin threads to cpus
+#
+
+die()
+{
+    echo "$0: error: $*" 1>&2
+    exit 1
+}
+
+out=dlscale.csv
+secs=4
+threads="1 2 4 8 16 32 64 128"
+pin=
+
+while test "x$1" != x
+do
+    case "$1" in
+	-o ) out="$2" ; shift ; shift ;;
+	-t ) secs="$2" ; shift ; shift ;;
+	-T ) threads="$2" ; shift ; shift ;;
+	-p ) pin=pin ; shift ;;
+	-* ) die "unknown option: $1" ;;
+	* )  break ;;
+    esac
+done
+
+test "x$1" != x || die "missing monitor build directory"
+build="$1"
+
+pure_preload="${build}/.libs/libmonitor-pure-preload.so"
+preload="${build}/.libs/libmonitor-preload.so"
+
+test -f "$pure_preload" || die "unable to find: $pure_preload"
+test -f "$preload" || die "unable to find: $preload"
+
+rm -f "$out"
+
+for num in $threads
+do
+    echo "threads: $num"
+
+    ./dlstress $secs threads=$num $pin quiet label=none csv="$out" >/dev/null \
+	|| die "dlstress failed"
+
+    LD_PRELOAD="$pure_preload" \
+	./dlstress $secs threads=$num $pin quiet label=pure-preload csv="$out" >/dev/null \
+	|| die "dlstress failed with pure preload"
+
+    LD_PRELOAD="$preload" \
+	./dlstress $secs threads=$num $pin quiet label=gotcha-preload csv="$out" >/dev/null \
+	|| die "dlstress failed with gotcha preload"
+done
+
+# summary: total calls per second for the whole process
+echo
+grep ',all,' "$out" | awk -F, '{ printf "%-16s threads: %4s  %-8s  %10.1f per sec   mean: %10.1f ns\n", $1, $2, $5, $12, $7 }'
@@ -35,41 +35,83 @@
  *
  * ----------------------------------------------------------------------
  *
- *  This program runs one or two threads and runs a loop of dlopen(),
- *  dlclose and optionally dlsym in each thread.  This is a stress
- *  test for hpcrun designed to cause trouble with the dlopen reader-
- *  writer lock and dl_iterate_phdr().
+ *  This program runs N threads and runs a loop of dlopen(), dlclose
+ *  and optionally dlsym in each thread.  This is a stress test for
+ *  hpcrun and libmonitor designed to cause trouble with the dlopen
+ *  reader-writer lock and dl_iterate_phdr(), and to measure how the
+ *  loader lock and the wrappers scale with the number of threads.
  *
- *  Usage:  dlstress [ <program-time> | mult | single | nosym ]*
+ *  Each call is timed and kept in a per-thread latency histogram.
+ *  At the end, we print a summary of count, mean and percentiles per
+ *  thread and per function, and optionally write it as CSV or JSON.
+ *
+ *  Usage:  dlstress [ <program-time> | mult | single | nosym | pin
+ *                     | threads=N | libdir=PATH | label=NAME
+ *                     | csv=FILE | json=FILE | quiet ]*
  *
  *   program-time -- program time in seconds
  *   mult   -- run with multiple (2) threads
  *   single -- run with single (1) thread
  *   nosym  -- do not call dlsym()
+ *   pin    -- pin thread k to the k-th allowed cpu (mod num cpus)
+ *   threads=N  -- run with N threads
+ *   libdir=PATH -- directory to search for libraries
+ *   label=NAME -- label for the csv/json rows (default: the name
+ *                 of the monitor mode, or 'none')
+ *   csv=FILE   -- append the summary to FILE as CSV
+ *   json=FILE  -- write the summary to FILE as JSON
+ *   quiet  -- no once a second progress lines
+ *
+ *  Use dlscale.sh to run a range of threads with and without
+ *  libmonitor.
  */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/time.h>
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <glob.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <dlfcn.h>
 #include <pthread.h>
 
-#define LIB_DIR  "/usr/lib64"
-
 #define MAX_LIBS  100
+#define MAX_THREADS  1024
 #define NUM_SUM_FUNCS  20
 #define PROGRAM_TIME  8
 
+#define BILLION  1000000000L
+
+/*
+ *  Latency histogram: 4 buckets per power of 2 of nanoseconds.
+ */
+#define HIST_SUB   4
+#define HIST_SIZE  (64 * HIST_SUB)
+
+enum { OP_DLOPEN = 0, OP_DLSYM, OP_DLCLOSE, NUM_OPS };
+
+const char *op_name[NUM_OPS] = { "dlopen", "dlsym", "dlclose" };
+
 typedef double (sum_func_t) (long);
 
+char *lib_dirs[] = {
+    "/usr/lib64",
+    "/usr/lib/x86_64-linux-gnu",
+    "/usr/lib/aarch64-linux-gnu",
+    "/usr/lib/powerpc64le-linux-gnu",
+    "/usr/lib",
+    NULL,
+};
+
 char *base[MAX_LIBS] = {
     "libICE",
     "libOpenGL",
@@ -103,23 +145,122 @@ char *name[MAX_LIBS] = {
     NULL,
 };
 
+struct histogram {
+    long  count;
+    long  sum;
+    long  max;
+    long  bucket[HIST_SIZE];
+};
+
 struct thread_args {
-    char *label;
+    char label[32];
     int  index;
     int  start;
     int  len;
+    pthread_t td;
+    struct histogram hist[NUM_OPS];
 };
 
+struct thread_args *thread_args;
+
 int num_libs = 0;
 
 int program_time;
-int mult_thread;
+int num_threads;
 int do_dlsym;
+int do_pin;
+int quiet;
+
+char *lib_dir = NULL;
+char *label = NULL;
+char *csv_file = NULL;
+char *json_file = NULL;
 
 struct timeval start;
 
 //----------------------------------------------------------------------
 
+long
+now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return BILLION * ts.tv_sec + ts.tv_nsec;
+}
+
+int
+hist_index(long ns)
+{
+    if (ns < HIST_SUB) {
+	return (ns < 0) ? 0 : ns;
+    }
+
+    int log = 63 - __builtin_clzl(ns);
+    int sub = (ns >> (log - 2)) & (HIST_SUB - 1);
+
+    return HIST_SUB * (log - 1) + sub;
+}
+
+long
+hist_value(int index)
+{
+    if (index < HIST_SUB) {
+	return index;
+    }
+
+    int log = index / HIST_SUB + 1;
+    int sub = index % HIST_SUB;
+
+    return (HIST_SUB + sub) * (1L << (log - 2));
+}
+
+void
+hist_add(struct histogram *hist, long ns)
+{
+    hist->count++;
+    hist->sum += ns;
+    if (ns > hist->max) {
+	hist->max = ns;
+    }
+    hist->bucket[hist_index(ns)]++;
+}
+
+void
+hist_merge(struct histogram *dest, struct histogram *src)
+{
+    dest->count += src->count;
+    dest->sum += src->sum;
+    if (src->max > dest->max) {
+	dest->max = src->max;
+    }
+    for (int k = 0; k < HIST_SIZE; k++) {
+	dest->bucket[k] += src->bucket[k];
+    }
+}
+
+/*
+ *  Return the lower bound of the bucket containing the given
+ *  percentile.
+ */
+long
+hist_percentile(struct histogram *hist, int pct)
+{
+    long target = (hist->count * pct + 99) / 100;
+    long total = 0;
+
+    for (int k = 0; k < HIST_SIZE; k++) {
+	total += hist->bucket[k];
+	if (total >= target && total > 0) {
+	    return hist_value(k);
+	}
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------
+
 /*
  * Create name[] array from base names.  Resolve version names by
  * taking the longest file name matching the glob pattern.
@@ -132,11 +273,25 @@ mk_lib_array(void)
     char patn[500];
     int i, j;
 
-    printf("searching for libs ...\n");
+    if (lib_dir == NULL) {
+	for (i = 0; lib_dirs[i] != NULL; i++) {
+	    sprintf(patn, "%s/libm.so*", lib_dirs[i]);
+	    if (glob(patn, 0, NULL, &globbuf) == 0) {
+		globfree(&globbuf);
+		lib_dir = lib_dirs[i];
+		break;
+	    }
+	}
+	if (lib_dir == NULL) {
+	    errx(1, "unable to find lib directory, use libdir=PATH");
+	}
+    }
+
+    printf("searching for libs in %s ...\n", lib_dir);
 
     num_libs = 0;
     for (i = 0; base[i] != NULL; i++) {
-	sprintf(patn, "%s/%s.so*", LIB_DIR, base[i]);
+	sprintf(patn, "%s/%s.so*", lib_dir, base[i]);
 
 	int ret = glob(patn, 0, NULL, &globbuf);
 
@@ -180,31 +335,82 @@ mk_lib_array(void)
 //----------------------------------------------------------------------
 
 /*
- * Main thread uses name[0, ..., N/2 - 1], side thread uses N/2 ... N - 1,
- * where N = num_libs.
+ * Thread k uses a window of N/T libraries (at least 4), starting at
+ * k * N/T and wrapping around, where N = num_libs and T = num
+ * threads.  With 2 threads, this is the old main/side split.
  */
 void
-mk_thread_args(struct thread_args * main_args, struct thread_args * side_args)
+mk_thread_args(void)
 {
     if (num_libs < 8) {
 	errx(1, "not enough available libraries");
     }
 
-    main_args->label = "main";
-    main_args->index = 1;
-    main_args->start = 0;
-    main_args->len = num_libs/2;
+    thread_args = calloc(num_threads, sizeof(struct thread_args));
+    if (thread_args == NULL) {
+	err(1, "calloc failed");
+    }
+
+    int len = num_libs / num_threads;
+    if (len < 4) {
+	len = 4;
+    }
+
+    for (int k = 0; k < num_threads; k++) {
+	struct thread_args *args = &thread_args[k];
 
-    side_args->label = "side";
-    side_args->index = 2;
-    side_args->start = num_libs/2;
-    side_args->len = num_libs - main_args->len;
+	if (k == 0) {
+	    strcpy(args->label, "main");
+	}
+	else {
+	    sprintf(args->label, "side %d", k);
+	}
+	args->index = (k % 2) + 1;
+	args->start = ((long) k * num_libs / num_threads) % num_libs;
+	args->len = (k == num_threads - 1 && num_threads > 1)
+	    ? num_libs - args->start : len;
+	if (args->len < 4) {
+	    args->len = 4;
+	}
+    }
+}
+
+//----------------------------------------------------------------------
+
+void
+pin_thread(int k)
+{
+    cpu_set_t allowed, set;
+    int num = 0, cpu;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+	warn("sched_getaffinity failed");
+	return;
+    }
+
+    int target = k % CPU_COUNT(&allowed);
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	if (CPU_ISSET(cpu, &allowed)) {
+	    if (num == target) {
+		break;
+	    }
+	    num++;
+	}
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+	warnx("unable to pin thread %d to cpu %d", k, cpu);
+    }
 }
 
 //----------------------------------------------------------------------
 
 /*
- * Main loop of dlopen(), dlclose and dlsym run by both threads.
+ * Main loop of dlopen(), dlclose and dlsym run by all threads.
  * Report on the number of calls.
  */
 void
@@ -212,7 +418,7 @@ do_loop(struct thread_args * args)
 {
     struct timeval now, last;
     void * handle[MAX_LIBS];
-    long num;
+    long num, t0;
 
     long cur_open = 0;
     long cur_sym = 0;
@@ -221,6 +427,10 @@ do_loop(struct thread_args * args)
     long total_err = 0;
     long num_open = 0;
 
+    if (do_pin) {
+	pin_thread(args - thread_args);
+    }
+
     last = start;
 
     for (num = 1;; num++)
@@ -232,7 +442,9 @@ do_loop(struct thread_args * args)
 	 * always go to the same address.
 	 */
 	for (k = 0; k < num_open; k++) {
-	    handle[k] = dlopen(name[args->start + k], RTLD_LAZY);
+	    t0 = now_nsec();
+	    handle[k] = dlopen(name[(args->start + k) % num_libs], RTLD_LAZY);
+	    hist_add(&args->hist[OP_DLOPEN], now_nsec() - t0);
 	    if (handle[k] == NULL) {
 		total_err++;
 	    }
@@ -246,14 +458,24 @@ do_loop(struct thread_args * args)
 	     */
 	    char buf[500];
 	    sprintf(buf, "./libsum%d.so", args->index);
+	    t0 = now_nsec();
 	    void *sum_handle = dlopen(buf, RTLD_LAZY);
+	    hist_add(&args->hist[OP_DLOPEN], now_nsec() - t0);
+
+	    if (sum_handle == NULL) {
+		errx(1, "unable to open %s", buf);
+	    }
 
 	    for (k = 0; k < NUM_SUM_FUNCS; k++) {
 		sprintf(buf, "sum_%d_%d", args->index, k);
+		t0 = now_nsec();
 		sum_func_t * sum_func = dlsym(sum_handle, buf);
+		hist_add(&args->hist[OP_DLSYM], now_nsec() - t0);
 		sum += (* sum_func) (5000);
 	    }
+	    t0 = now_nsec();
 	    dlclose(sum_handle);
+	    hist_add(&args->hist[OP_DLCLOSE], now_nsec() - t0);
 
 	    cur_open += 1;
 	    total_open += 1;
@@ -274,7 +496,9 @@ do_loop(struct thread_args * args)
 	 */
 	for (k = num_open - 1; k >= 0; k--) {
 	    if (handle[k] != NULL) {
+		t0 = now_nsec();
 		dlclose(handle[k]);
+		hist_add(&args->hist[OP_DLCLOSE], now_nsec() - t0);
 	    }
 	}
 
@@ -283,17 +507,21 @@ do_loop(struct thread_args * args)
         gettimeofday(&now, NULL);
 
         if (now.tv_sec > last.tv_sec) {
-            printf("%s:  time: %3ld   dlopen: %6ld  (%ld)   dlsym: %6ld  (%ld)"
-		   "   err: %ld   sum = %g\n",
-                   args->label, now.tv_sec - start.tv_sec, cur_open, total_open,
-		   cur_sym, total_sym, total_err, sum);
+	    if (! quiet) {
+		printf("%s:  time: %3ld   dlopen: %6ld  (%ld)   dlsym: %6ld  (%ld)"
+		       "   err: %ld   sum = %g\n",
+		       args->label, now.tv_sec - start.tv_sec, cur_open, total_open,
+		       cur_sym, total_sym, total_err, sum);
+	    }
             last = now;
 	    cur_open = 0;
 	    cur_sym = 0;
         }
 
         if (now.tv_sec >= start.tv_sec + program_time) {
-	    printf("%s:  done\n", args->label);
+	    if (! quiet) {
+		printf("%s:  done\n", args->label);
+	    }
             break;
         }
     }
@@ -310,35 +538,164 @@ side_thread(void *data)
 
 //----------------------------------------------------------------------
 
+/*
+ * Print one row per thread per function, plus 'all' rows for the
+ * whole process, as text and optionally CSV and JSON.
+ */
+void
+print_summary(void)
+{
+    struct histogram total[NUM_OPS];
+    FILE *csv = NULL, *json = NULL;
+    int first = 1;
+
+    memset(total, 0, sizeof(total));
+
+    if (csv_file != NULL) {
+	csv = fopen(csv_file, "a");
+	if (csv == NULL) {
+	    err(1, "unable to open: %s", csv_file);
+	}
+	if (ftell(csv) == 0) {
+	    fprintf(csv, "label,threads,pin,thread,func,count,mean_ns,"
+		    "p50_ns,p90_ns,p99_ns,max_ns,per_sec\n");
+	}
+    }
+    if (json_file != NULL) {
+	json = fopen(json_file, "w");
+	if (json == NULL) {
+	    err(1, "unable to open: %s", json_file);
+	}
+	fprintf(json, "{\n  \"label\": \"%s\",\n  \"threads\": %d,\n"
+		"  \"pin\": %d,\n  \"time\": %d,\n  \"rows\": [\n",
+		label, num_threads, do_pin, program_time);
+    }
+
+    printf("\n%-8s %-8s %10s %10s %10s %10s %10s %10s\n",
+	   "thread", "func", "count", "mean ns", "p50 ns", "p90 ns",
+	   "p99 ns", "max ns");
+
+    for (int k = 0; k <= num_threads; k++) {
+	for (int op = 0; op < NUM_OPS; op++) {
+	    struct histogram *hist;
+	    char thread[32];
+
+	    if (k < num_threads) {
+		hist = &thread_args[k].hist[op];
+		hist_merge(&total[op], hist);
+		sprintf(thread, "%d", k);
+	    }
+	    else {
+		hist = &total[op];
+		strcpy(thread, "all");
+	    }
+
+	    if (hist->count == 0) {
+		continue;
+	    }
+
+	    double mean = (double) hist->sum / hist->count;
+	    long p50 = hist_percentile(hist, 50);
+	    long p90 = hist_percentile(hist, 90);
+	    long p99 = hist_percentile(hist, 99);
+	    double rate = (double) hist->count / program_time;
+
+	    if (k == num_threads || num_threads <= 8) {
+		printf("%-8s %-8s %10ld %10.0f %10ld %10ld %10ld %10ld\n",
+		       thread, op_name[op], hist->count, mean, p50, p90,
+		       p99, hist->max);
+	    }
+	    if (csv != NULL) {
+		fprintf(csv, "%s,%d,%d,%s,%s,%ld,%.1f,%ld,%ld,%ld,%ld,%.1f\n",
+			label, num_threads, do_pin, thread, op_name[op],
+			hist->count, mean, p50, p90, p99, hist->max, rate);
+	    }
+	    if (json != NULL) {
+		fprintf(json, "%s    {\"thread\": \"%s\", \"func\": \"%s\", "
+			"\"count\": %ld, \"mean_ns\": %.1f, \"p50_ns\": %ld, "
+			"\"p90_ns\": %ld, \"p99_ns\": %ld, \"max_ns\": %ld, "
+			"\"per_sec\": %.1f}",
+			first ? "" : ",\n", thread, op_name[op], hist->count,
+			mean, p50, p90, p99, hist->max, rate);
+		first = 0;
+	    }
+	}
+    }
+
+    if (csv != NULL) {
+	fclose(csv);
+    }
+    if (json != NULL) {
+	fprintf(json, "\n  ]\n}\n");
+	fclose(json);
+    }
+}
+
+//----------------------------------------------------------------------
+
 /*
  * Args:
  *  program-time  (in seconds),
- *  'mult', 'single', 'nosym'.
+ *  'mult', 'single', 'nosym', 'pin', 'quiet',
+ *  'threads=N', 'libdir=PATH', 'label=NAME', 'csv=FILE', 'json=FILE'.
  */
 void
 parse_args(int argc, char **argv)
 {
     program_time = PROGRAM_TIME;
-    mult_thread = 1;
+    num_threads = 2;
     do_dlsym = 1;
+    do_pin = 0;
+    quiet = 0;
 
     for (int k = 1; k < argc; k++) {
 	if (isdigit(argv[k][0])) {
 	    program_time = atoi(argv[k]);
 	}
+	else if (strncmp(argv[k], "threads=", 8) == 0) {
+	    num_threads = atoi(argv[k] + 8);
+	}
+	else if (strncmp(argv[k], "libdir=", 7) == 0) {
+	    lib_dir = argv[k] + 7;
+	}
+	else if (strncmp(argv[k], "label=", 6) == 0) {
+	    label = argv[k] + 6;
+	}
+	else if (strncmp(argv[k], "csv=", 4) == 0) {
+	    csv_file = argv[k] + 4;
+	}
+	else if (strncmp(argv[k], "json=", 5) == 0) {
+	    json_file = argv[k] + 5;
+	}
 	else if (strncmp(argv[k], "multiple", 4) == 0) {
-	    mult_thread = 1;
+	    num_threads = 2;
 	}
 	else if (strncmp(argv[k], "single", 4) == 0) {
-	    mult_thread = 0;
+	    num_threads = 1;
 	}
 	else if (strncmp(argv[k], "nosym", 4) == 0) {
 	    do_dlsym = 0;
 	}
+	else if (strcmp(argv[k], "pin") == 0) {
+	    do_pin = 1;
+	}
+	else if (strcmp(argv[k], "quiet") == 0) {
+	    quiet = 1;
+	}
 	else {
 	    errx(1, "unknown flag: %s", argv[k]);
 	}
     }
+
+    if (num_threads < 1 || num_threads > MAX_THREADS) {
+	errx(1, "number of threads must be 1 to %d", MAX_THREADS);
+    }
+
+    // default label is whether we're running under libmonitor
+    if (label == NULL) {
+	label = (dlsym(RTLD_DEFAULT, "monitor_get_thread_info") != NULL)
+	    ? "monitor" : "none";
+    }
 }
 
 //----------------------------------------------------------------------
@@ -346,36 +703,38 @@ parse_args(int argc, char **argv)
 int
 main(int argc, char **argv)
 {
-    struct thread_args main_args, side_args;
-    pthread_t td;
-
     parse_args(argc, argv);
 
     printf("dlstress: loop of dlopen, dlclose and dlsym\n"
-	   "program time: %d  %s thread,  %s\n\n",
-	   program_time,
-	   (mult_thread) ? "mult" : "single",
-	   (do_dlsym) ? "with dlsym" : "no dlsym");
+	   "program time: %d  threads: %d  %s,  %s,  %s\n\n",
+	   program_time, num_threads,
+	   (do_pin) ? "pinned" : "not pinned",
+	   (do_dlsym) ? "with dlsym" : "no dlsym", label);
 
     mk_lib_array();
 
-    mk_thread_args(&main_args, &side_args);
+    mk_thread_args();
 
     gettimeofday(&start, NULL);
 
-    if (mult_thread) {
-	if (pthread_create(&td, NULL, side_thread, &side_args) != 0) {
+    for (int k = 1; k < num_threads; k++) {
+	if (pthread_create(&thread_args[k].td, NULL, side_thread,
+			   &thread_args[k]) != 0) {
 	    err(1, "pthread_create failed");
 	}
     }
 
-    do_loop(&main_args);
+    do_loop(&thread_args[0]);
 
-    if (mult_thread) {
+    if (num_threads > 1) {
 	printf("waiting on pthread_join ...\n");
-	pthread_join(td, NULL);
+	for (int k = 1; k < num_threads; k++) {
+	    pthread_join(thread_args[k].td, NULL);
+	}
     }
 
+    print_summary();
+
     printf("done\n");
 
     return 0;
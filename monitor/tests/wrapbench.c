@@ -0,0 +1,312 @@
+/*
+ *  Copyright (c) 2019-2020, Rice University.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of Rice University (RICE) nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  This software is provided by RICE and contributors "as is" and any
+ *  express or implied warranties, including, but not limited to, the
+ *  implied warranties of merchantability and fitness for a particular
+ *  purpose are disclaimed. In no event shall RICE or contributors be
+ *  liable for any direct, indirect, incidental, special, exemplary, or
+ *  consequential damages (including, but not limited to, procurement of
+ *  substitute goods or services; loss of use, data, or profits; or
+ *  business interruption) however caused and on any theory of liability,
+ *  whether in contract, strict liability, or tort (including negligence
+ *  or otherwise) arising in any way out of the use of this software, even
+ *  if advised of the possibility of such damage.
+ *
+ * ----------------------------------------------------------------------
+ *
+ *  Measure the cost of the functions that libmonitor wraps.  Each
+ *  call is timed separately and the program prints one CSV line per
+ *  test with ns/call percentiles.
+ *
+ *  Usage:  wrapbench [-m mode] [-n iters] [-l lib.so] test ...
+ *
+ *   mode  -- label for the first column (default: baseline)
+ *   iters -- number of timed calls per test
+ *   lib   -- library for the dlopen test (default: libsum1.so)
+ *
+ *  Tests:
+ *   thread  -- pthread_create() and pthread_join() of an empty thread
+ *   dlopen  -- dlopen() and dlclose() of a library that is already
+ *              open, so the time is mostly the wrapper and not the
+ *              loader
+ *   startup -- exec this program and time from just before execve()
+ *              to the start of main()
+ *
+ *  Run under each libmonitor build mode with wrapbench.sh.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dlfcn.h>
+#include <pthread.h>
+
+#define DEFAULT_ITERS  2000
+#define STARTUP_ITERS   200
+#define DEFAULT_LIB  "./libsum1.so"
+
+#define T0_VAR  "WRAPBENCH_T0"
+#define FD_VAR  "WRAPBENCH_FD"
+
+#define BILLION  1000000000L
+
+char *mode_name = "baseline";
+char *lib_name = DEFAULT_LIB;
+long  num_iters = 0;
+
+//----------------------------------------------------------------------
+
+long
+now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return BILLION * ts.tv_sec + ts.tv_nsec;
+}
+
+int
+cmp_long(const void *p1, const void *p2)
+{
+    long x = * (const long *) p1;
+    long y = * (const long *) p2;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ *  Sort the times and print:
+ *  mode,test,iters,min,p50,p90,p99,max,mean
+ */
+void
+report(const char *test, long *times, long num)
+{
+    double sum = 0.0;
+    long k;
+
+    qsort(times, num, sizeof(long), cmp_long);
+
+    for (k = 0; k < num; k++) {
+	sum += (double) times[k];
+    }
+
+    printf("%s,%s,%ld,%ld,%ld,%ld,%ld,%ld,%.1f\n",
+	   mode_name, test, num, times[0],
+	   times[(num * 50) / 100], times[(num * 90) / 100],
+	   times[(num * 99) / 100], times[num - 1], sum / num);
+    fflush(stdout);
+}
+
+//----------------------------------------------------------------------
+
+void *
+empty_thread(void *arg)
+{
+    return arg;
+}
+
+void
+test_thread(long num)
+{
+    long *times = malloc(num * sizeof(long));
+    pthread_t td;
+    long k;
+
+    if (times == NULL) {
+	err(1, "malloc failed");
+    }
+
+    for (k = 0; k < num; k++) {
+	long start = now_nsec();
+
+	if (pthread_create(&td, NULL, empty_thread, NULL) != 0) {
+	    errx(1, "pthread_create failed");
+	}
+	pthread_join(td, NULL);
+
+	times[k] = now_nsec() - start;
+    }
+
+    report("thread", times, num);
+    free(times);
+}
+
+//----------------------------------------------------------------------
+
+void
+test_dlopen(long num)
+{
+    long *times = malloc(num * sizeof(long));
+    long k;
+
+    if (times == NULL) {
+	err(1, "malloc failed");
+    }
+
+    // hold one reference, so the loop does not map and unmap the
+    // library every time.
+    void *keep = dlopen(lib_name, RTLD_LAZY);
+    if (keep == NULL) {
+	errx(1, "dlopen failed: %s", dlerror());
+    }
+
+    for (k = 0; k < num; k++) {
+	long start = now_nsec();
+
+	void *handle = dlopen(lib_name, RTLD_LAZY);
+	dlclose(handle);
+
+	times[k] = now_nsec() - start;
+    }
+
+    dlclose(keep);
+
+    report("dlopen", times, num);
+    free(times);
+}
+
+//----------------------------------------------------------------------
+
+/*
+ *  Exec ourself num times with the start time in the environment.
+ *  The child reports the elapsed time over a pipe at the start of
+ *  main() and exits.
+ */
+void
+test_startup(long num)
+{
+    long *times = malloc(num * sizeof(long));
+    char t0_str[50], fd_str[50];
+    int fds[2];
+    long k;
+
+    if (times == NULL) {
+	err(1, "malloc failed");
+    }
+
+    for (k = 0; k < num; k++) {
+	if (pipe(fds) != 0) {
+	    err(1, "pipe failed");
+	}
+
+	pid_t pid = fork();
+
+	if (pid < 0) {
+	    err(1, "fork failed");
+	}
+	if (pid == 0) {
+	    close(fds[0]);
+	    sprintf(fd_str, "%d", fds[1]);
+	    sprintf(t0_str, "%ld", now_nsec());
+	    setenv(FD_VAR, fd_str, 1);
+	    setenv(T0_VAR, t0_str, 1);
+	    execl("/proc/self/exe", "wrapbench", (char *) NULL);
+	    err(1, "exec failed");
+	}
+
+	close(fds[1]);
+
+	long delta = -1;
+	if (read(fds[0], &delta, sizeof(delta)) != sizeof(delta)) {
+	    errx(1, "startup child did not report");
+	}
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+
+	times[k] = delta;
+    }
+
+    report("startup", times, num);
+    free(times);
+}
+
+//----------------------------------------------------------------------
+
+void
+usage(void)
+{
+    errx(1, "usage: wrapbench [-m mode] [-n iters] [-l lib.so] "
+	 "thread | dlopen | startup ...");
+}
+
+int
+main(int argc, char **argv)
+{
+    char *t0_str = getenv(T0_VAR);
+    int k;
+
+    // startup child: report and exit
+    if (t0_str != NULL) {
+	long delta = now_nsec() - atol(t0_str);
+	int fd = atoi(getenv(FD_VAR));
+
+	if (write(fd, &delta, sizeof(delta)) != sizeof(delta)) {
+	    _exit(1);
+	}
+	_exit(0);
+    }
+
+    for (k = 1; k < argc && argv[k][0] == '-'; k++) {
+	if (k + 1 >= argc) {
+	    usage();
+	}
+	if (strcmp(argv[k], "-m") == 0) {
+	    mode_name = argv[++k];
+	}
+	else if (strcmp(argv[k], "-n") == 0) {
+	    num_iters = atol(argv[++k]);
+	}
+	else if (strcmp(argv[k], "-l") == 0) {
+	    lib_name = argv[++k];
+	}
+	else {
+	    usage();
+	}
+    }
+
+    if (k >= argc) {
+	usage();
+    }
+
+    for (; k < argc; k++) {
+	if (strcmp(argv[k], "thread") == 0) {
+	    test_thread(num_iters > 0 ? num_iters : DEFAULT_ITERS);
+	}
+	else if (strcmp(argv[k], "dlopen") == 0) {
+	    test_dlopen(num_iters > 0 ? num_iters : DEFAULT_ITERS);
+	}
+	else if (strcmp(argv[k], "startup") == 0) {
+	    test_startup(num_iters > 0 ? num_iters : STARTUP_ITERS);
+	}
+	else {
+	    usage();
+	}
+    }
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+#  Copyright (c) 2019-2020, Rice University.
+#  See the file LICENSE for details.
+#
+#  Run wrapbench for an unwrapped baseline and for each of the four
+#  libmonitor build modes, and write one CSV table.
+#
+#  Usage: wrapbench.sh [-o file.csv] [-n iters] <monitor-build-src-dir>
+#
+#  where <monitor-build-src-dir> is the src directory of the libmonitor
+#  build tree (with .libs/libmonitor-preload.so, etc).  Run 'make
+#  bench' from the top of the build tree to build and run everything.
+#
+
+die()
+{
+    echo "$0: error: $*" 1>&2
+    exit 1
+}
+
+out=
+iters=
+
+while test "x$1" != x
+do
+    case "$1" in
+	-o ) out="$2" ; shift ; shift ;;
+	-n ) iters="-n $2" ; shift ; shift ;;
+	-* ) die "unknown option: $1" ;;
+	* )  break ;;
+    esac
+done
+
+test "x$1" != x || die "missing monitor build directory"
+build="$1"
+
+pure_preload="${build}/.libs/libmonitor-pure-preload.so"
+preload="${build}/.libs/libmonitor-preload.so"
+
+test -f "$pure_preload" || die "unable to find: $pure_preload"
+test -f "$preload" || die "unable to find: $preload"
+
+# the commit of the source tree, we may run in the build tree
+srcdir=`dirname "$0"`
+commit=`cd "$srcdir" && git rev-parse --short HEAD 2>/dev/null`
+test "x$commit" != x || commit=unknown
+
+tests="thread dlopen startup"
+lib="`pwd`/libsum1.so"
+
+run()
+{
+    "$@" | sed -e "s/^/${commit},/"
+}
+
+results()
+{
+    echo "commit,mode,test,iters,min_ns,p50_ns,p90_ns,p99_ns,max_ns,mean_ns"
+
+    run ./wrapbench -m baseline $iters -l "$lib" $tests
+
+    LD_PRELOAD="$pure_preload" \
+	run ./wrapbench -m pure-preload $iters -l "$lib" $tests
+
+    LD_PRELOAD="$preload" \
+	run ./wrapbench -m gotcha-preload $iters -l "$lib" $tests
+
+    run ./wrapbench-link -m gotcha-link $iters -l "$lib" $tests
+
+    # the static case does not wrap dlopen
+    run ./wrapbench-static -m static $iters -l "$lib" $tests
+}
+
+if test "x$out" != x ; then
+    results | tee "$out"
+else
+    results
+fi